@@ -0,0 +1,110 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/*
+ * Audio packet decryption as raop_buffer did it before and after keeping
+ * one AES-CBC context per session: a context created and destroyed per
+ * packet, one context with only the IV reset, and the same in batches.
+ * All three have to produce the same plaintext.
+ *
+ * Usage: bench_aes_cbc [packets] [payload bytes]
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "crypto.h"
+
+#define BENCH_BATCH 32
+
+/* Decrypts count independent packets, each one starting from the initial IV */
+static void
+bench_decrypt_batch(aes_ctx_t *ctx, const uint8_t *const *in, uint8_t *const *out, const int *len, int count)
+{
+    for (int i = 0; i < count; i++) {
+        aes_cbc_reset_iv(ctx, NULL);
+        aes_cbc_decrypt(ctx, in[i], out[i], len[i]);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int packets = argc > 1 ? atoi(argv[1]) : 100000;
+    int payload = argc > 2 ? atoi(argv[2]) : 352;
+    unsigned char key[16], iv[16];
+    unsigned char *input, *expected, *output;
+    uint64_t start, per_packet, shared, batched;
+    int len = payload / 16 * 16;
+
+    if (packets <= 0 || len <= 0) {
+        fprintf(stderr, "usage: %s [packets] [payload bytes]\n", argv[0]);
+        return 2;
+    }
+    input = malloc((size_t) packets * len);
+    expected = malloc((size_t) packets * len);
+    output = malloc((size_t) packets * len);
+    if (!input || !expected || !output) {
+        return 2;
+    }
+    bench_fill(key, sizeof(key), 1);
+    bench_fill(iv, sizeof(iv), 2);
+    bench_fill(input, (size_t) packets * len, 3);
+
+    /* Before: a new context, and so a new key schedule, for every packet */
+    start = bench_now_ns();
+    for (int i = 0; i < packets; i++) {
+        aes_ctx_t *ctx = aes_cbc_init(key, iv, AES_DECRYPT);
+        aes_cbc_decrypt(ctx, input + (size_t) i * len, expected + (size_t) i * len, len);
+        aes_cbc_destroy(ctx);
+    }
+    per_packet = bench_now_ns() - start;
+
+    /* After: one context for the session, the IV reloaded per packet */
+    aes_ctx_t *ctx = aes_cbc_init(key, iv, AES_DECRYPT);
+    start = bench_now_ns();
+    for (int i = 0; i < packets; i++) {
+        aes_cbc_reset_iv(ctx, NULL);
+        aes_cbc_decrypt(ctx, input + (size_t) i * len, output + (size_t) i * len, len);
+    }
+    shared = bench_now_ns() - start;
+    int shared_ok = !memcmp(expected, output, (size_t) packets * len);
+
+    memset(output, 0, (size_t) packets * len);
+    start = bench_now_ns();
+    for (int i = 0; i < packets; i += BENCH_BATCH) {
+        const uint8_t *in[BENCH_BATCH];
+        uint8_t *out[BENCH_BATCH];
+        int lens[BENCH_BATCH];
+        int count = packets - i < BENCH_BATCH ? packets - i : BENCH_BATCH;
+        for (int j = 0; j < count; j++) {
+            in[j] = input + (size_t) (i + j) * len;
+            out[j] = output + (size_t) (i + j) * len;
+            lens[j] = len;
+        }
+        bench_decrypt_batch(ctx, in, out, lens, count);
+    }
+    batched = bench_now_ns() - start;
+    int batched_ok = !memcmp(expected, output, (size_t) packets * len);
+    aes_cbc_destroy(ctx);
+
+    printf("%d packets of %d bytes\n", packets, len);
+    printf("context per packet  %8.1f ns/packet\n", (double) per_packet / packets);
+    printf("shared context      %8.1f ns/packet  %s\n", (double) shared / packets, shared_ok ? "same output" : "OUTPUT DIFFERS");
+    printf("batched             %8.1f ns/packet  %s\n", (double) batched / packets, batched_ok ? "same output" : "OUTPUT DIFFERS");
+
+    free(input);
+    free(expected);
+    free(output);
+    return shared_ok && batched_ok ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/*
+ * Mirror frame decryption throughput of mirror_buffer_decrypt, swept over
+ * frame size against the number of threads splitting each frame. Frame
+ * lengths are not multiples of the AES block, so every frame starts and
+ * ends mid-block and goes through the og / nextDecryptCount carry. Every
+ * run has to reproduce the whole stream decrypted serially in one call.
+ *
+ * Usage: bench_mirror_decrypt [megabytes per run]
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "mirror_buffer.h"
+
+/* MIRROR_BUFFER_MAX_WORKERS workers plus the calling thread */
+#define BENCH_MAX_THREADS 5
+
+static const int bench_frame_sizes[] = { 16 * 1024, 128 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+#define BENCH_FRAME_SIZES (int) (sizeof(bench_frame_sizes) / sizeof(bench_frame_sizes[0]))
+
+static mirror_buffer_t *
+bench_mirror_buffer(logger_t *logger, int threads)
+{
+    unsigned char aeskey[16], ecdh_secret[32];
+    bench_fill(aeskey, sizeof(aeskey), 1);
+    bench_fill(ecdh_secret, sizeof(ecdh_secret), 2);
+
+    mirror_buffer_t *mirror_buffer = mirror_buffer_init(logger, aeskey, ecdh_secret);
+    if (mirror_buffer) {
+        mirror_buffer_set_threads(mirror_buffer, threads);
+        mirror_buffer_init_aes(mirror_buffer, 0x1234567890ull);
+    }
+    return mirror_buffer;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    size_t total = (size_t) megabytes * 1024 * 1024;
+    unsigned char *input, *expected, *output;
+    int failed = 0;
+
+    if (megabytes <= 0) {
+        fprintf(stderr, "usage: %s [megabytes per run]\n", argv[0]);
+        return 2;
+    }
+    /* Room for the largest frame past the end, the stream is cut wherever the frames end */
+    input = malloc(total + bench_frame_sizes[BENCH_FRAME_SIZES - 1] + 16);
+    expected = malloc(total + bench_frame_sizes[BENCH_FRAME_SIZES - 1] + 16);
+    output = malloc(total + bench_frame_sizes[BENCH_FRAME_SIZES - 1] + 16);
+    if (!input || !expected || !output) {
+        return 2;
+    }
+    bench_fill(input, total + bench_frame_sizes[BENCH_FRAME_SIZES - 1] + 16, 3);
+
+    logger_t *logger = logger_init();
+
+    /* Reference: the whole stream at once, on the calling thread only */
+    mirror_buffer_t *mirror_buffer = bench_mirror_buffer(logger, 1);
+    if (!mirror_buffer) {
+        return 2;
+    }
+    memcpy(expected, input, total + bench_frame_sizes[BENCH_FRAME_SIZES - 1] + 16);
+    mirror_buffer_decrypt(mirror_buffer, expected, (int) (total + bench_frame_sizes[BENCH_FRAME_SIZES - 1] + 16));
+    mirror_buffer_destroy(mirror_buffer);
+
+    printf("%d MB per run, MB/s by frame size and decrypting threads\n", megabytes);
+    printf("%10s", "frame");
+    for (int threads = 1; threads <= BENCH_MAX_THREADS; threads++) {
+        printf("  %7d", threads);
+    }
+    printf("\n");
+
+    for (int s = 0; s < BENCH_FRAME_SIZES; s++) {
+        printf("%9dK", bench_frame_sizes[s] / 1024);
+        for (int threads = 1; threads <= BENCH_MAX_THREADS; threads++) {
+            mirror_buffer = bench_mirror_buffer(logger, threads);
+            if (!mirror_buffer) {
+                return 2;
+            }
+            memcpy(output, input, total + bench_frame_sizes[BENCH_FRAME_SIZES - 1] + 16);
+
+            size_t offset = 0;
+            int frame = 0;
+            uint64_t start = bench_now_ns();
+            while (offset < total) {
+                /* Odd lengths around the nominal size keep every frame boundary off the block grid */
+                int len = bench_frame_sizes[s] + 1 + (frame++ * 7) % 15;
+                mirror_buffer_decrypt(mirror_buffer, output + offset, len);
+                offset += len;
+            }
+            uint64_t elapsed = bench_now_ns() - start;
+            mirror_buffer_destroy(mirror_buffer);
+
+            int same = !memcmp(expected, output, offset);
+            printf("  %6.0f%c", (double) offset / (1024 * 1024) / (elapsed / 1e9), same ? ' ' : '!');
+            failed |= !same;
+        }
+        printf("\n");
+    }
+    if (failed) {
+        printf("runs marked ! differ from serial decryption\n");
+    }
+
+    logger_destroy(logger);
+    free(input);
+    free(expected);
+    free(output);
+    return failed;
+}
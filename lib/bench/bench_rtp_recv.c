@@ -0,0 +1,263 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/*
+ * Packets per second the audio receive loop can take from a UDP socket,
+ * as raop_rtp_thread_udp did it before and after moving to epoll and
+ * recvmmsg: select and one recvfrom per datagram, against epoll_wait and
+ * batches of RAOP_RTP_RECV_BATCH. Sender threads flood the loopback, and
+ * once they outrun the receiver, so that packets get dropped, the receive
+ * rate is the ceiling. Add senders until that happens.
+ *
+ * Usage: bench_rtp_recv [packets per sender] [payload bytes] [senders]
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For recvmmsg and sendmmsg */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "raop_rtp.h"
+
+/* RAOP_RTP_RECV_BATCH of the receive loop in raop_rtp.c */
+#define BENCH_RECV_BATCH 16
+#define BENCH_SEND_BATCH 64
+#define BENCH_IDLE_MS 5
+#define BENCH_MAX_SENDERS 16
+
+typedef struct bench_sender_s {
+    struct sockaddr_in addr;
+    int packets;
+    int payload;
+    /* Senders still running */
+    atomic_int running;
+} bench_sender_t;
+
+typedef struct bench_result_s {
+    int received;
+    int syscalls;
+    uint64_t elapsed_ns;
+} bench_result_t;
+
+static void *
+bench_send(void *arg)
+{
+    bench_sender_t *sender = arg;
+    struct mmsghdr msgs[BENCH_SEND_BATCH];
+    struct iovec iovs[BENCH_SEND_BATCH];
+    unsigned char *packets = calloc(BENCH_SEND_BATCH, sender->payload);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sock != -1 && packets) {
+        for (int sent = 0; sent < sender->packets;) {
+            int count = sender->packets - sent < BENCH_SEND_BATCH ? sender->packets - sent : BENCH_SEND_BATCH;
+            for (int i = 0; i < count; i++) {
+                unsigned char *packet = packets + (size_t) i * sender->payload;
+                packet[2] = (sent + i) >> 8;
+                packet[3] = sent + i;
+                iovs[i].iov_base = packet;
+                iovs[i].iov_len = sender->payload;
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &sender->addr;
+                msgs[i].msg_hdr.msg_namelen = sizeof(sender->addr);
+            }
+            int ret = sendmmsg(sock, msgs, count, 0);
+            if (ret < 0 && errno != ENOBUFS && errno != EAGAIN) {
+                break;
+            }
+            sent += ret > 0 ? ret : 0;
+        }
+    }
+    if (sock != -1) close(sock);
+    free(packets);
+    atomic_fetch_sub(&sender->running, 1);
+    return NULL;
+}
+
+/* Before: select with a timeout, then a single recvfrom */
+static void
+bench_recv_select(int sock, bench_sender_t *sender, bench_result_t *result)
+{
+    unsigned char packet[RAOP_PACKET_LEN];
+    uint64_t first = 0, last = 0;
+
+    for (;;) {
+        struct timeval tv = { 0, BENCH_IDLE_MS * 1000 };
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(sock, &rfds);
+        result->syscalls++;
+        int ret = select(sock + 1, &rfds, NULL, NULL, &tv);
+        if (ret == 0) {
+            if (!atomic_load(&sender->running)) break;
+            continue;
+        } else if (ret < 0) {
+            break;
+        }
+        struct sockaddr_storage saddr;
+        socklen_t saddrlen = sizeof(saddr);
+        result->syscalls++;
+        if (recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr *) &saddr, &saddrlen) > 0) {
+            last = bench_now_ns();
+            if (!first) first = last;
+            result->received++;
+        }
+    }
+    result->elapsed_ns = last - first;
+}
+
+/* After: epoll_wait, then recvmmsg until the socket is drained */
+static void
+bench_recv_batch(int sock, bench_sender_t *sender, bench_result_t *result)
+{
+    unsigned char *slab = malloc((size_t) BENCH_RECV_BATCH * RAOP_PACKET_LEN);
+    struct mmsghdr msgs[BENCH_RECV_BATCH];
+    struct iovec iovs[BENCH_RECV_BATCH];
+    struct sockaddr_storage saddrs[BENCH_RECV_BATCH];
+    struct epoll_event ev;
+    uint64_t first = 0, last = 0;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    if (!slab || epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        goto exit;
+    }
+    for (;;) {
+        result->syscalls++;
+        int nfds = epoll_wait(epfd, &ev, 1, BENCH_IDLE_MS);
+        if (nfds == 0) {
+            if (!atomic_load(&sender->running)) break;
+            continue;
+        } else if (nfds < 0) {
+            break;
+        }
+        int count;
+        do {
+            for (int i = 0; i < BENCH_RECV_BATCH; i++) {
+                iovs[i].iov_base = slab + (size_t) i * RAOP_PACKET_LEN;
+                iovs[i].iov_len = RAOP_PACKET_LEN;
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &saddrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(saddrs[i]);
+            }
+            result->syscalls++;
+            count = recvmmsg(sock, msgs, BENCH_RECV_BATCH, MSG_DONTWAIT, NULL);
+            if (count > 0) {
+                last = bench_now_ns();
+                if (!first) first = last;
+                result->received += count;
+            }
+        } while (count == BENCH_RECV_BATCH);
+    }
+
+    exit:
+    result->elapsed_ns = last - first;
+    if (epfd != -1) close(epfd);
+    free(slab);
+}
+
+static int
+bench_run(const char *name, void (*receive)(int, bench_sender_t *, bench_result_t *),
+          int packets, int payload, int senders)
+{
+    bench_sender_t sender;
+    bench_result_t result;
+    socklen_t addrlen = sizeof(sender.addr);
+    int rcvbuf = 4 * 1024 * 1024;
+    pthread_t threads[BENCH_MAX_SENDERS];
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    memset(&sender, 0, sizeof(sender));
+    sender.addr.sin_family = AF_INET;
+    sender.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (bind(sock, (struct sockaddr *) &sender.addr, sizeof(sender.addr)) == -1 ||
+        getsockname(sock, (struct sockaddr *) &sender.addr, &addrlen) == -1) {
+        close(sock);
+        return -1;
+    }
+    sender.packets = packets;
+    sender.payload = payload;
+    atomic_init(&sender.running, senders);
+    memset(&result, 0, sizeof(result));
+
+    for (int i = 0; i < senders; i++) {
+        pthread_create(&threads[i], NULL, bench_send, &sender);
+    }
+    receive(sock, &sender, &result);
+    for (int i = 0; i < senders; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    close(sock);
+
+    double seconds = result.elapsed_ns ? result.elapsed_ns / 1e9 : 1e-9;
+    printf("%-18s %10.0f packets/s  %5.2f syscalls/packet  %d of %d received\n", name,
+           result.received / seconds, result.received ? (double) result.syscalls / result.received : 0.0,
+           result.received, packets * senders);
+    return result.received ? 0 : -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int packets = argc > 1 ? atoi(argv[1]) : 500000;
+    int payload = argc > 2 ? atoi(argv[2]) : 1036;
+    int senders = argc > 3 ? atoi(argv[3]) : 2;
+
+    if (packets <= 0 || payload < 12 || payload > RAOP_PACKET_LEN || senders <= 0 || senders > BENCH_MAX_SENDERS) {
+        fprintf(stderr, "usage: %s [packets per sender] [payload bytes] [senders]\n", argv[0]);
+        return 2;
+    }
+    printf("%d senders of %d packets of %d bytes over loopback\n", senders, packets, payload);
+    if (bench_run("select + recvfrom", bench_recv_select, packets, payload, senders) < 0 ||
+        bench_run("epoll + recvmmsg", bench_recv_batch, packets, payload, senders) < 0) {
+        fprintf(stderr, "nothing was received\n");
+        return 1;
+    }
+    return 0;
+}
+
+#else
+
+int
+main(int argc, char *argv[])
+{
+    fprintf(stderr, "%s needs recvmmsg, which is only available on Linux\n", argv[0]);
+    return 2;
+}
+
+#endif
@@ -34,6 +34,7 @@ struct aes_ctx_s {
     uint8_t iv[AES_128_BLOCK_SIZE];
     aes_direction_t direction;
     uint8_t block_offset;
+    uint64_t position;
 };
 
 uint8_t waste[AES_128_BLOCK_SIZE];
@@ -54,6 +55,7 @@ aes_ctx_t *aes_init(const uint8_t *key, const uint8_t *iv, const EVP_CIPHER *typ
     assert(ctx->cipher_ctx != NULL);
 
     ctx->block_offset = 0;
+    ctx->position = 0;
     ctx->direction = direction;
 
     if (direction == AES_ENCRYPT) {
@@ -128,6 +130,7 @@ aes_ctx_t *aes_ctr_init(const uint8_t *key, const uint8_t *iv) {
 void aes_ctr_encrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len) {
     aes_encrypt(ctx, in, out, len);
     ctx->block_offset = (ctx->block_offset + len) % AES_128_BLOCK_SIZE;
+    ctx->position += len;
 }
 
 void aes_ctr_start_fresh_block(aes_ctx_t *ctx) {
@@ -138,10 +141,37 @@ void aes_ctr_start_fresh_block(aes_ctx_t *ctx) {
 
 void aes_ctr_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len) {
     aes_encrypt(ctx, in, out, len);
+    ctx->position += len;
+}
+
+uint64_t aes_ctr_get_position(aes_ctx_t *ctx) {
+    return ctx->position;
+}
+
+void aes_ctr_set_position(aes_ctx_t *ctx, uint64_t position) {
+    assert(position % AES_128_BLOCK_SIZE == 0);
+
+    // The counter is the IV plus the block number, as a 128 bit big endian integer
+    uint8_t counter[AES_128_BLOCK_SIZE];
+    uint64_t blocks = position / AES_128_BLOCK_SIZE;
+    memcpy(counter, ctx->iv, AES_128_BLOCK_SIZE);
+    for (int i = AES_128_BLOCK_SIZE - 1; i >= 0 && blocks; i--) {
+        unsigned int sum = counter[i] + (unsigned int) (blocks & 0xff);
+        counter[i] = (uint8_t) sum;
+        blocks = (blocks >> 8) + (sum >> 8);
+    }
+    // A NULL cipher and key only reloads the counter, the expanded key is kept
+    if (!EVP_EncryptInit_ex(ctx->cipher_ctx, NULL, NULL, NULL, counter)) {
+        handle_error(__func__);
+    }
+    ctx->block_offset = 0;
+    ctx->position = position;
 }
 
 void aes_ctr_reset(aes_ctx_t *ctx) {
     aes_reset(ctx, EVP_aes_128_ctr(), AES_ENCRYPT);
+    ctx->block_offset = 0;
+    ctx->position = 0;
 }
 
 void aes_ctr_destroy(aes_ctx_t *ctx) {
@@ -165,7 +195,17 @@ void aes_cbc_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len) {
 }
 
 void aes_cbc_reset(aes_ctx_t *ctx) {
-    aes_reset(ctx, EVP_aes_128_ctr(), ctx->direction);
+    aes_reset(ctx, EVP_aes_128_cbc(), ctx->direction);
+}
+
+void aes_cbc_reset_iv(aes_ctx_t *ctx, const uint8_t *iv) {
+    if (iv) {
+        memcpy(ctx->iv, iv, AES_128_BLOCK_SIZE);
+    }
+    // A NULL cipher and key only reloads the IV, the expanded key is kept
+    if (!EVP_CipherInit_ex(ctx->cipher_ctx, NULL, NULL, NULL, ctx->iv, -1)) {
+        handle_error(__func__);
+    }
 }
 
 void aes_cbc_destroy(aes_ctx_t *ctx) {
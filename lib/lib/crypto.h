@@ -46,10 +46,16 @@ void aes_ctr_reset(aes_ctx_t *ctx);
 void aes_ctr_encrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_ctr_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_ctr_start_fresh_block(aes_ctx_t *ctx);
+/* Keystream bytes used since init or reset */
+uint64_t aes_ctr_get_position(aes_ctx_t *ctx);
+/* Continues the keystream at a block aligned position, so a stream can be processed out of order */
+void aes_ctr_set_position(aes_ctx_t *ctx, uint64_t position);
 void aes_ctr_destroy(aes_ctx_t *ctx);
 
 aes_ctx_t *aes_cbc_init(const uint8_t *key, const uint8_t *iv, aes_direction_t direction);
 void aes_cbc_reset(aes_ctx_t *ctx);
+/* Restarts the chain with a new IV (or the initial one if iv is NULL), keeping the key schedule */
+void aes_cbc_reset_iv(aes_ctx_t *ctx, const uint8_t *iv);
 void aes_cbc_encrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_cbc_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_cbc_destroy(aes_ctx_t *ctx);
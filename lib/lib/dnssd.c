@@ -141,6 +141,8 @@ struct dnssd_s {
 
     char *hw_addr;
     int hw_addr_len;
+
+    int hevc;
 };
 
 
@@ -320,9 +322,11 @@ dnssd_register_airplay(dnssd_t *dnssd, unsigned short port)
     }
 
 
+    const char *features = dnssd->hevc ? AIRPLAY_FEATURES_HEVC : AIRPLAY_FEATURES;
+
     dnssd->TXTRecordCreate(&dnssd->airplay_record, 0, NULL);
     dnssd->TXTRecordSetValue(&dnssd->airplay_record, "deviceid", strlen(device_id), device_id);
-    dnssd->TXTRecordSetValue(&dnssd->airplay_record, "features", strlen(AIRPLAY_FEATURES), AIRPLAY_FEATURES);
+    dnssd->TXTRecordSetValue(&dnssd->airplay_record, "features", strlen(features), features);
     dnssd->TXTRecordSetValue(&dnssd->airplay_record, "flags", strlen(AIRPLAY_FLAGS), AIRPLAY_FLAGS);
     dnssd->TXTRecordSetValue(&dnssd->airplay_record, "model", strlen(GLOBAL_MODEL), GLOBAL_MODEL);
     dnssd->TXTRecordSetValue(&dnssd->airplay_record, "pk", strlen(AIRPLAY_PK), AIRPLAY_PK);
@@ -342,6 +346,20 @@ dnssd_register_airplay(dnssd_t *dnssd, unsigned short port)
     return 1;
 }
 
+void
+dnssd_set_hevc(dnssd_t *dnssd, int enabled)
+{
+    assert(dnssd);
+    dnssd->hevc = enabled;
+}
+
+int
+dnssd_get_hevc(dnssd_t *dnssd)
+{
+    assert(dnssd);
+    return dnssd->hevc;
+}
+
 const char *
 dnssd_get_airplay_txt(dnssd_t *dnssd, int *length)
 {
@@ -23,6 +23,9 @@ DNSSD_API dnssd_t *dnssd_init(const char *name, int name_len, const char *hw_add
 
 DNSSD_API int dnssd_register_raop(dnssd_t *dnssd, unsigned short port);
 DNSSD_API int dnssd_register_airplay(dnssd_t *dnssd, unsigned short port);
+/* Advertises HEVC mirroring from the next dnssd_register_airplay on */
+DNSSD_API void dnssd_set_hevc(dnssd_t *dnssd, int enabled);
+DNSSD_API int dnssd_get_hevc(dnssd_t *dnssd);
 
 DNSSD_API void dnssd_unregister_raop(dnssd_t *dnssd);
 DNSSD_API void dnssd_unregister_airplay(dnssd_t *dnssd);
@@ -20,6 +20,9 @@
 #define RAOP_PK "b07727d6f6cd6e08b58ede525ec3cdeaa252ad9f683feb212ef8a205246554e7"
 
 #define AIRPLAY_FEATURES "0x5A7FFEE6"
+/* Bit 42 (SupportsScreenMultiCodec) in the second word lets senders mirror in HEVC */
+#define AIRPLAY_FEATURES_HEVC "0x5A7FFEE6,0x400"
+#define AIRPLAY_FEATURE_SCREEN_MULTI_CODEC 42
 #define AIRPLAY_SRCVERS "220.68"
 #define AIRPLAY_FLAGS "0x4"
 #define AIRPLAY_VV "2"
@@ -0,0 +1,484 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/*
+ * Reads the fields of H.264 sequence and picture parameter sets (ITU-T H.264
+ * 7.3.2.1 and 7.3.2.2) a receiver needs before the first frame is decoded:
+ * picture size and cropping, profile and level, reorder depth and frame rate.
+ * HEVC sequence parameter sets (ITU-T H.265 7.3.2.2) are read as far as the
+ * reorder depth. The RBSP is read straight from the NAL unit, skipping
+ * emulation prevention bytes on the way, so nothing is copied.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "h264_parser.h"
+
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+#define HEVC_NAL_SPS 33
+#define HEVC_MAX_SUB_LAYERS 7
+
+/* Longest Exp-Golomb prefix of a 32 bit value */
+#define H264_MAX_EXP_GOLOMB_ZEROS 31
+
+typedef struct h264_bits_s {
+    const unsigned char *data;
+    int len;
+    /* Next byte to load, and zero bytes seen right before it */
+    int pos;
+    int zeros;
+    unsigned int current;
+    /* Bits of current not read yet */
+    int left;
+    int error;
+} h264_bits_t;
+
+/* Sample aspect ratios of aspect_ratio_idc 1 to 16, Table E-1 */
+static const unsigned char h264_sar_table[16][2] = {
+    { 1, 1 }, { 12, 11 }, { 10, 11 }, { 16, 11 }, { 40, 33 }, { 24, 11 }, { 20, 11 }, { 32, 11 },
+    { 80, 33 }, { 18, 11 }, { 15, 11 }, { 64, 33 }, { 160, 99 }, { 4, 3 }, { 3, 2 }, { 2, 1 }
+};
+
+static void
+h264_bits_init(h264_bits_t *bits, const unsigned char *data, int len)
+{
+    memset(bits, 0, sizeof(h264_bits_t));
+    bits->data = data;
+    bits->len = len;
+}
+
+static int
+h264_bits_load(h264_bits_t *bits)
+{
+    if (bits->pos >= bits->len) {
+        bits->error = 1;
+        return 0;
+    }
+    unsigned char byte = bits->data[bits->pos++];
+    // 0x000003 only exists to keep start codes out of the payload
+    if (bits->zeros >= 2 && byte == 0x03) {
+        bits->zeros = 0;
+        if (bits->pos >= bits->len) {
+            bits->error = 1;
+            return 0;
+        }
+        byte = bits->data[bits->pos++];
+    }
+    bits->zeros = byte ? 0 : bits->zeros + 1;
+    bits->current = byte;
+    bits->left = 8;
+    return 1;
+}
+
+static unsigned int
+h264_bits_read(h264_bits_t *bits, int n)
+{
+    unsigned int value = 0;
+
+    assert(n >= 0 && n <= 32);
+    while (n > 0) {
+        if (!bits->left && !h264_bits_load(bits)) {
+            return 0;
+        }
+        int take = n < bits->left ? n : bits->left;
+        bits->left -= take;
+        value = (value << take) | ((bits->current >> bits->left) & ((1u << take) - 1));
+        n -= take;
+    }
+    return value;
+}
+
+static void
+h264_bits_skip(h264_bits_t *bits, int n)
+{
+    while (n > 0 && !bits->error) {
+        int take = n < 32 ? n : 32;
+        h264_bits_read(bits, take);
+        n -= take;
+    }
+}
+
+/* ue(v), 9.1 */
+static unsigned int
+h264_bits_read_ue(h264_bits_t *bits)
+{
+    int zeros = 0;
+    while (!h264_bits_read(bits, 1)) {
+        if (bits->error || ++zeros > H264_MAX_EXP_GOLOMB_ZEROS) {
+            bits->error = 1;
+            return 0;
+        }
+    }
+    if (!zeros) {
+        return 0;
+    }
+    return (unsigned int) ((1ull << zeros) - 1 + h264_bits_read(bits, zeros));
+}
+
+/* se(v), 9.1.1 */
+static int
+h264_bits_read_se(h264_bits_t *bits)
+{
+    unsigned int k = h264_bits_read_ue(bits);
+    return (k & 1) ? (int) ((k + 1) / 2) : -(int) (k / 2);
+}
+
+static void
+h264_skip_scaling_list(h264_bits_t *bits, int size)
+{
+    int last = 8, next = 8;
+    for (int j = 0; j < size && !bits->error; j++) {
+        if (next) {
+            next = (last + h264_bits_read_se(bits) + 256) % 256;
+        }
+        last = next ? next : last;
+    }
+}
+
+/* hrd_parameters(), E.1.2 */
+static void
+h264_skip_hrd(h264_bits_t *bits)
+{
+    unsigned int cpb_cnt = h264_bits_read_ue(bits) + 1;
+    if (cpb_cnt > 32) {
+        bits->error = 1;
+        return;
+    }
+    h264_bits_skip(bits, 8); // bit_rate_scale, cpb_size_scale
+    for (unsigned int i = 0; i < cpb_cnt; i++) {
+        h264_bits_read_ue(bits); // bit_rate_value_minus1
+        h264_bits_read_ue(bits); // cpb_size_value_minus1
+        h264_bits_skip(bits, 1); // cbr_flag
+    }
+    h264_bits_skip(bits, 20); // Four delay and length fields of 5 bits
+}
+
+/* vui_parameters(), E.1.1 */
+static void
+h264_parse_vui(h264_bits_t *bits, video_stream_info *info)
+{
+    if (h264_bits_read(bits, 1)) { // aspect_ratio_info_present_flag
+        unsigned int idc = h264_bits_read(bits, 8);
+        if (idc == 255) { // Extended_SAR
+            info->sar_width = h264_bits_read(bits, 16);
+            info->sar_height = h264_bits_read(bits, 16);
+        } else if (idc >= 1 && idc <= 16) {
+            info->sar_width = h264_sar_table[idc - 1][0];
+            info->sar_height = h264_sar_table[idc - 1][1];
+        }
+    }
+    if (h264_bits_read(bits, 1)) { // overscan_info_present_flag
+        h264_bits_skip(bits, 1);
+    }
+    if (h264_bits_read(bits, 1)) { // video_signal_type_present_flag
+        h264_bits_skip(bits, 4); // video_format, video_full_range_flag
+        if (h264_bits_read(bits, 1)) { // colour_description_present_flag
+            h264_bits_skip(bits, 24);
+        }
+    }
+    if (h264_bits_read(bits, 1)) { // chroma_loc_info_present_flag
+        h264_bits_read_ue(bits);
+        h264_bits_read_ue(bits);
+    }
+    if (h264_bits_read(bits, 1)) { // timing_info_present_flag
+        unsigned int num_units_in_tick = h264_bits_read(bits, 32);
+        unsigned int time_scale = h264_bits_read(bits, 32);
+        h264_bits_skip(bits, 1); // fixed_frame_rate_flag
+        // A frame lasts two ticks, one per field
+        if (num_units_in_tick && time_scale) {
+            if (num_units_in_tick <= 0x7fffffff) {
+                info->fps_num = time_scale;
+                info->fps_den = num_units_in_tick * 2;
+            } else {
+                info->fps_num = time_scale / 2;
+                info->fps_den = num_units_in_tick;
+            }
+        }
+    }
+    int nal_hrd = h264_bits_read(bits, 1);
+    if (nal_hrd) {
+        h264_skip_hrd(bits);
+    }
+    int vcl_hrd = h264_bits_read(bits, 1);
+    if (vcl_hrd) {
+        h264_skip_hrd(bits);
+    }
+    if (nal_hrd || vcl_hrd) {
+        h264_bits_skip(bits, 1); // low_delay_hrd_flag
+    }
+    h264_bits_skip(bits, 1); // pic_struct_present_flag
+    if (h264_bits_read(bits, 1)) { // bitstream_restriction_flag
+        h264_bits_skip(bits, 1); // motion_vectors_over_pic_boundaries_flag
+        for (int i = 0; i < 4; i++) {
+            h264_bits_read_ue(bits); // Byte, bit and motion vector limits
+        }
+        info->reorder_frames = (int) h264_bits_read_ue(bits); // max_num_reorder_frames
+        h264_bits_read_ue(bits); // max_dec_frame_buffering
+    }
+}
+
+int
+h264_parse_sps(const unsigned char *nal, int nal_len, video_stream_info *info)
+{
+    h264_bits_t bits;
+    video_stream_info sps;
+
+    assert(nal);
+    assert(info);
+
+    if (nal_len < 4 || (nal[0] & 0x1f) != H264_NAL_SPS) {
+        return -1;
+    }
+    memset(&sps, 0, sizeof(sps));
+    sps.reorder_frames = -1;
+    sps.chroma_format_idc = 1;
+    sps.bit_depth = 8;
+
+    h264_bits_init(&bits, nal + 1, nal_len - 1);
+    sps.profile_idc = h264_bits_read(&bits, 8);
+    sps.constraint_flags = h264_bits_read(&bits, 8);
+    sps.level_idc = h264_bits_read(&bits, 8);
+    h264_bits_read_ue(&bits); // seq_parameter_set_id
+
+    int separate_colour_plane = 0;
+    switch (sps.profile_idc) {
+        case 100: case 110: case 122: case 244: case 44:
+        case 83: case 86: case 118: case 128: case 138:
+        case 139: case 134: case 135:
+            sps.chroma_format_idc = (int) h264_bits_read_ue(&bits);
+            if (sps.chroma_format_idc > 3) {
+                return -1;
+            }
+            if (sps.chroma_format_idc == 3) {
+                separate_colour_plane = h264_bits_read(&bits, 1);
+            }
+            sps.bit_depth = (int) h264_bits_read_ue(&bits) + 8; // bit_depth_luma_minus8
+            h264_bits_read_ue(&bits); // bit_depth_chroma_minus8
+            h264_bits_skip(&bits, 1); // qpprime_y_zero_transform_bypass_flag
+            if (h264_bits_read(&bits, 1)) { // seq_scaling_matrix_present_flag
+                int lists = sps.chroma_format_idc != 3 ? 8 : 12;
+                for (int i = 0; i < lists; i++) {
+                    if (h264_bits_read(&bits, 1)) {
+                        h264_skip_scaling_list(&bits, i < 6 ? 16 : 64);
+                    }
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    h264_bits_read_ue(&bits); // log2_max_frame_num_minus4
+    unsigned int poc_type = h264_bits_read_ue(&bits);
+    if (poc_type == 0) {
+        h264_bits_read_ue(&bits); // log2_max_pic_order_cnt_lsb_minus4
+    } else if (poc_type == 1) {
+        h264_bits_skip(&bits, 1); // delta_pic_order_always_zero_flag
+        h264_bits_read_se(&bits); // offset_for_non_ref_pic
+        h264_bits_read_se(&bits); // offset_for_top_to_bottom_field
+        unsigned int cycle = h264_bits_read_ue(&bits);
+        if (cycle > 255) {
+            return -1;
+        }
+        for (unsigned int i = 0; i < cycle; i++) {
+            h264_bits_read_se(&bits);
+        }
+    } else if (poc_type > 2) {
+        return -1;
+    }
+    sps.max_ref_frames = (int) h264_bits_read_ue(&bits);
+    h264_bits_skip(&bits, 1); // gaps_in_frame_num_value_allowed_flag
+    unsigned int width_mbs = h264_bits_read_ue(&bits) + 1;
+    unsigned int height_map_units = h264_bits_read_ue(&bits) + 1;
+    int frame_mbs_only = h264_bits_read(&bits, 1);
+    if (!frame_mbs_only) {
+        h264_bits_skip(&bits, 1); // mb_adaptive_frame_field_flag
+    }
+    h264_bits_skip(&bits, 1); // direct_8x8_inference_flag
+    if (bits.error || width_mbs > 1024 || height_map_units > 1024) {
+        return -1;
+    }
+    sps.coded_width = (int) width_mbs * 16;
+    sps.coded_height = (int) height_map_units * 16 * (2 - frame_mbs_only);
+
+    unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    if (h264_bits_read(&bits, 1)) { // frame_cropping_flag
+        crop_left = h264_bits_read_ue(&bits);
+        crop_right = h264_bits_read_ue(&bits);
+        crop_top = h264_bits_read_ue(&bits);
+        crop_bottom = h264_bits_read_ue(&bits);
+    }
+    // Crop offsets count chroma samples, and frame pairs for field coding (7-19 to 7-22)
+    int chroma_array_type = separate_colour_plane ? 0 : sps.chroma_format_idc;
+    int crop_unit_x = (chroma_array_type == 1 || chroma_array_type == 2) ? 2 : 1;
+    int crop_unit_y = (chroma_array_type == 1 ? 2 : 1) * (2 - frame_mbs_only);
+    if ((crop_left + crop_right) * crop_unit_x >= (unsigned int) sps.coded_width ||
+        (crop_top + crop_bottom) * crop_unit_y >= (unsigned int) sps.coded_height) {
+        return -1;
+    }
+    sps.width = sps.coded_width - (int) (crop_left + crop_right) * crop_unit_x;
+    sps.height = sps.coded_height - (int) (crop_top + crop_bottom) * crop_unit_y;
+
+    if (h264_bits_read(&bits, 1)) { // vui_parameters_present_flag
+        h264_parse_vui(&bits, &sps);
+    }
+    if (bits.error) {
+        return -1;
+    }
+
+    // Without bitstream restrictions, only streams that can not have B frames are known not to reorder
+    if (sps.reorder_frames < 0 && (sps.profile_idc == 66 || ((sps.constraint_flags & 0x10) &&
+        (sps.profile_idc == 44 || sps.profile_idc == 86 || sps.profile_idc == 100 ||
+         sps.profile_idc == 110 || sps.profile_idc == 122 || sps.profile_idc == 244)))) {
+        sps.reorder_frames = 0;
+    }
+
+    sps.cabac = info->cabac;
+    sps.valid = 1;
+    *info = sps;
+    return 0;
+}
+
+int
+h264_parse_pps(const unsigned char *nal, int nal_len, video_stream_info *info)
+{
+    h264_bits_t bits;
+
+    assert(nal);
+    assert(info);
+
+    if (nal_len < 2 || (nal[0] & 0x1f) != H264_NAL_PPS) {
+        return -1;
+    }
+    h264_bits_init(&bits, nal + 1, nal_len - 1);
+    h264_bits_read_ue(&bits); // pic_parameter_set_id
+    h264_bits_read_ue(&bits); // seq_parameter_set_id
+    int cabac = h264_bits_read(&bits, 1); // entropy_coding_mode_flag
+    if (bits.error) {
+        return -1;
+    }
+    info->cabac = cabac;
+    return 0;
+}
+
+/* profile_tier_level(1, max_sub_layers_minus1), H.265 7.3.3 */
+static void
+hevc_parse_profile_tier_level(h264_bits_t *bits, int max_sub_layers_minus1, video_stream_info *info)
+{
+    int profile_present[HEVC_MAX_SUB_LAYERS];
+    int level_present[HEVC_MAX_SUB_LAYERS];
+
+    h264_bits_skip(bits, 3); // general_profile_space, general_tier_flag
+    info->profile_idc = h264_bits_read(bits, 5);
+    h264_bits_skip(bits, 32); // general_profile_compatibility_flag
+    // Source and constraint flags, the progressive and interlaced ones first
+    info->constraint_flags = h264_bits_read(bits, 8);
+    h264_bits_skip(bits, 40);
+    info->level_idc = h264_bits_read(bits, 8);
+
+    for (int i = 0; i < max_sub_layers_minus1; i++) {
+        profile_present[i] = h264_bits_read(bits, 1);
+        level_present[i] = h264_bits_read(bits, 1);
+    }
+    if (max_sub_layers_minus1 > 0) {
+        h264_bits_skip(bits, 2 * (8 - max_sub_layers_minus1)); // reserved_zero_2bits
+    }
+    for (int i = 0; i < max_sub_layers_minus1; i++) {
+        if (profile_present[i]) {
+            h264_bits_skip(bits, 88);
+        }
+        if (level_present[i]) {
+            h264_bits_skip(bits, 8);
+        }
+    }
+}
+
+int
+hevc_parse_sps(const unsigned char *nal, int nal_len, video_stream_info *info)
+{
+    h264_bits_t bits;
+    video_stream_info sps;
+
+    assert(nal);
+    assert(info);
+
+    if (nal_len < 4 || ((nal[0] >> 1) & 0x3f) != HEVC_NAL_SPS) {
+        return -1;
+    }
+    memset(&sps, 0, sizeof(sps));
+    sps.reorder_frames = -1;
+    // Every HEVC picture is CABAC coded
+    sps.cabac = 1;
+
+    h264_bits_init(&bits, nal + 2, nal_len - 2);
+    h264_bits_skip(&bits, 4); // sps_video_parameter_set_id
+    int max_sub_layers_minus1 = h264_bits_read(&bits, 3);
+    h264_bits_skip(&bits, 1); // sps_temporal_id_nesting_flag
+    if (max_sub_layers_minus1 >= HEVC_MAX_SUB_LAYERS) {
+        return -1;
+    }
+    hevc_parse_profile_tier_level(&bits, max_sub_layers_minus1, &sps);
+    h264_bits_read_ue(&bits); // sps_seq_parameter_set_id
+
+    sps.chroma_format_idc = (int) h264_bits_read_ue(&bits);
+    if (sps.chroma_format_idc > 3) {
+        return -1;
+    }
+    int separate_colour_plane = 0;
+    if (sps.chroma_format_idc == 3) {
+        separate_colour_plane = h264_bits_read(&bits, 1);
+    }
+    unsigned int width = h264_bits_read_ue(&bits); // pic_width_in_luma_samples
+    unsigned int height = h264_bits_read_ue(&bits);
+    if (bits.error || width == 0 || height == 0 || width > 16384 || height > 16384) {
+        return -1;
+    }
+    sps.coded_width = (int) width;
+    sps.coded_height = (int) height;
+
+    unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    if (h264_bits_read(&bits, 1)) { // conformance_window_flag
+        crop_left = h264_bits_read_ue(&bits);
+        crop_right = h264_bits_read_ue(&bits);
+        crop_top = h264_bits_read_ue(&bits);
+        crop_bottom = h264_bits_read_ue(&bits);
+    }
+    // Offsets count chroma samples (Table 6-1)
+    int chroma_array_type = separate_colour_plane ? 0 : sps.chroma_format_idc;
+    int crop_unit_x = (chroma_array_type == 1 || chroma_array_type == 2) ? 2 : 1;
+    int crop_unit_y = chroma_array_type == 1 ? 2 : 1;
+    if ((crop_left + crop_right) * crop_unit_x >= width || (crop_top + crop_bottom) * crop_unit_y >= height) {
+        return -1;
+    }
+    sps.width = sps.coded_width - (int) (crop_left + crop_right) * crop_unit_x;
+    sps.height = sps.coded_height - (int) (crop_top + crop_bottom) * crop_unit_y;
+
+    sps.bit_depth = (int) h264_bits_read_ue(&bits) + 8; // bit_depth_luma_minus8
+    h264_bits_read_ue(&bits); // bit_depth_chroma_minus8
+    h264_bits_read_ue(&bits); // log2_max_pic_order_cnt_lsb_minus4
+    // Only the limits of the highest sub-layer matter for the whole stream
+    int first = h264_bits_read(&bits, 1) ? 0 : max_sub_layers_minus1; // sps_sub_layer_ordering_info_present_flag
+    for (int i = first; i <= max_sub_layers_minus1; i++) {
+        sps.max_ref_frames = (int) h264_bits_read_ue(&bits); // sps_max_dec_pic_buffering_minus1
+        sps.reorder_frames = (int) h264_bits_read_ue(&bits); // sps_max_num_reorder_pics
+        h264_bits_read_ue(&bits); // sps_max_latency_increase_plus1
+    }
+    if (bits.error) {
+        return -1;
+    }
+
+    sps.valid = 1;
+    *info = sps;
+    return 0;
+}
@@ -0,0 +1,28 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef H264_PARSER_H
+#define H264_PARSER_H
+
+#include "stream.h"
+
+/* All take a whole NAL unit starting at its header byte, emulation prevention bytes included.
+ * They return 0 on success and -1 when the unit is truncated or not of the expected type */
+
+/* Fills everything in info the SPS carries and sets info->valid */
+int h264_parse_sps(const unsigned char *nal, int nal_len, video_stream_info *info);
+/* Only adds the entropy coder to info, which must already describe the SPS the PPS refers to */
+int h264_parse_pps(const unsigned char *nal, int nal_len, video_stream_info *info);
+/* The same for an HEVC SPS, read up to the reorder depth, so the frame rate is left out */
+int hevc_parse_sps(const unsigned char *nal, int nal_len, video_stream_info *info);
+
+#endif
@@ -13,76 +13,205 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 
 #include "http_request.h"
 #include "llhttp/llhttp.h"
 
+/* Everything a typical RTSP request holds fits in the arena inside the request itself */
+#define HTTP_REQUEST_ARENA_SIZE 4096
+#define HTTP_REQUEST_HEADERS 24
+/* Power of two, at least twice the headers hashed into it */
+#define HTTP_REQUEST_HASH_SIZE 64
+/* Bodies are refused past this size, and no more than the arena is set aside before they arrive */
+#define HTTP_REQUEST_MAX_BODY (16 * 1024 * 1024)
+#define HTTP_REQUEST_BODY_RESERVE HTTP_REQUEST_ARENA_SIZE
+
+/* FNV-1a of the lowercased header name */
+#define HTTP_HASH_OFFSET 0x811c9dc5u
+#define HTTP_HASH_PRIME 0x01000193u
+
+struct http_string_s {
+    char *ptr;
+    int len;
+};
+typedef struct http_string_s http_string_t;
+
+struct http_header_s {
+    http_string_t name;
+    http_string_t value;
+};
+typedef struct http_header_s http_header_t;
+
+/* Further arena memory once the inline one is used up, freed with the request */
+struct http_arena_block_s {
+    struct http_arena_block_s *next;
+    char data[];
+};
+typedef struct http_arena_block_s http_arena_block_t;
+
+static const struct {
+    const char *name;
+    unsigned int hash;
+} http_header_keys[HTTP_HEADER_COUNT] = {
+    [HTTP_HEADER_CSEQ] = { "CSeq", 0xee2bd5a9u },
+    [HTTP_HEADER_CONTENT_TYPE] = { "Content-Type", 0xfcf70995u },
+    [HTTP_HEADER_CONTENT_LENGTH] = { "Content-Length", 0x4df9451du },
+    [HTTP_HEADER_RTP_INFO] = { "RTP-Info", 0x7c0d76a0u },
+    [HTTP_HEADER_DACP_ID] = { "DACP-ID", 0x89b6d69du },
+    [HTTP_HEADER_ACTIVE_REMOTE] = { "Active-Remote", 0x08a6e134u },
+    [HTTP_HEADER_TRANSPORT] = { "Transport", 0xd32f6312u },
+};
+
 struct http_request_s {
     llhttp_t parser;
     llhttp_settings_t parser_settings;
 
     const char *method;
-    char *url;
+    http_string_t url;
 
-    char **headers;
+    http_header_t *headers;
     int headers_size;
-    int headers_index;
+    int headers_count;
+    /* Set while the last header callback was for a value */
+    int in_value;
+
+    /* Header index + 1 per slot, 0 when empty */
+    unsigned short *hash_table;
+    int hash_size;
 
-    char *data;
-    int datalen;
+    http_string_t data;
+    int data_size;
 
     int complete;
+
+    /* Bump allocator, every string of the request lives in it */
+    char *arena_pos;
+    char *arena_end;
+    http_arena_block_t *arena_blocks;
+
+    http_header_t headers_inline[HTTP_REQUEST_HEADERS];
+    unsigned short hash_inline[HTTP_REQUEST_HASH_SIZE];
+    char arena[HTTP_REQUEST_ARENA_SIZE];
 };
 
+static unsigned int
+http_request_hash(const char *name, int len)
+{
+    unsigned int hash = HTTP_HASH_OFFSET;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char) tolower((unsigned char) name[i]);
+        hash *= HTTP_HASH_PRIME;
+    }
+    return hash;
+}
+
 static int
-on_url(llhttp_t *parser, const char *at, size_t length)
+http_request_name_equal(const char *a, const char *b, int len)
 {
-    http_request_t *request = parser->data;
-    int urllen = request->url ? strlen(request->url) : 0;
+    for (int i = 0; i < len; i++) {
+        if (tolower((unsigned char) a[i]) != tolower((unsigned char) b[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    request->url = realloc(request->url, urllen+length+1);
-    assert(request->url);
+/* Sizes come from the peer, so running out of memory fails the request instead of the process */
+static char *
+http_request_alloc(http_request_t *request, int size)
+{
+    char *ptr;
 
-    request->url[urllen] = '\0';
-    strncat(request->url, at, length);
+    if (request->arena_end - request->arena_pos < size) {
+        int block_size = size > HTTP_REQUEST_ARENA_SIZE ? size : HTTP_REQUEST_ARENA_SIZE;
+        http_arena_block_t *block = malloc(sizeof(http_arena_block_t) + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->next = request->arena_blocks;
+        request->arena_blocks = block;
+        request->arena_pos = block->data;
+        request->arena_end = block->data + block_size;
+    }
+    ptr = request->arena_pos;
+    request->arena_pos += size;
+    return ptr;
+}
+
+/* Arrays of headers and hash slots need their natural alignment, strings do not */
+static void *
+http_request_alloc_aligned(http_request_t *request, int size)
+{
+    uintptr_t misalign = (uintptr_t) request->arena_pos % sizeof(void *);
+    if (misalign && request->arena_end - request->arena_pos >= (ptrdiff_t) (sizeof(void *) - misalign + size)) {
+        request->arena_pos += sizeof(void *) - misalign;
+    }
+    /* A new block starts aligned */
+    return http_request_alloc(request, size);
+}
+
+/* Fragments of one string arrive in a row, so it is usually the last thing allocated and grows in place */
+static int
+http_request_append(http_request_t *request, http_string_t *string, const char *at, size_t length)
+{
+    if (string->ptr && string->ptr + string->len + 1 == request->arena_pos &&
+        request->arena_end - request->arena_pos >= (ptrdiff_t) length) {
+        request->arena_pos += length;
+    } else {
+        /* Leave room to grow so a string split across many reads is not copied every time */
+        size_t size = ((size_t) string->len + length + 1) * 2;
+        char *ptr = size <= INT_MAX ? http_request_alloc(request, (int) size) : NULL;
+        if (!ptr) {
+            return -1;
+        }
+        if (string->ptr) {
+            memcpy(ptr, string->ptr, string->len);
+        }
+        string->ptr = ptr;
+        request->arena_pos = ptr + string->len + length + 1;
+    }
+    memcpy(string->ptr + string->len, at, length);
+    string->len += length;
+    string->ptr[string->len] = '\0';
     return 0;
 }
 
 static int
-on_header_field(llhttp_t *parser, const char *at, size_t length)
+on_url(llhttp_t *parser, const char *at, size_t length)
 {
     http_request_t *request = parser->data;
 
-    /* Check if our index is a value */
-    if (request->headers_index%2 == 1) {
-        request->headers_index++;
-    }
+    return http_request_append(request, &request->url, at, length);
+}
 
-    /* Allocate space for new field-value pair */
-    if (request->headers_index == request->headers_size) {
-        request->headers_size += 2;
-        request->headers = realloc(request->headers,
-                                   request->headers_size*sizeof(char*));
-        assert(request->headers);
-        request->headers[request->headers_index] = NULL;
-        request->headers[request->headers_index+1] = NULL;
-    }
+static int
+on_header_field(llhttp_t *parser, const char *at, size_t length)
+{
+    http_request_t *request = parser->data;
 
-    /* Allocate space in the current header string */
-    if (request->headers[request->headers_index] == NULL) {
-        request->headers[request->headers_index] = calloc(1, length+1);
-    } else {
-        request->headers[request->headers_index] = realloc(
-                request->headers[request->headers_index],
-                strlen(request->headers[request->headers_index])+length+1
-        );
+    /* Start a new field-value pair unless the name continues */
+    if (request->in_value || request->headers_count == 0) {
+        if (request->headers_count == request->headers_size) {
+            http_header_t *headers = http_request_alloc_aligned(request, 2 * request->headers_size * sizeof(http_header_t));
+            if (!headers) {
+                return -1;
+            }
+            memcpy(headers, request->headers, request->headers_count * sizeof(http_header_t));
+            request->headers = headers;
+            request->headers_size *= 2;
+        }
+        memset(&request->headers[request->headers_count], 0, sizeof(http_header_t));
+        request->headers_count++;
+        request->in_value = 0;
     }
-    assert(request->headers[request->headers_index]);
 
-    strncat(request->headers[request->headers_index], at, length);
-    return 0;
+    return http_request_append(request, &request->headers[request->headers_count-1].name, at, length);
 }
 
 static int
@@ -90,23 +219,54 @@ on_header_value(llhttp_t *parser, const char *at, size_t length)
 {
     http_request_t *request = parser->data;
 
-    /* Check if our index is a field */
-    if (request->headers_index%2 == 0) {
-        request->headers_index++;
-    }
+    request->in_value = 1;
+    return http_request_append(request, &request->headers[request->headers_count-1].value, at, length);
+}
 
-    /* Allocate space in the current header string */
-    if (request->headers[request->headers_index] == NULL) {
-        request->headers[request->headers_index] = calloc(1, length+1);
-    } else {
-        request->headers[request->headers_index] = realloc(
-                request->headers[request->headers_index],
-                strlen(request->headers[request->headers_index])+length+1
-        );
+static int
+on_headers_complete(llhttp_t *parser)
+{
+    http_request_t *request = parser->data;
+
+    /* Intern the names, the first of repeated headers is the one found */
+    while (request->hash_size < 2 * request->headers_count) {
+        request->hash_size *= 2;
+    }
+    if (request->hash_size > HTTP_REQUEST_HASH_SIZE) {
+        request->hash_table = http_request_alloc_aligned(request, request->hash_size * sizeof(unsigned short));
+        if (!request->hash_table) {
+            return -1;
+        }
+        memset(request->hash_table, 0, request->hash_size * sizeof(unsigned short));
+    }
+    for (int i = 0; i < request->headers_count; i++) {
+        http_header_t *header = &request->headers[i];
+        if (!header->value.ptr) {
+            /* Empty values never call on_header_value */
+            if (http_request_append(request, &header->value, "", 0) < 0) {
+                return -1;
+            }
+        }
+        unsigned int slot = http_request_hash(header->name.ptr, header->name.len);
+        while (request->hash_table[slot & (request->hash_size - 1)]) {
+            slot++;
+        }
+        request->hash_table[slot & (request->hash_size - 1)] = i + 1;
     }
-    assert(request->headers[request->headers_index]);
 
-    strncat(request->headers[request->headers_index], at, length);
+    if (parser->content_length > HTTP_REQUEST_MAX_BODY) {
+        return -1;
+    }
+    /* Set aside room for a small body of known length, a larger one grows as it actually arrives */
+    if (parser->content_length > 0) {
+        int size = (int) parser->content_length + 1;
+        request->data_size = size < HTTP_REQUEST_BODY_RESERVE ? size : HTTP_REQUEST_BODY_RESERVE;
+        request->data.ptr = http_request_alloc(request, request->data_size);
+        if (!request->data.ptr) {
+            return -1;
+        }
+        request->data.ptr[0] = '\0';
+    }
     return 0;
 }
 
@@ -115,12 +275,17 @@ on_body(llhttp_t *parser, const char *at, size_t length)
 {
     http_request_t *request = parser->data;
 
-    request->data = realloc(request->data, request->datalen+length);
-    assert(request->data);
-
-    memcpy(request->data+request->datalen, at, length);
-    request->datalen += length;
-    return 0;
+    /* Also covers chunked bodies, which announce no length up front */
+    if (length > HTTP_REQUEST_MAX_BODY - (size_t) request->data.len) {
+        return -1;
+    }
+    if (request->data.ptr && request->data.len + (int) length < request->data_size) {
+        memcpy(request->data.ptr + request->data.len, at, length);
+        request->data.len += length;
+        request->data.ptr[request->data.len] = '\0';
+        return 0;
+    }
+    return http_request_append(request, &request->data, at, length);
 }
 
 static int
@@ -130,7 +295,8 @@ on_message_complete(llhttp_t *parser)
 
     request->method = llhttp_method_name(request->parser.method);
     request->complete = 1;
-    return 0;
+    /* Stop right after this request, anything following belongs to the next one */
+    return HPE_PAUSED;
 }
 
 http_request_t *
@@ -138,15 +304,26 @@ http_request_init(void)
 {
     http_request_t *request;
 
-    request = calloc(1, sizeof(http_request_t));
+    /* Only the bookkeeping needs clearing, the arena is written before it is read */
+    request = malloc(sizeof(http_request_t));
     if (!request) {
         return NULL;
     }
+    memset(request, 0, offsetof(http_request_t, headers_inline));
+    memset(request->hash_inline, 0, sizeof(request->hash_inline));
+
+    request->headers = request->headers_inline;
+    request->headers_size = HTTP_REQUEST_HEADERS;
+    request->hash_table = request->hash_inline;
+    request->hash_size = HTTP_REQUEST_HASH_SIZE;
+    request->arena_pos = request->arena;
+    request->arena_end = request->arena + HTTP_REQUEST_ARENA_SIZE;
 
     llhttp_settings_init(&request->parser_settings);
     request->parser_settings.on_url = &on_url;
     request->parser_settings.on_header_field = &on_header_field;
     request->parser_settings.on_header_value = &on_header_value;
+    request->parser_settings.on_headers_complete = &on_headers_complete;
     request->parser_settings.on_body = &on_body;
     request->parser_settings.on_message_complete = &on_message_complete;
 
@@ -159,15 +336,12 @@ http_request_init(void)
 void
 http_request_destroy(http_request_t *request)
 {
-    int i;
-
     if (request) {
-        free(request->url);
-        for (i=0; i<request->headers_size; i++) {
-            free(request->headers[i]);
+        while (request->arena_blocks) {
+            http_arena_block_t *next = request->arena_blocks->next;
+            free(request->arena_blocks);
+            request->arena_blocks = next;
         }
-        free(request->headers);
-        free(request->data);
         free(request);
     }
 }
@@ -175,13 +349,18 @@ http_request_destroy(http_request_t *request)
 int
 http_request_add_data(http_request_t *request, const char *data, int datalen)
 {
-    int ret;
+    llhttp_errno_t ret;
 
     assert(request);
 
     ret = llhttp_execute(&request->parser,
                               data, datalen);
-    return ret;
+    if (ret == HPE_PAUSED) {
+        return (int) (llhttp_get_error_pos(&request->parser) - data);
+    } else if (ret != HPE_OK) {
+        return -1;
+    }
+    return datalen;
 }
 
 int
@@ -195,7 +374,8 @@ int
 http_request_has_error(http_request_t *request)
 {
     assert(request);
-    return (llhttp_get_errno(&request->parser) != HPE_OK);
+    llhttp_errno_t ret = llhttp_get_errno(&request->parser);
+    return (ret != HPE_OK && ret != HPE_PAUSED);
 }
 
 const char *
@@ -219,26 +399,55 @@ http_request_get_method(http_request_t *request)
     return request->method;
 }
 
+int
+http_request_get_method_id(http_request_t *request)
+{
+    assert(request);
+    return request->parser.method;
+}
+
 const char *
 http_request_get_url(http_request_t *request)
 {
     assert(request);
-    return request->url;
+    return request->url.ptr;
+}
+
+static const char *
+http_request_find_header(http_request_t *request, const char *name, int len, unsigned int hash)
+{
+    unsigned int slot;
+    int index;
+
+    for (slot = hash; (index = request->hash_table[slot & (request->hash_size - 1)]); slot++) {
+        http_header_t *header = &request->headers[index - 1];
+        if (header->name.len == len && http_request_name_equal(header->name.ptr, name, len)) {
+            return header->value.ptr;
+        }
+    }
+    return NULL;
 }
 
 const char *
 http_request_get_header(http_request_t *request, const char *name)
 {
-    int i;
+    int len;
 
     assert(request);
+    assert(name);
 
-    for (i=0; i<request->headers_size; i+=2) {
-        if (!strcmp(request->headers[i], name)) {
-            return request->headers[i+1];
-        }
-    }
-    return NULL;
+    len = strlen(name);
+    return http_request_find_header(request, name, len, http_request_hash(name, len));
+}
+
+const char *
+http_request_get_header_key(http_request_t *request, http_header_key_t key)
+{
+    assert(request);
+    assert(key >= 0 && key < HTTP_HEADER_COUNT);
+
+    const char *name = http_header_keys[key].name;
+    return http_request_find_header(request, name, strlen(name), http_header_keys[key].hash);
 }
 
 const char *
@@ -247,7 +456,7 @@ http_request_get_data(http_request_t *request, int *datalen)
     assert(request);
 
     if (datalen) {
-        *datalen = request->datalen;
+        *datalen = request->data.len;
     }
-    return request->data;
+    return request->data.ptr;
 }
@@ -17,9 +17,23 @@
 
 typedef struct http_request_s http_request_t;
 
+/* Headers the handlers look up, their hashes are computed ahead of time */
+typedef enum http_header_key_e {
+    HTTP_HEADER_CSEQ,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_RTP_INFO,
+    HTTP_HEADER_DACP_ID,
+    HTTP_HEADER_ACTIVE_REMOTE,
+    HTTP_HEADER_TRANSPORT,
+    HTTP_HEADER_COUNT
+} http_header_key_t;
+
 
 http_request_t *http_request_init(void);
 
+/* Returns how much of data was parsed, which is less than datalen when a request completed before its end,
+ * or -1 on a parse error */
 int http_request_add_data(http_request_t *request, const char *data, int datalen);
 int http_request_is_complete(http_request_t *request);
 int http_request_has_error(http_request_t *request);
@@ -27,8 +41,12 @@ int http_request_has_error(http_request_t *request);
 const char *http_request_get_error_name(http_request_t *request);
 const char *http_request_get_error_description(http_request_t *request);
 const char *http_request_get_method(http_request_t *request);
+/* The llhttp_method_t of the request, cheaper to dispatch on than the name */
+int http_request_get_method_id(http_request_t *request);
 const char *http_request_get_url(http_request_t *request);
+/* Header names match regardless of case */
 const char *http_request_get_header(http_request_t *request, const char *name);
+const char *http_request_get_header_key(http_request_t *request, http_header_key_t key);
 const char *http_request_get_data(http_request_t *request, int *datalen);
 
 void http_request_destroy(http_request_t *request);
@@ -13,6 +13,7 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -20,35 +21,97 @@
 #include "http_response.h"
 #include "compat.h"
 
+/* Room for the fragments and formatted text of a typical RTSP response inside the response itself */
+#define HTTP_RESPONSE_FRAGMENTS 16
+#define HTTP_RESPONSE_TEXT_SIZE 512
+
+/* Further text once the inline one is used up, fragments keep pointing into it until destroy */
+struct http_response_chunk_s {
+    struct http_response_chunk_s *next;
+    char data[];
+};
+typedef struct http_response_chunk_s http_response_chunk_t;
+
 struct http_response_s {
     int complete;
     int disconnect;
 
+    http_response_fragment_t *fragments;
+    int fragments_count;
+    int fragments_size;
+
+    /* Copied and formatted parts of the head */
+    char *text_pos;
+    char *text_end;
+    http_response_chunk_t *chunks;
+
+    /* Body handed over by http_response_finish_owned */
+    char *body;
+
+    /* Flattened response, only made for http_response_get_data */
     char *data;
-    int data_size;
-    int data_length;
+
+    http_response_fragment_t fragments_inline[HTTP_RESPONSE_FRAGMENTS];
+    char text_inline[HTTP_RESPONSE_TEXT_SIZE];
 };
 
+/* Status lines common enough to keep preformatted */
+static const char http_response_rtsp_ok[] = "RTSP/1.0 200 OK\r\n";
+
+static void
+http_response_add_fragment(http_response_t *response, const char *data, int datalen)
+{
+    assert(response);
+    assert(data);
+    assert(datalen > 0);
+
+    if (response->fragments_count == response->fragments_size) {
+        int fragments_size = response->fragments_size * 2;
+        http_response_fragment_t *fragments;
+        if (response->fragments == response->fragments_inline) {
+            fragments = malloc(fragments_size * sizeof(http_response_fragment_t));
+            assert(fragments);
+            memcpy(fragments, response->fragments_inline, sizeof(response->fragments_inline));
+        } else {
+            fragments = realloc(response->fragments, fragments_size * sizeof(http_response_fragment_t));
+            assert(fragments);
+        }
+        response->fragments = fragments;
+        response->fragments_size = fragments_size;
+    }
+    response->fragments[response->fragments_count].data = data;
+    response->fragments[response->fragments_count].len = datalen;
+    response->fragments_count++;
+}
 
 static void
 http_response_add_data(http_response_t *response, const char *data, int datalen)
 {
-    int newdatasize;
+    http_response_fragment_t *last;
 
     assert(response);
     assert(data);
     assert(datalen > 0);
 
-    newdatasize = response->data_size;
-    while (response->data_size+datalen > newdatasize) {
-        newdatasize *= 2;
+    if (response->text_end - response->text_pos < datalen) {
+        int chunk_size = datalen > HTTP_RESPONSE_TEXT_SIZE ? datalen : HTTP_RESPONSE_TEXT_SIZE;
+        http_response_chunk_t *chunk = malloc(sizeof(http_response_chunk_t) + chunk_size);
+        assert(chunk);
+        chunk->next = response->chunks;
+        response->chunks = chunk;
+        response->text_pos = chunk->data;
+        response->text_end = chunk->data + chunk_size;
     }
-    if (newdatasize != response->data_size) {
-        response->data = realloc(response->data, newdatasize);
-        assert(response->data);
+    memcpy(response->text_pos, data, datalen);
+
+    /* Text copied in a row stays one fragment */
+    last = response->fragments_count ? &response->fragments[response->fragments_count-1] : NULL;
+    if (last && last->data + last->len == response->text_pos) {
+        last->len += datalen;
+    } else {
+        http_response_add_fragment(response, response->text_pos, datalen);
     }
-    memcpy(response->data+response->data_length, data, datalen);
-    response->data_length += datalen;
+    response->text_pos += datalen;
 }
 
 http_response_t *
@@ -59,23 +122,26 @@ http_response_init(const char *protocol, int code, const char *message)
 
     assert(code >= 100 && code < 1000);
 
-    /* Convert code into string */
-    memset(codestr, 0, sizeof(codestr));
-    snprintf(codestr, sizeof(codestr), "%u", code);
-
-    response = calloc(1, sizeof(http_response_t));
+    /* The inline buffers are written before they are read */
+    response = malloc(sizeof(http_response_t));
     if (!response) {
         return NULL;
     }
+    memset(response, 0, offsetof(http_response_t, fragments_inline));
+    response->fragments = response->fragments_inline;
+    response->fragments_size = HTTP_RESPONSE_FRAGMENTS;
+    response->text_pos = response->text_inline;
+    response->text_end = response->text_inline + HTTP_RESPONSE_TEXT_SIZE;
 
-    /* Allocate response data */
-    response->data_size = 1024;
-    response->data = malloc(response->data_size);
-    if (!response->data) {
-        free(response);
-        return NULL;
+    if (code == 200 && !strcmp(protocol, "RTSP/1.0") && !strcmp(message, "OK")) {
+        http_response_add_fragment(response, http_response_rtsp_ok, sizeof(http_response_rtsp_ok) - 1);
+        return response;
     }
 
+    /* Convert code into string */
+    memset(codestr, 0, sizeof(codestr));
+    snprintf(codestr, sizeof(codestr), "%u", code);
+
     /* Add first line of response to the data array */
     http_response_add_data(response, protocol, strlen(protocol));
     http_response_add_data(response, " ", 1);
@@ -91,6 +157,15 @@ void
 http_response_destroy(http_response_t *response)
 {
     if (response) {
+        while (response->chunks) {
+            http_response_chunk_t *next = response->chunks->next;
+            free(response->chunks);
+            response->chunks = next;
+        }
+        if (response->fragments != response->fragments_inline) {
+            free(response->fragments);
+        }
+        free(response->body);
         free(response->data);
         free(response);
     }
@@ -105,34 +180,61 @@ http_response_add_header(http_response_t *response, const char *name, const char
 
     http_response_add_data(response, name, strlen(name));
     http_response_add_data(response, ": ", 2);
-    http_response_add_data(response, value, strlen(value));
+    if (*value) {
+        http_response_add_data(response, value, strlen(value));
+    }
     http_response_add_data(response, "\r\n", 2);
 }
 
+void
+http_response_add_header_line(http_response_t *response, const char *line)
+{
+    assert(response);
+    assert(line);
+
+    http_response_add_fragment(response, line, strlen(line));
+}
+
 void
 http_response_finish(http_response_t *response, const char *data, int datalen)
+{
+    char *body = NULL;
+
+    assert(response);
+    assert(datalen==0 || (data && datalen > 0));
+
+    if (data && datalen > 0) {
+        body = malloc(datalen);
+        assert(body);
+        memcpy(body, data, datalen);
+    }
+    http_response_finish_owned(response, body, datalen);
+}
+
+void
+http_response_finish_owned(http_response_t *response, char *data, int datalen)
 {
     assert(response);
     assert(datalen==0 || (data && datalen > 0));
 
     if (data && datalen > 0) {
-        const char *hdrname = "Content-Length";
         char hdrvalue[16];
 
         memset(hdrvalue, 0, sizeof(hdrvalue));
         snprintf(hdrvalue, sizeof(hdrvalue)-1, "%d", datalen);
 
         /* Add Content-Length header first */
-        http_response_add_data(response, hdrname, strlen(hdrname));
-        http_response_add_data(response, ": ", 2);
+        http_response_add_data(response, "Content-Length: ", 16);
         http_response_add_data(response, hdrvalue, strlen(hdrvalue));
         http_response_add_data(response, "\r\n\r\n", 4);
 
         /* Add data to the end of response */
-        http_response_add_data(response, data, datalen);
+        response->body = data;
+        http_response_add_fragment(response, data, datalen);
     } else {
         /* Add extra end of line after headers */
         http_response_add_data(response, "\r\n", 2);
+        free(data);
     }
     response->complete = 1;
 }
@@ -153,13 +255,38 @@ http_response_get_disconnect(http_response_t *response)
     return response->disconnect;
 }
 
+const http_response_fragment_t *
+http_response_get_fragments(http_response_t *response, int *count)
+{
+    assert(response);
+    assert(count);
+    assert(response->complete);
+
+    *count = response->fragments_count;
+    return response->fragments;
+}
+
 const char *
 http_response_get_data(http_response_t *response, int *datalen)
 {
+    int i;
+
     assert(response);
     assert(datalen);
     assert(response->complete);
 
-    *datalen = response->data_length;
+    *datalen = 0;
+    for (i = 0; i < response->fragments_count; i++) {
+        *datalen += response->fragments[i].len;
+    }
+    if (!response->data) {
+        char *data = malloc(*datalen);
+        assert(data);
+        response->data = data;
+        for (i = 0; i < response->fragments_count; i++) {
+            memcpy(data, response->fragments[i].data, response->fragments[i].len);
+            data += response->fragments[i].len;
+        }
+    }
     return response->data;
 }
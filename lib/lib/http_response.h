@@ -17,14 +17,27 @@
 
 typedef struct http_response_s http_response_t;
 
+/* One piece of the response on the wire, written out in order with the others */
+struct http_response_fragment_s {
+    const char *data;
+    int len;
+};
+typedef struct http_response_fragment_s http_response_fragment_t;
+
 http_response_t *http_response_init(const char *protocol, int code, const char *message);
 
 void http_response_add_header(http_response_t *response, const char *name, const char *value);
+/* Adds a whole "Name: value\r\n" line by reference, it has to outlive the response */
+void http_response_add_header_line(http_response_t *response, const char *line);
 void http_response_finish(http_response_t *response, const char *data, int datalen);
+/* Like http_response_finish, but the response takes over data and frees it instead of copying it */
+void http_response_finish_owned(http_response_t *response, char *data, int datalen);
 
 void http_response_set_disconnect(http_response_t *response, int disconnect);
 int http_response_get_disconnect(http_response_t *response);
 
+const http_response_fragment_t *http_response_get_fragments(http_response_t *response, int *count);
+/* Joins the fragments into one buffer, owned by the response */
 const char *http_response_get_data(http_response_t *response, int *datalen);
 
 void http_response_destroy(http_response_t *response);
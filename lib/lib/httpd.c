@@ -16,6 +16,19 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#endif
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#include <sys/socket.h>
+#endif
 
 #include "httpd.h"
 #include "netutils.h"
@@ -23,12 +36,43 @@
 #include "compat.h"
 #include "logger.h"
 
+/* Reads are at least this large and grow to what the socket has pending, up to the maximum */
+#define HTTPD_READ_BUFFER_SIZE 1024
+#define HTTPD_MAX_READ_SIZE 65536
+/* Ready sockets handled per wakeup */
+#define HTTPD_MAX_EVENTS 64
+/* Response fragments gathered per write */
+#define HTTPD_MAX_IOV 64
+/* A peer whose socket takes no data for this long is dropped */
+#define HTTPD_WRITE_TIMEOUT_MS 5000
+
 struct http_connection_s {
     int connected;
 
     int socket_fd;
     void *user_data;
     http_request_t *request;
+
+    /* Grows to the largest read so far, freed with the connection */
+    char *buffer;
+    int buffer_size;
+
+    /* Responses to every request of one read, sent together */
+    http_response_t **responses;
+    int responses_count;
+    int responses_size;
+    /* Position of the first unwritten byte in the responses */
+    int output_response;
+    int output_fragment;
+    int output_offset;
+    /* Close once the responses are written */
+    int disconnect;
+
+    /* While the socket is full the connection waits in the blocked list, oldest first */
+    int blocked;
+    uint64_t blocked_since;
+    struct http_connection_s *blocked_prev;
+    struct http_connection_s *blocked_next;
 };
 typedef struct http_connection_s http_connection_t;
 
@@ -39,6 +83,9 @@ struct httpd_s {
     int max_connections;
     int open_connections;
     http_connection_t *connections;
+    /* Indexes of the unused connections, the first free_count are valid */
+    int *free_connections;
+    int free_count;
 
     /* These variables only edited mutex locked */
     int running;
@@ -49,6 +96,17 @@ struct httpd_s {
     /* Server fds for accepting connections */
     int server_fd4;
     int server_fd6;
+
+#if defined(__linux__)
+    /* Every socket is registered with its connection, or the field holding its fd */
+    int epoll_fd;
+    /* Wakes the thread when it has to stop */
+    int event_fd;
+#endif
+
+    /* Connections waiting to write, the head times out first */
+    http_connection_t *blocked_head;
+    http_connection_t *blocked_tail;
 };
 
 httpd_t *
@@ -68,10 +126,35 @@ httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int max_connections)
 
     httpd->max_connections = max_connections;
     httpd->connections = calloc(max_connections, sizeof(http_connection_t));
-    if (!httpd->connections) {
+    httpd->free_connections = malloc(max_connections * sizeof(int));
+    if (!httpd->connections || !httpd->free_connections) {
+        free(httpd->connections);
+        free(httpd->free_connections);
+        free(httpd);
+        return NULL;
+    }
+    /* Hand out the lowest slots first */
+    for (int i = 0; i < max_connections; i++) {
+        httpd->free_connections[i] = max_connections - 1 - i;
+    }
+    httpd->free_count = max_connections;
+
+#if defined(__linux__)
+    httpd->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    httpd->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &httpd->event_fd;
+    if (httpd->epoll_fd == -1 || httpd->event_fd == -1 ||
+        epoll_ctl(httpd->epoll_fd, EPOLL_CTL_ADD, httpd->event_fd, &event) == -1) {
+        if (httpd->epoll_fd != -1) close(httpd->epoll_fd);
+        if (httpd->event_fd != -1) close(httpd->event_fd);
+        free(httpd->connections);
+        free(httpd->free_connections);
         free(httpd);
         return NULL;
     }
+#endif
 
     /* Use the logger provided */
     httpd->logger = logger;
@@ -93,27 +176,98 @@ httpd_destroy(httpd_t *httpd)
     if (httpd) {
         httpd_stop(httpd);
 
+#if defined(__linux__)
+        close(httpd->epoll_fd);
+        close(httpd->event_fd);
+#endif
         free(httpd->connections);
+        free(httpd->free_connections);
         free(httpd);
     }
 }
 
+static uint64_t
+httpd_get_time_ms(void)
+{
+#if defined(__linux__)
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000 + time.tv_nsec / 1000000;
+#else
+    return 0;
+#endif
+}
+
+/* Waits for the socket to take more output instead of reading more requests, so a peer that
+ * does not read cannot queue up responses */
+static void
+httpd_set_blocked(httpd_t *httpd, http_connection_t *connection, int blocked, int progress)
+{
+    if (connection->blocked && (!blocked || progress)) {
+        /* Unlink, a blocked connection that made progress goes back to the tail */
+        if (connection->blocked_prev) connection->blocked_prev->blocked_next = connection->blocked_next;
+        else httpd->blocked_head = connection->blocked_next;
+        if (connection->blocked_next) connection->blocked_next->blocked_prev = connection->blocked_prev;
+        else httpd->blocked_tail = connection->blocked_prev;
+        connection->blocked_prev = connection->blocked_next = NULL;
+    } else if (connection->blocked == blocked) {
+        return;
+    }
+
+    if (blocked) {
+        connection->blocked_since = httpd_get_time_ms();
+        connection->blocked_prev = httpd->blocked_tail;
+        if (httpd->blocked_tail) httpd->blocked_tail->blocked_next = connection;
+        else httpd->blocked_head = connection;
+        httpd->blocked_tail = connection;
+    }
+    if (connection->blocked == blocked) {
+        return;
+    }
+    connection->blocked = blocked;
+
+#if defined(__linux__)
+    struct epoll_event event;
+    event.events = blocked ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = connection;
+    if (epoll_ctl(httpd->epoll_fd, EPOLL_CTL_MOD, connection->socket_fd, &event) == -1) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error watching socket %d", connection->socket_fd);
+    }
+#endif
+}
+
+/* Starts or stops watching the server sockets, they are left alone while all connections are in use */
+static void
+httpd_set_accepting(httpd_t *httpd, int accepting)
+{
+#if defined(__linux__)
+    int *server_fds[] = { &httpd->server_fd4, &httpd->server_fd6 };
+    for (int i = 0; i < 2; i++) {
+        if (*server_fds[i] == -1) {
+            continue;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = server_fds[i];
+        if (epoll_ctl(httpd->epoll_fd, accepting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, *server_fds[i], &event) == -1) {
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error watching server socket %d", *server_fds[i]);
+        }
+    }
+#endif
+}
+
 static int
 httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len, unsigned char *remote, int remote_len)
 {
+    http_connection_t *connection;
     void *user_data;
-    int i;
 
-    for (i=0; i<httpd->max_connections; i++) {
-        if (!httpd->connections[i].connected) {
-            break;
-        }
-    }
-    if (i == httpd->max_connections) {
-        /* This code should never be reached, we do not select server_fds when full */
+    if (httpd->free_count == 0) {
+        /* This code should never be reached, we do not watch server_fds when full */
         logger_log(httpd->logger, LOGGER_INFO, "Max connections reached");
         return -1;
     }
+    connection = &httpd->connections[httpd->free_connections[httpd->free_count - 1]];
 
     user_data = httpd->callbacks.conn_init(httpd->callbacks.opaque, local, local_len, remote, remote_len);
     if (!user_data) {
@@ -121,10 +275,27 @@ httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len
         return -1;
     }
 
+#if defined(__linux__)
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = connection;
+    if (epoll_ctl(httpd->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error watching socket %d", fd);
+        httpd->callbacks.conn_destroy(user_data);
+        return -1;
+    }
+    /* Writes must not stall the thread serving every other connection */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+
+    httpd->free_count--;
     httpd->open_connections++;
-    httpd->connections[i].socket_fd = fd;
-    httpd->connections[i].connected = 1;
-    httpd->connections[i].user_data = user_data;
+    connection->socket_fd = fd;
+    connection->connected = 1;
+    connection->user_data = user_data;
+    if (httpd->free_count == 0) {
+        httpd_set_accepting(httpd, 0);
+    }
     return 0;
 }
 
@@ -142,6 +313,11 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
     remote_saddrlen = sizeof(remote_saddr);
     fd = accept(server_fd, (struct sockaddr *)&remote_saddr, &remote_saddrlen);
     if (fd == -1) {
+        int error = SOCKET_GET_ERROR();
+        /* The client may have given up between being announced and accepted */
+        if (error == SOCKET_ERRORNAME(EWOULDBLOCK) || error == SOCKET_ERRORNAME(EINTR) || error == SOCKET_ERRORNAME(ECONNABORTED)) {
+            return 0;
+        }
         /* FIXME: Error happened */
         return -1;
     }
@@ -176,166 +352,453 @@ httpd_remove_connection(httpd_t *httpd, http_connection_t *connection)
         connection->request = NULL;
     }
     httpd->callbacks.conn_destroy(connection->user_data);
+    httpd_set_blocked(httpd, connection, 0, 0);
+#if defined(__linux__)
+    epoll_ctl(httpd->epoll_fd, EPOLL_CTL_DEL, connection->socket_fd, NULL);
+#endif
     shutdown(connection->socket_fd, SHUT_WR);
     closesocket(connection->socket_fd);
+    free(connection->buffer);
+    connection->buffer = NULL;
+    connection->buffer_size = 0;
+    for (int i = 0; i < connection->responses_count; i++) {
+        http_response_destroy(connection->responses[i]);
+    }
+    free(connection->responses);
+    connection->responses = NULL;
+    connection->responses_count = 0;
+    connection->responses_size = 0;
+    connection->output_response = 0;
+    connection->output_fragment = 0;
+    connection->output_offset = 0;
+    connection->disconnect = 0;
     connection->connected = 0;
     httpd->open_connections--;
+
+    httpd->free_connections[httpd->free_count++] = (int) (connection - httpd->connections);
+    if (httpd->free_count == 1) {
+        httpd_set_accepting(httpd, 1);
+    }
 }
 
-static THREAD_RETVAL
-httpd_thread(void *arg)
+/* Reads what the socket has pending into the connection's buffer, which grows to fit it */
+static int
+httpd_read_connection(http_connection_t *connection)
 {
-    httpd_t *httpd = arg;
-    char buffer[1024];
-    int i;
-
-    assert(httpd);
+    int wanted = HTTPD_READ_BUFFER_SIZE;
+    int flags = 0;
 
-    while (1) {
-        fd_set rfds;
-        struct timeval tv;
-        int nfds=0;
-        int ret;
+#if defined(__linux__)
+    int pending = 0;
+    if (ioctl(connection->socket_fd, FIONREAD, &pending) == 0 && pending > wanted) {
+        wanted = pending < HTTPD_MAX_READ_SIZE ? pending : HTTPD_MAX_READ_SIZE;
+    }
+    /* A stale event may point at a connection that took over the slot of a removed one */
+    flags = MSG_DONTWAIT;
+#endif
+    if (wanted > connection->buffer_size) {
+        char *buffer = realloc(connection->buffer, wanted);
+        if (buffer) {
+            connection->buffer = buffer;
+            connection->buffer_size = wanted;
+        } else if (!connection->buffer) {
+            SOCKET_SET_ERROR(ENOMEM);
+            return -1;
+        }
+    }
+    return recv(connection->socket_fd, connection->buffer, connection->buffer_size, flags);
+}
 
-        MUTEX_LOCK(httpd->run_mutex);
-        if (!httpd->running) {
-            MUTEX_UNLOCK(httpd->run_mutex);
-            break;
+/* Takes over the response until it is sent */
+static void
+httpd_queue_response(httpd_t *httpd, http_connection_t *connection, http_response_t *response)
+{
+    if (connection->responses_count == connection->responses_size) {
+        int responses_size = connection->responses_size ? connection->responses_size * 2 : 4;
+        http_response_t **responses = realloc(connection->responses, responses_size * sizeof(http_response_t *));
+        if (!responses) {
+            logger_log(httpd->logger, LOGGER_ERR, "httpd could not queue a response");
+            http_response_destroy(response);
+            return;
         }
-        MUTEX_UNLOCK(httpd->run_mutex);
+        connection->responses = responses;
+        connection->responses_size = responses_size;
+    }
+    connection->responses[connection->responses_count++] = response;
+}
 
-        /* Set timeout value to 5ms */
-        tv.tv_sec = 1;
-        tv.tv_usec = 5000;
-
-        /* Get the correct nfds value and set rfds */
-        FD_ZERO(&rfds);
-        if (httpd->open_connections < httpd->max_connections) {
-            if (httpd->server_fd4 != -1) {
-                FD_SET(httpd->server_fd4, &rfds);
-                if (nfds <= httpd->server_fd4) {
-                    nfds = httpd->server_fd4+1;
-                }
+static int
+httpd_writev(int fd, const http_response_fragment_t *fragments, int count)
+{
+#if defined(_WIN32)
+    WSABUF buffers[HTTPD_MAX_IOV];
+    DWORD sent = 0;
+
+    for (int i = 0; i < count; i++) {
+        buffers[i].buf = (char *) fragments[i].data;
+        buffers[i].len = fragments[i].len;
+    }
+    if (WSASend(fd, buffers, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+        return -1;
+    }
+    return (int) sent;
+#else
+    struct iovec iov[HTTPD_MAX_IOV];
+    struct msghdr msg;
+
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = (void *) fragments[i].data;
+        iov[i].iov_len = fragments[i].len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+#if defined(MSG_NOSIGNAL)
+    /* A peer that went away shows up as an error rather than SIGPIPE */
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
+    return sendmsg(fd, &msg, 0);
+#endif
+#endif
+}
+
+/* Writes as much of the queued responses as the socket takes, with as few calls as possible.
+ * Returns 1 when output is left for later, 0 when all was written and -1 on errors */
+static int
+httpd_send_output(httpd_t *httpd, http_connection_t *connection, int *progress)
+{
+    const http_response_fragment_t *fragments;
+    int fragments_count;
+    int ret = 0;
+
+    *progress = 0;
+    while (connection->output_response < connection->responses_count) {
+        http_response_fragment_t gathered[HTTPD_MAX_IOV];
+        int count = 0;
+        int r = connection->output_response;
+        int f = connection->output_fragment;
+        int o = connection->output_offset;
+
+        while (r < connection->responses_count && count < HTTPD_MAX_IOV) {
+            fragments = http_response_get_fragments(connection->responses[r], &fragments_count);
+            for (; f < fragments_count && count < HTTPD_MAX_IOV; f++, o = 0) {
+                gathered[count].data = fragments[f].data + o;
+                gathered[count].len = fragments[f].len - o;
+                count++;
             }
-            if (httpd->server_fd6 != -1) {
-                FD_SET(httpd->server_fd6, &rfds);
-                if (nfds <= httpd->server_fd6) {
-                    nfds = httpd->server_fd6+1;
-                }
+            if (f == fragments_count) {
+                r++;
+                f = 0;
             }
         }
-        for (i=0; i<httpd->max_connections; i++) {
-            int socket_fd;
-            if (!httpd->connections[i].connected) {
+
+        int written = httpd_writev(connection->socket_fd, gathered, count);
+        if (written == -1) {
+            int error = SOCKET_GET_ERROR();
+            if (error == SOCKET_ERRORNAME(EINTR)) {
                 continue;
+            } else if (error == SOCKET_ERRORNAME(EWOULDBLOCK)) {
+                return 1;
+            }
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in sending data");
+            ret = -1;
+            break;
+        }
+        *progress = 1;
+
+        while (written > 0) {
+            fragments = http_response_get_fragments(connection->responses[connection->output_response], &fragments_count);
+            int left = fragments[connection->output_fragment].len - connection->output_offset;
+            if (written < left) {
+                connection->output_offset += written;
+                break;
             }
-            socket_fd = httpd->connections[i].socket_fd;
-            FD_SET(socket_fd, &rfds);
-            if (nfds <= socket_fd) {
-                nfds = socket_fd+1;
+            written -= left;
+            connection->output_offset = 0;
+            if (++connection->output_fragment == fragments_count) {
+                connection->output_response++;
+                connection->output_fragment = 0;
             }
         }
+    }
 
-        ret = select(nfds, &rfds, NULL, NULL, &tv);
-        if (ret == 0) {
-            /* Timeout happened */
-            continue;
-        } else if (ret == -1) {
-            logger_log(httpd->logger, LOGGER_ERR, "httpd error in select");
-            break;
+    for (int i = 0; i < connection->responses_count; i++) {
+        http_response_destroy(connection->responses[i]);
+    }
+    connection->responses_count = 0;
+    connection->output_response = 0;
+    connection->output_fragment = 0;
+    connection->output_offset = 0;
+    return ret;
+}
+
+/* Sends what is queued and closes the connection if asked to once everything is out */
+static void
+httpd_flush_connection(httpd_t *httpd, http_connection_t *connection)
+{
+    int progress;
+    int ret;
+
+    ret = httpd_send_output(httpd, connection, &progress);
+    if (ret < 0 || (ret == 0 && connection->disconnect)) {
+        httpd_remove_connection(httpd, connection);
+        return;
+    }
+    httpd_set_blocked(httpd, connection, ret == 1, progress);
+}
+
+/* Drops the peers that have not taken any output for too long, they are blocked the longest */
+static void
+httpd_expire_blocked(httpd_t *httpd)
+{
+    uint64_t now = httpd_get_time_ms();
+
+    while (httpd->blocked_head && now - httpd->blocked_head->blocked_since >= HTTPD_WRITE_TIMEOUT_MS) {
+        logger_log(httpd->logger, LOGGER_WARNING, "httpd dropping socket %d, it took no output for %d ms",
+                   httpd->blocked_head->socket_fd, HTTPD_WRITE_TIMEOUT_MS);
+        httpd_remove_connection(httpd, httpd->blocked_head);
+    }
+}
+
+static void
+httpd_handle_connection(httpd_t *httpd, http_connection_t *connection)
+{
+    int offset;
+    int ret;
+
+    LOGGER_LOG(httpd->logger, LOGGER_DEBUG, "httpd receiving on socket %d", connection->socket_fd);
+    ret = httpd_read_connection(connection);
+    if (ret == 0) {
+        logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d", connection->socket_fd);
+        httpd_remove_connection(httpd, connection);
+        return;
+    } else if (ret == -1) {
+        int error = SOCKET_GET_ERROR();
+        if (error == SOCKET_ERRORNAME(EWOULDBLOCK) || error == SOCKET_ERRORNAME(EINTR)) {
+            return;
         }
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error receiving on socket %d: %d", connection->socket_fd, error);
+        httpd_remove_connection(httpd, connection);
+        return;
+    }
 
-        if (httpd->open_connections < httpd->max_connections &&
-            httpd->server_fd4 != -1 && FD_ISSET(httpd->server_fd4, &rfds)) {
-            ret = httpd_accept_connection(httpd, httpd->server_fd4, 0);
-            if (ret == -1) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv4");
-                break;
-            } else if (ret == 0) {
-                continue;
+    /* A read may end in the middle of a request or hold several pipelined ones, handle all in order */
+    for (offset = 0; offset < ret && !connection->disconnect; ) {
+        int used;
+
+        /* If not in the middle of request, allocate one */
+        if (!connection->request) {
+            connection->request = http_request_init();
+            assert(connection->request);
+        }
+
+        /* Parse HTTP request from data read from connection */
+        used = http_request_add_data(connection->request, connection->buffer + offset, ret - offset);
+        if (used < 0 || http_request_has_error(connection->request)) {
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in parsing: %s", http_request_get_error_name(connection->request));
+            /* Answers to the requests before it go out if the socket takes them right away */
+            connection->disconnect = 1;
+            httpd_flush_connection(httpd, connection);
+            if (connection->connected) {
+                httpd_remove_connection(httpd, connection);
             }
+            return;
         }
-        if (httpd->open_connections < httpd->max_connections &&
-            httpd->server_fd6 != -1 && FD_ISSET(httpd->server_fd6, &rfds)) {
-            ret = httpd_accept_connection(httpd, httpd->server_fd6, 1);
-            if (ret == -1) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv6");
-                break;
-            } else if (ret == 0) {
-                continue;
+        offset += used;
+
+        if (!http_request_is_complete(connection->request)) {
+            LOGGER_LOG(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
+            break;
+        }
+
+        /* Request is finished, process and deallocate */
+        http_response_t *response = NULL;
+        // Callback the received data to raop
+        httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
+        http_request_destroy(connection->request);
+        connection->request = NULL;
+
+        if (response) {
+            if (http_response_get_disconnect(response)) {
+                logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
+                connection->disconnect = 1;
             }
+            httpd_queue_response(httpd, connection, response);
+        } else {
+            logger_log(httpd->logger, LOGGER_WARNING, "httpd didn't get response");
         }
-        for (i=0; i<httpd->max_connections; i++) {
-            http_connection_t *connection = &httpd->connections[i];
+    }
 
-            if (!connection->connected) {
-                continue;
+    httpd_flush_connection(httpd, connection);
+}
+
+#if defined(__linux__)
+/* Sleeps until a socket is ready and dispatches straight to its connection */
+static int
+httpd_wait(httpd_t *httpd)
+{
+    struct epoll_event events[HTTPD_MAX_EVENTS];
+    int timeout = -1;
+    int nfds, ret;
+
+    /* Only a connection waiting to write has a deadline to wake up for */
+    if (httpd->blocked_head) {
+        uint64_t waited = httpd_get_time_ms() - httpd->blocked_head->blocked_since;
+        timeout = waited < HTTPD_WRITE_TIMEOUT_MS ? (int) (HTTPD_WRITE_TIMEOUT_MS - waited) : 0;
+    }
+
+    nfds = epoll_wait(httpd->epoll_fd, events, HTTPD_MAX_EVENTS, timeout);
+    if (nfds == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in epoll_wait");
+        return -1;
+    }
+
+    for (int n = 0; n < nfds; n++) {
+        void *ptr = events[n].data.ptr;
+        if (ptr == &httpd->event_fd) {
+            /* Only wakes the loop up to see it has to stop */
+            uint64_t value;
+            if (read(httpd->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                logger_log(httpd->logger, LOGGER_ERR, "httpd error reading wakeup event");
             }
-            if (!FD_ISSET(connection->socket_fd, &rfds)) {
+        } else if (ptr == &httpd->server_fd4 || ptr == &httpd->server_fd6) {
+            if (httpd->free_count == 0) {
                 continue;
             }
-
-            /* If not in the middle of request, allocate one */
-            if (!connection->request) {
-                connection->request = http_request_init();
-                assert(connection->request);
+            int is_ipv6 = ptr == &httpd->server_fd6;
+            ret = httpd_accept_connection(httpd, *(int *) ptr, is_ipv6);
+            if (ret == -1) {
+                logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept %s", is_ipv6 ? "ipv6" : "ipv4");
+                return -1;
             }
-
-            logger_log(httpd->logger, LOGGER_DEBUG, "httpd receiving on socket %d", connection->socket_fd);
-            ret = recv(connection->socket_fd, buffer, sizeof(buffer), 0);
-            if (ret == 0) {
-                logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d", connection->socket_fd);
-                httpd_remove_connection(httpd, connection);
+        } else {
+            http_connection_t *connection = ptr;
+            if (!connection->connected) {
                 continue;
             }
-
-            /* Parse HTTP request from data read from connection */
-            http_request_add_data(connection->request, buffer, ret);
-            if (http_request_has_error(connection->request)) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in parsing: %s", http_request_get_error_name(connection->request));
-                httpd_remove_connection(httpd, connection);
-                continue;
+            if (connection->blocked) {
+                if (events[n].events & (EPOLLERR | EPOLLHUP)) {
+                    logger_log(httpd->logger, LOGGER_INFO, "Connection lost with output pending for socket %d", connection->socket_fd);
+                    httpd_remove_connection(httpd, connection);
+                } else if (events[n].events & EPOLLOUT) {
+                    httpd_flush_connection(httpd, connection);
+                }
+            } else if (events[n].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+                httpd_handle_connection(httpd, connection);
             }
+        }
+    }
+    httpd_expire_blocked(httpd);
+    return 0;
+}
+#else
+static int
+httpd_wait(httpd_t *httpd)
+{
+    fd_set rfds;
+    struct timeval tv;
+    int nfds=0;
+    int ret;
+    int i;
 
-            /* If request is finished, process and deallocate */
-            if (http_request_is_complete(connection->request)) {
-                http_response_t *response = NULL;
-                // Callback the received data to raop
-                httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
-                http_request_destroy(connection->request);
-                connection->request = NULL;
-
-                if (response) {
-                    const char *data;
-                    int datalen;
-                    int written;
-                    int ret;
-
-                    /* Get response data and datalen */
-                    data = http_response_get_data(response, &datalen);
-
-                    written = 0;
-                    while (written < datalen) {
-                        ret = send(connection->socket_fd, data+written, datalen-written, 0);
-                        if (ret == -1) {
-                            logger_log(httpd->logger, LOGGER_ERR, "httpd error in sending data");
-                            break;
-                        }
-                        written += ret;
-                    }
-
-                    if (http_response_get_disconnect(response)) {
-                        logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
-                        httpd_remove_connection(httpd, connection);
-                    }
-                } else {
-                    logger_log(httpd->logger, LOGGER_WARNING, "httpd didn't get response");
-                }
-                http_response_destroy(response);
-            } else {
-                logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
+    /* Set timeout value to 5ms */
+    tv.tv_sec = 1;
+    tv.tv_usec = 5000;
+
+    /* Get the correct nfds value and set rfds */
+    FD_ZERO(&rfds);
+    if (httpd->open_connections < httpd->max_connections) {
+        if (httpd->server_fd4 != -1) {
+            FD_SET(httpd->server_fd4, &rfds);
+            if (nfds <= httpd->server_fd4) {
+                nfds = httpd->server_fd4+1;
             }
         }
+        if (httpd->server_fd6 != -1) {
+            FD_SET(httpd->server_fd6, &rfds);
+            if (nfds <= httpd->server_fd6) {
+                nfds = httpd->server_fd6+1;
+            }
+        }
+    }
+    for (i=0; i<httpd->max_connections; i++) {
+        int socket_fd;
+        if (!httpd->connections[i].connected) {
+            continue;
+        }
+        socket_fd = httpd->connections[i].socket_fd;
+        FD_SET(socket_fd, &rfds);
+        if (nfds <= socket_fd) {
+            nfds = socket_fd+1;
+        }
+    }
+
+    ret = select(nfds, &rfds, NULL, NULL, &tv);
+    if (ret == 0) {
+        /* Timeout happened */
+        return 0;
+    } else if (ret == -1) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in select");
+        return -1;
+    }
+
+    if (httpd->open_connections < httpd->max_connections &&
+        httpd->server_fd4 != -1 && FD_ISSET(httpd->server_fd4, &rfds)) {
+        ret = httpd_accept_connection(httpd, httpd->server_fd4, 0);
+        if (ret == -1) {
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv4");
+            return -1;
+        } else if (ret == 0) {
+            return 0;
+        }
+    }
+    if (httpd->open_connections < httpd->max_connections &&
+        httpd->server_fd6 != -1 && FD_ISSET(httpd->server_fd6, &rfds)) {
+        ret = httpd_accept_connection(httpd, httpd->server_fd6, 1);
+        if (ret == -1) {
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv6");
+            return -1;
+        } else if (ret == 0) {
+            return 0;
+        }
+    }
+    for (i=0; i<httpd->max_connections; i++) {
+        http_connection_t *connection = &httpd->connections[i];
+
+        if (!connection->connected) {
+            continue;
+        }
+        if (!FD_ISSET(connection->socket_fd, &rfds)) {
+            continue;
+        }
+        httpd_handle_connection(httpd, connection);
+    }
+    return 0;
+}
+#endif
+
+static THREAD_RETVAL
+httpd_thread(void *arg)
+{
+    httpd_t *httpd = arg;
+    int i;
+
+    assert(httpd);
+
+    while (1) {
+        MUTEX_LOCK(httpd->run_mutex);
+        if (!httpd->running) {
+            MUTEX_UNLOCK(httpd->run_mutex);
+            break;
+        }
+        MUTEX_UNLOCK(httpd->run_mutex);
+
+        if (httpd_wait(httpd) < 0) {
+            break;
+        }
     }
 
     /* Remove all connections that are still connected */
@@ -350,6 +813,7 @@ httpd_thread(void *arg)
     }
 
     /* Close server sockets since they are not used any more */
+    httpd_set_accepting(httpd, 0);
     if (httpd->server_fd4 != -1) {
         shutdown(httpd->server_fd4, SHUT_RDWR);
         closesocket(httpd->server_fd4);
@@ -366,7 +830,7 @@ httpd_thread(void *arg)
     httpd->running = 0;
     MUTEX_UNLOCK(httpd->run_mutex);
 
-    logger_log(httpd->logger, LOGGER_DEBUG, "Exiting HTTP thread");
+    LOGGER_LOG(httpd->logger, LOGGER_DEBUG, "Exiting HTTP thread");
 
     return 0;
 }
@@ -374,8 +838,8 @@ httpd_thread(void *arg)
 int
 httpd_start(httpd_t *httpd, unsigned short *port)
 {
-    /* How many connection attempts are kept in queue */
-    int backlog = 5;
+    /* How many connection attempts are kept in queue, probing senders come in bursts */
+    int backlog = 64;
 
     assert(httpd);
     assert(port);
@@ -412,7 +876,15 @@ httpd_start(httpd_t *httpd, unsigned short *port)
         MUTEX_UNLOCK(httpd->run_mutex);
         return -2;
     }
+#if defined(__linux__)
+    /* Readiness can be stale by the time accept runs, which must not block the thread then */
+    if (httpd->server_fd4 != -1) fcntl(httpd->server_fd4, F_SETFL, fcntl(httpd->server_fd4, F_GETFL) | O_NONBLOCK);
+    if (httpd->server_fd6 != -1) fcntl(httpd->server_fd6, F_SETFL, fcntl(httpd->server_fd6, F_GETFL) | O_NONBLOCK);
+#endif
     logger_log(httpd->logger, LOGGER_INFO, "Initialized server socket(s)");
+    if (httpd->free_count > 0) {
+        httpd_set_accepting(httpd, 1);
+    }
 
     /* Set values correctly and create new thread */
     httpd->running = 1;
@@ -450,6 +922,12 @@ httpd_stop(httpd_t *httpd)
     httpd->running = 0;
     MUTEX_UNLOCK(httpd->run_mutex);
 
+#if defined(__linux__)
+    uint64_t value = 1;
+    if (write(httpd->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error waking thread");
+    }
+#endif
     THREAD_JOIN(httpd->thread);
 
     MUTEX_LOCK(httpd->run_mutex);
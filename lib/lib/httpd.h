@@ -21,6 +21,13 @@
 
 typedef struct httpd_s httpd_t;
 
+/* The select fallback cannot watch descriptors beyond FD_SETSIZE */
+#if defined(__linux__)
+#define HTTPD_MAX_CONNECTIONS 4096
+#else
+#define HTTPD_MAX_CONNECTIONS 99
+#endif
+
 struct httpd_callbacks_s {
 	void* opaque;
 	void* (*conn_init)(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen);
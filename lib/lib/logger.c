@@ -12,42 +12,109 @@
  *  Lesser General Public License for more details.
  */
 
+/*
+ * Messages are formatted on the calling thread straight into a slot of a
+ * bounded ring and handed to a drain thread, which runs the callback. Slots
+ * are claimed with a compare-and-swap on the tail and published through a
+ * per-slot sequence number, so any number of threads can log without
+ * taking a lock. When the ring is full the message is dropped and counted
+ * rather than making the caller wait.
+ */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "logger.h"
 #include "compat.h"
 
-struct logger_s {
-	mutex_handle_t lvl_mutex;
-	mutex_handle_t cb_mutex;
+/* Number of messages in flight, a power of two, and the longest message kept in place */
+#define LOGGER_QUEUE_LENGTH 256
+#define LOGGER_MESSAGE_SIZE 1024
+/* Upper bound on the delay of a message whose wakeup raced with the drain thread going to sleep */
+#define LOGGER_WAIT_MS 50
+#define LOGGER_CACHE_LINE 64
 
+typedef struct {
+	/* Equals the ring position when free, position + 1 once the message is written */
+	atomic_uint sequence;
 	int level;
+	/* Heap copy of a message too long for msg, freed once delivered */
+	char *long_msg;
+	char msg[LOGGER_MESSAGE_SIZE];
+} logger_entry_t;
+
+struct logger_s {
+	atomic_int level;
+
+	mutex_handle_t cb_mutex;
 	void *cls;
 	logger_callback_t callback;
+
+	logger_entry_t *entries;
+	/* Next position to claim, shared by all producers */
+	_Alignas(LOGGER_CACHE_LINE) atomic_uint tail;
+	/* Next position to deliver, owned by the drain thread */
+	_Alignas(LOGGER_CACHE_LINE) unsigned int head;
+	atomic_uint dropped;
+
+	int running;
+	thread_handle_t thread;
+	atomic_int quit;
+	atomic_int waiting;
+	mutex_handle_t wait_mutex;
+	cond_handle_t wait_cond;
 };
 
+static THREAD_RETVAL logger_thread(void *arg);
+
 logger_t *
 logger_init()
 {
 	logger_t *logger = calloc(1, sizeof(logger_t));
 	assert(logger);
 
-	MUTEX_CREATE(logger->lvl_mutex);
 	MUTEX_CREATE(logger->cb_mutex);
+	MUTEX_CREATE(logger->wait_mutex);
+	COND_CREATE(logger->wait_cond);
 
-	logger->level = LOGGER_WARNING;
+	atomic_init(&logger->level, LOGGER_WARNING);
 	logger->callback = NULL;
+
+	atomic_init(&logger->tail, 0);
+	atomic_init(&logger->dropped, 0);
+	atomic_init(&logger->quit, 0);
+	atomic_init(&logger->waiting, 0);
+	logger->entries = malloc(LOGGER_QUEUE_LENGTH * sizeof(logger_entry_t));
+	if (logger->entries) {
+		for (unsigned int i = 0; i < LOGGER_QUEUE_LENGTH; i++) {
+			atomic_init(&logger->entries[i].sequence, i);
+		}
+		THREAD_CREATE(logger->thread, logger_thread, logger);
+		logger->running = (logger->thread != 0);
+	}
+	/* Without the drain thread messages are delivered on the caller like before */
 	return logger;
 }
 
 void
 logger_destroy(logger_t *logger)
 {
-	MUTEX_DESTROY(logger->lvl_mutex);
+	if (logger->running) {
+		atomic_store(&logger->quit, 1);
+		MUTEX_LOCK(logger->wait_mutex);
+		COND_SIGNAL(logger->wait_cond);
+		MUTEX_UNLOCK(logger->wait_mutex);
+		THREAD_JOIN(logger->thread);
+	}
 	MUTEX_DESTROY(logger->cb_mutex);
+	MUTEX_DESTROY(logger->wait_mutex);
+	COND_DESTROY(logger->wait_cond);
+	free(logger->entries);
 	free(logger);
 }
 
@@ -56,9 +123,13 @@ logger_set_level(logger_t *logger, int level)
 {
 	assert(logger);
 
-	MUTEX_LOCK(logger->lvl_mutex);
-	logger->level = level;
-	MUTEX_UNLOCK(logger->lvl_mutex);
+	atomic_store_explicit(&logger->level, level, memory_order_relaxed);
+}
+
+int
+logger_is_enabled(logger_t *logger, int level)
+{
+	return level <= atomic_load_explicit(&logger->level, memory_order_relaxed);
 }
 
 void
@@ -102,38 +173,157 @@ logger_utf8_to_local(const char *str)
 	return ret;
 }
 
-void
-logger_log(logger_t *logger, int level, const char *fmt, ...)
+static void
+logger_deliver(logger_t *logger, int level, const char *msg)
 {
-	char buffer[4096];
-	va_list ap;
-
-	MUTEX_LOCK(logger->lvl_mutex);
-	if (level > logger->level) {
-		MUTEX_UNLOCK(logger->lvl_mutex);
-		return;
-	}
-	MUTEX_UNLOCK(logger->lvl_mutex);
-
-	buffer[sizeof(buffer)-1] = '\0';
-	va_start(ap, fmt);
-	vsnprintf(buffer, sizeof(buffer)-1, fmt, ap);
-	va_end(ap);
-
 	MUTEX_LOCK(logger->cb_mutex);
 	if (logger->callback) {
-		logger->callback(logger->cls, level, buffer);
+		logger->callback(logger->cls, level, msg);
 		MUTEX_UNLOCK(logger->cb_mutex);
 	} else {
 		char *local;
 		MUTEX_UNLOCK(logger->cb_mutex);
-		local = logger_utf8_to_local(buffer);
+		local = logger_utf8_to_local(msg);
 		if (local) {
 			fprintf(stderr, "%s\n", local);
 			free(local);
 		} else {
-			fprintf(stderr, "%s\n", buffer);
+			fprintf(stderr, "%s\n", msg);
+		}
+	}
+}
+
+/* Formats into buffer, or returns a heap copy when the message does not fit; buffer keeps it truncated if that fails */
+static char *
+logger_format(char *buffer, size_t size, const char *fmt, va_list ap)
+{
+	char *long_msg = NULL;
+	va_list copy;
+
+	va_copy(copy, ap);
+	int len = vsnprintf(buffer, size, fmt, ap);
+	if (len >= (int) size) {
+		long_msg = malloc(len + 1);
+		if (long_msg) {
+			vsnprintf(long_msg, len + 1, fmt, copy);
+		}
+	}
+	va_end(copy);
+	return long_msg;
+}
+
+/* Delivers every published message in order, returns how many there were */
+static int
+logger_drain(logger_t *logger)
+{
+	int count = 0;
+
+	for (;;) {
+		logger_entry_t *entry = &logger->entries[logger->head & (LOGGER_QUEUE_LENGTH - 1)];
+		if (atomic_load_explicit(&entry->sequence, memory_order_acquire) != logger->head + 1) {
+			break;
+		}
+		if (entry->long_msg) {
+			logger_deliver(logger, entry->level, entry->long_msg);
+			free(entry->long_msg);
+			entry->long_msg = NULL;
+		} else {
+			logger_deliver(logger, entry->level, entry->msg);
 		}
+		atomic_store_explicit(&entry->sequence, logger->head + LOGGER_QUEUE_LENGTH, memory_order_release);
+		logger->head++;
+		count++;
+	}
+
+	unsigned int dropped = atomic_exchange(&logger->dropped, 0);
+	if (dropped) {
+		char buffer[64];
+		snprintf(buffer, sizeof(buffer), "logger dropped %u messages", dropped);
+		logger_deliver(logger, LOGGER_WARNING, buffer);
 	}
+	return count;
 }
 
+static THREAD_RETVAL
+logger_thread(void *arg)
+{
+	logger_t *logger = arg;
+
+	while (!atomic_load(&logger->quit)) {
+		if (logger_drain(logger)) {
+			continue;
+		}
+
+		struct timeval now;
+		struct timespec wait_time;
+		MUTEX_LOCK(logger->wait_mutex);
+		atomic_store(&logger->waiting, 1);
+		/* Look once more now that producers can see we are about to sleep */
+		logger_entry_t *entry = &logger->entries[logger->head & (LOGGER_QUEUE_LENGTH - 1)];
+		if (atomic_load(&entry->sequence) != logger->head + 1 && !atomic_load(&logger->quit)) {
+			gettimeofday(&now, NULL);
+			wait_time.tv_sec = now.tv_sec;
+			wait_time.tv_nsec = (now.tv_usec + LOGGER_WAIT_MS * 1000) * 1000;
+			if (wait_time.tv_nsec >= 1000000000) {
+				wait_time.tv_sec++;
+				wait_time.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&logger->wait_cond, &logger->wait_mutex, &wait_time);
+		}
+		atomic_store(&logger->waiting, 0);
+		MUTEX_UNLOCK(logger->wait_mutex);
+	}
+
+	/* Whatever was logged before destroy still goes out */
+	logger_drain(logger);
+	return 0;
+}
+
+void
+logger_log(logger_t *logger, int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!logger_is_enabled(logger, level)) {
+		return;
+	}
+
+	if (!logger->running) {
+		char buffer[LOGGER_MESSAGE_SIZE];
+		va_start(ap, fmt);
+		char *long_msg = logger_format(buffer, sizeof(buffer), fmt, ap);
+		va_end(ap);
+		logger_deliver(logger, level, long_msg ? long_msg : buffer);
+		free(long_msg);
+		return;
+	}
+
+	logger_entry_t *entry;
+	unsigned int pos = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+	for (;;) {
+		entry = &logger->entries[pos & (LOGGER_QUEUE_LENGTH - 1)];
+		int diff = (int) (atomic_load_explicit(&entry->sequence, memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&logger->tail, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* The drain thread has not caught up with a full ring */
+			atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+		}
+	}
+
+	entry->level = level;
+	va_start(ap, fmt);
+	entry->long_msg = logger_format(entry->msg, sizeof(entry->msg), fmt, ap);
+	va_end(ap);
+	atomic_store_explicit(&entry->sequence, pos + 1, memory_order_release);
+
+	if (atomic_load(&logger->waiting)) {
+		COND_SIGNAL(logger->wait_cond);
+	}
+}
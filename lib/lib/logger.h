@@ -39,8 +39,20 @@ void logger_destroy(logger_t *logger);
 void logger_set_level(logger_t *logger, int level);
 void logger_set_callback(logger_t *logger, logger_callback_t callback, void *cls);
 
+/* Lock-free check whether messages of the given level are kept */
+int logger_is_enabled(logger_t *logger, int level);
+/* Queues the message for the logging thread, never blocks the caller. Messages of any length
+ * are kept, long ones in a heap copy; only if that allocation fails is one cut to 1023 bytes */
 void logger_log(logger_t *logger, int level, const char *fmt, ...);
 
+/* Same as logger_log but the arguments are not evaluated at all when the level is off */
+#define LOGGER_LOG(logger, level, ...) \
+	do { \
+		if (logger_is_enabled((logger), (level))) { \
+			logger_log((logger), (level), __VA_ARGS__); \
+		} \
+	} while (0)
+
 #ifdef __cplusplus
 }
 #endif
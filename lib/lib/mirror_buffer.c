@@ -24,6 +24,36 @@
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <stdatomic.h>
+#include "memalign.h"
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+/* Each buffer is allocated on first use and only ever grows, in steps of the granularity */
+#define MIRROR_BUFFER_FRAME_ALIGN 64
+#define MIRROR_BUFFER_FRAME_GRANULARITY 65536
+
+/* Frames from this size on are decrypted by several threads, smaller ones are not worth the handoff */
+#define MIRROR_BUFFER_PARALLEL_THRESHOLD (256 * 1024)
+#define MIRROR_BUFFER_MAX_WORKERS 4
+
+typedef struct mirror_worker_s {
+    struct mirror_buffer_s *mirror_buffer;
+    thread_handle_t thread;
+    /* Own context on the same key, moved to the segment it is given */
+    aes_ctx_t *aes_ctx;
+    int index;
+} mirror_worker_t;
+
+typedef struct mirror_frame_s {
+    /* Taken by the reading thread, given back by whichever thread consumed the frame */
+    atomic_int in_use;
+    unsigned char *data;
+    int capacity;
+} mirror_frame_t;
 
 //#define DUMP_KEI_IV
 struct mirror_buffer_s {
@@ -35,8 +65,152 @@ struct mirror_buffer_s {
     // Need secondary processing to use
     unsigned char aeskey[RAOP_AESKEY_LEN];
     unsigned char ecdh_secret[32];
+
+    /* Frames are read from the socket into these and decrypted where they are */
+    mirror_frame_t frames[MIRROR_BUFFER_POOL_SIZE];
+
+    /* Decrypt large frames in counter aligned segments, the calling thread takes the first */
+    int thread_limit;
+    int worker_count;
+    mirror_worker_t workers[MIRROR_BUFFER_MAX_WORKERS];
+
+    /* MUTEX LOCKED VARIABLES START */
+    mutex_handle_t job_mutex;
+    cond_handle_t job_cond;
+    cond_handle_t done_cond;
+    unsigned int job_generation;
+    int job_pending;
+    int job_quit;
+    unsigned char *job_data;
+    int job_len;
+    int job_segment;
+    uint64_t job_position;
+    /* MUTEX LOCKED VARIABLES END */
 };
 
+static THREAD_RETVAL
+mirror_buffer_worker_thread(void *arg)
+{
+    mirror_worker_t *worker = arg;
+    mirror_buffer_t *mirror_buffer = worker->mirror_buffer;
+    unsigned int seen = 0;
+
+    MUTEX_LOCK(mirror_buffer->job_mutex);
+    while (1) {
+        while (mirror_buffer->job_generation == seen && !mirror_buffer->job_quit) {
+            pthread_cond_wait(&mirror_buffer->job_cond, &mirror_buffer->job_mutex);
+        }
+        if (mirror_buffer->job_quit) {
+            break;
+        }
+        seen = mirror_buffer->job_generation;
+        unsigned char *data = mirror_buffer->job_data;
+        int len = mirror_buffer->job_len;
+        int segment = mirror_buffer->job_segment;
+        uint64_t position = mirror_buffer->job_position;
+        MUTEX_UNLOCK(mirror_buffer->job_mutex);
+
+        int start = (worker->index + 1) * segment;
+        if (start < len) {
+            int count = (len - start < segment) ? len - start : segment;
+            aes_ctr_set_position(worker->aes_ctx, position + start);
+            aes_ctr_decrypt(worker->aes_ctx, data + start, data + start, count);
+        }
+
+        MUTEX_LOCK(mirror_buffer->job_mutex);
+        if (--mirror_buffer->job_pending == 0) {
+            COND_SIGNAL(mirror_buffer->done_cond);
+        }
+    }
+    MUTEX_UNLOCK(mirror_buffer->job_mutex);
+    return 0;
+}
+
+static void
+mirror_buffer_stop_workers(mirror_buffer_t *mirror_buffer)
+{
+    if (!mirror_buffer->worker_count) {
+        return;
+    }
+    MUTEX_LOCK(mirror_buffer->job_mutex);
+    mirror_buffer->job_quit = 1;
+    pthread_cond_broadcast(&mirror_buffer->job_cond);
+    MUTEX_UNLOCK(mirror_buffer->job_mutex);
+    for (int i = 0; i < mirror_buffer->worker_count; i++) {
+        THREAD_JOIN(mirror_buffer->workers[i].thread);
+        aes_ctr_destroy(mirror_buffer->workers[i].aes_ctx);
+    }
+    mirror_buffer->worker_count = 0;
+    mirror_buffer->job_quit = 0;
+}
+
+/* One worker per spare core, none on a single core, unless a thread count was set */
+static void
+mirror_buffer_start_workers(mirror_buffer_t *mirror_buffer, const unsigned char *key, const unsigned char *iv)
+{
+    int cores;
+#if defined(WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    cores = si.dwNumberOfProcessors;
+#else
+    cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (mirror_buffer->thread_limit > 0) {
+        cores = mirror_buffer->thread_limit;
+    }
+    int count = cores - 1;
+    if (count > MIRROR_BUFFER_MAX_WORKERS) count = MIRROR_BUFFER_MAX_WORKERS;
+
+    for (int i = 0; i < count; i++) {
+        mirror_worker_t *worker = &mirror_buffer->workers[i];
+        worker->mirror_buffer = mirror_buffer;
+        worker->index = i;
+        worker->aes_ctx = aes_ctr_init(key, iv);
+        THREAD_CREATE(worker->thread, mirror_buffer_worker_thread, worker);
+        if (!worker->thread) {
+            aes_ctr_destroy(worker->aes_ctx);
+            break;
+        }
+        mirror_buffer->worker_count++;
+    }
+    LOGGER_LOG(mirror_buffer->logger, LOGGER_DEBUG, "mirror_buffer decrypting large frames on %d threads", mirror_buffer->worker_count + 1);
+}
+
+/* Decrypts whole blocks, splitting large runs across the workers */
+static void
+mirror_buffer_decrypt_blocks(mirror_buffer_t *mirror_buffer, unsigned char *data, int len)
+{
+    if (len < MIRROR_BUFFER_PARALLEL_THRESHOLD || !mirror_buffer->worker_count) {
+        aes_ctr_decrypt(mirror_buffer->aes_ctx, data, data, len);
+        return;
+    }
+
+    uint64_t position = aes_ctr_get_position(mirror_buffer->aes_ctx);
+    int segment = (len / (mirror_buffer->worker_count + 1) + AES_128_BLOCK_SIZE - 1) / AES_128_BLOCK_SIZE * AES_128_BLOCK_SIZE;
+
+    MUTEX_LOCK(mirror_buffer->job_mutex);
+    mirror_buffer->job_data = data;
+    mirror_buffer->job_len = len;
+    mirror_buffer->job_segment = segment;
+    mirror_buffer->job_position = position;
+    mirror_buffer->job_pending = mirror_buffer->worker_count;
+    mirror_buffer->job_generation++;
+    pthread_cond_broadcast(&mirror_buffer->job_cond);
+    MUTEX_UNLOCK(mirror_buffer->job_mutex);
+
+    aes_ctr_decrypt(mirror_buffer->aes_ctx, data, data, len < segment ? len : segment);
+
+    MUTEX_LOCK(mirror_buffer->job_mutex);
+    while (mirror_buffer->job_pending) {
+        pthread_cond_wait(&mirror_buffer->done_cond, &mirror_buffer->job_mutex);
+    }
+    MUTEX_UNLOCK(mirror_buffer->job_mutex);
+
+    /* Carry on after the last segment */
+    aes_ctr_set_position(mirror_buffer->aes_ctx, position + len);
+}
+
 void
 mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, uint64_t streamConnectionID)
 {
@@ -77,8 +251,11 @@ mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, uint64_t streamConnection
     fclose(keyfile);
 #endif
     // Need to be initialized externally
+    mirror_buffer_stop_workers(mirror_buffer);
+    aes_ctr_destroy(mirror_buffer->aes_ctx);
     mirror_buffer->aes_ctx = aes_ctr_init(decrypt_aeskey, decrypt_aesiv);
     mirror_buffer->nextDecryptCount = 0;
+    mirror_buffer_start_workers(mirror_buffer, decrypt_aeskey, decrypt_aesiv);
 }
 
 mirror_buffer_t *
@@ -97,38 +274,108 @@ mirror_buffer_init(logger_t *logger,
     memcpy(mirror_buffer->ecdh_secret, ecdh_secret, 32);
     mirror_buffer->logger = logger;
     mirror_buffer->nextDecryptCount = 0;
+    for (int i = 0; i < MIRROR_BUFFER_POOL_SIZE; i++) {
+        atomic_init(&mirror_buffer->frames[i].in_use, 0);
+    }
+    MUTEX_CREATE(mirror_buffer->job_mutex);
+    COND_CREATE(mirror_buffer->job_cond);
+    COND_CREATE(mirror_buffer->done_cond);
     //mirror_buffer_init_aes(mirror_buffer, aeskey, ecdh_secret, streamConnectionID);
     return mirror_buffer;
 }
 
-void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, unsigned char* input, unsigned char* output, int inputLen) {
-    // Start decrypting
-    if (mirror_buffer->nextDecryptCount > 0) {//mirror_buffer->nextDecryptCount = 10
-        for (int i = 0; i < mirror_buffer->nextDecryptCount; i++) {
-            output[i] = (input[i] ^ mirror_buffer->og[(16 - mirror_buffer->nextDecryptCount) + i]);
+void
+mirror_buffer_set_threads(mirror_buffer_t *mirror_buffer, int threads)
+{
+    assert(mirror_buffer);
+    mirror_buffer->thread_limit = threads;
+}
+
+int
+mirror_buffer_acquire_frame(mirror_buffer_t *mirror_buffer, int datalen, unsigned char **data)
+{
+    mirror_frame_t *frame = NULL;
+    int expected, index = -1;
+
+    assert(mirror_buffer);
+    assert(datalen >= 0);
+    assert(data);
+
+    int needed = datalen + MIRROR_BUFFER_FRAME_PADDING;
+    /* Prefer a free buffer that is large enough already, else grow any free one */
+    for (int i = 0; i < MIRROR_BUFFER_POOL_SIZE && !frame; i++) {
+        expected = 0;
+        if (mirror_buffer->frames[i].capacity >= needed &&
+            atomic_compare_exchange_strong(&mirror_buffer->frames[i].in_use, &expected, 1)) {
+            frame = &mirror_buffer->frames[i];
+            index = i;
+        }
+    }
+    for (int i = 0; i < MIRROR_BUFFER_POOL_SIZE && !frame; i++) {
+        expected = 0;
+        if (atomic_compare_exchange_strong(&mirror_buffer->frames[i].in_use, &expected, 1)) {
+            frame = &mirror_buffer->frames[i];
+            index = i;
         }
     }
-    // Handling encrypted bytes
-    int encryptlen = ((inputLen - mirror_buffer->nextDecryptCount) / 16) * 16;
-    // Aes decryption
+    if (!frame) {
+        return -1;
+    }
+
+    if (frame->capacity < needed) {
+        int capacity = (needed + MIRROR_BUFFER_FRAME_GRANULARITY - 1) / MIRROR_BUFFER_FRAME_GRANULARITY * MIRROR_BUFFER_FRAME_GRANULARITY;
+        if (frame->data) {
+            ALIGNED_FREE(frame->data);
+        }
+        ALIGNED_MALLOC(frame->data, MIRROR_BUFFER_FRAME_ALIGN, capacity);
+        if (!frame->data) {
+            frame->capacity = 0;
+            atomic_store(&frame->in_use, 0);
+            return -1;
+        }
+        frame->capacity = capacity;
+        LOGGER_LOG(mirror_buffer->logger, LOGGER_DEBUG, "mirror_buffer frame buffer grown to %d", capacity);
+    }
+    memset(frame->data + datalen, 0, MIRROR_BUFFER_FRAME_PADDING);
+    *data = frame->data;
+    return index;
+}
+
+void
+mirror_buffer_release_frame(mirror_buffer_t *mirror_buffer, int frame)
+{
+    assert(mirror_buffer);
+    assert(frame >= 0 && frame < MIRROR_BUFFER_POOL_SIZE);
+
+    atomic_store_explicit(&mirror_buffer->frames[frame].in_use, 0, memory_order_release);
+}
+
+void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, unsigned char *data, int datalen) {
+    // Finish the block left over from the previous frame
+    int start = mirror_buffer->nextDecryptCount;
+    if (start >= datalen) {
+        for (int i = 0; i < datalen; i++) {
+            data[i] ^= mirror_buffer->og[(16 - mirror_buffer->nextDecryptCount) + i];
+        }
+        mirror_buffer->nextDecryptCount -= datalen;
+        return;
+    }
+    for (int i = 0; i < start; i++) {
+        data[i] ^= mirror_buffer->og[(16 - mirror_buffer->nextDecryptCount) + i];
+    }
+    // Whole blocks are decrypted where they are
+    int encryptlen = ((datalen - start) / 16) * 16;
     aes_ctr_start_fresh_block(mirror_buffer->aes_ctx);
-    aes_ctr_decrypt(mirror_buffer->aes_ctx, input + mirror_buffer->nextDecryptCount,
-                    input + mirror_buffer->nextDecryptCount, encryptlen);
-    // Copy to output
-    memcpy(output + mirror_buffer->nextDecryptCount, input + mirror_buffer->nextDecryptCount, encryptlen);
-    int outputlength = mirror_buffer->nextDecryptCount + encryptlen;
+    mirror_buffer_decrypt_blocks(mirror_buffer, data + start, encryptlen);
     // Processing remaining length
-    int restlen = (inputLen - mirror_buffer->nextDecryptCount) % 16;
-    int reststart = inputLen - restlen;
+    int restlen = (datalen - start) % 16;
+    int reststart = datalen - restlen;
     mirror_buffer->nextDecryptCount = 0;
     if (restlen > 0) {
         memset(mirror_buffer->og, 0, 16);
-        memcpy(mirror_buffer->og, input + reststart, restlen);
+        memcpy(mirror_buffer->og, data + reststart, restlen);
         aes_ctr_decrypt(mirror_buffer->aes_ctx, mirror_buffer->og, mirror_buffer->og, 16);
-        for (int j = 0; j < restlen; j++) {
-            output[reststart + j] = mirror_buffer->og[j];
-        }
-        outputlength += restlen;
+        memcpy(data + reststart, mirror_buffer->og, restlen);
         mirror_buffer->nextDecryptCount = 16 - restlen;// Difference 16-6=10 bytes
     }
 }
@@ -137,7 +384,16 @@ void
 mirror_buffer_destroy(mirror_buffer_t *mirror_buffer)
 {
     if (mirror_buffer) {
+        mirror_buffer_stop_workers(mirror_buffer);
         aes_ctr_destroy(mirror_buffer->aes_ctx);
+        MUTEX_DESTROY(mirror_buffer->job_mutex);
+        COND_DESTROY(mirror_buffer->job_cond);
+        COND_DESTROY(mirror_buffer->done_cond);
+        for (int i = 0; i < MIRROR_BUFFER_POOL_SIZE; i++) {
+            if (mirror_buffer->frames[i].data) {
+                ALIGNED_FREE(mirror_buffer->frames[i].data);
+            }
+        }
         free(mirror_buffer);
     }
 }
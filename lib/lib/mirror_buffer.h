@@ -25,6 +25,19 @@ mirror_buffer_t *mirror_buffer_init( logger_t *logger,
         const unsigned char *aeskey,
         const unsigned char *ecdh_secret);
 void mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, uint64_t streamConnectionID);
-void mirror_buffer_decrypt(mirror_buffer_t *raop_mirror, unsigned char* input, unsigned char* output, int datalen);
+/* Threads that decrypt a large frame, the caller included, 0 for one per core.
+ * Takes effect on the next mirror_buffer_init_aes */
+void mirror_buffer_set_threads(mirror_buffer_t *mirror_buffer, int threads);
+/* Frames in flight at once, counting the one being read and the one being consumed */
+#define MIRROR_BUFFER_POOL_SIZE 16
+/* Zeroed bytes after every pooled frame, so decoders may read past the end */
+#define MIRROR_BUFFER_FRAME_PADDING 64
+/* Takes a frame for datalen bytes and points data at its aligned buffer.
+ * Returns the handle to release it by, or -1 when all are in use */
+int mirror_buffer_acquire_frame(mirror_buffer_t *mirror_buffer, int datalen, unsigned char **data);
+/* Gives a frame back to the pool by its handle, may be called from any thread */
+void mirror_buffer_release_frame(mirror_buffer_t *mirror_buffer, int frame);
+/* Decrypts the next datalen bytes of the stream in place */
+void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, unsigned char *data, int datalen);
 void mirror_buffer_destroy(mirror_buffer_t *mirror_buffer);
 #endif //MIRROR_BUFFER_H
@@ -20,6 +20,7 @@
 #include "raop.h"
 #include "raop_rtp.h"
 #include "raop_rtp.h"
+#include "raop_buffer.h"
 #include "pairing.h"
 #include "httpd.h"
 
@@ -30,6 +31,7 @@
 #include "compat.h"
 #include "raop_rtp_mirror.h"
 #include "raop_ntp.h"
+#include "llhttp/llhttp.h"
 
 struct raop_s {
     /* Callbacks for audio and video */
@@ -45,6 +47,26 @@ struct raop_s {
     dnssd_t *dnssd;
 
     unsigned short port;
+
+    /* Bounds of the adaptive audio reorder window, 0 for the default */
+    unsigned short audio_buffer_min;
+    unsigned short audio_buffer_max;
+
+    /* Scheduled audio playout, off by default */
+    int audio_playout;
+    unsigned int audio_output_latency;
+    int audio_resampling;
+    int video_queue_depth;
+    int video_hevc;
+
+    /* Written by the httpd thread, read by raop_get_route_stats */
+    mutex_handle_t stats_mutex;
+    raop_route_stats_t route_stats[RAOP_ROUTE_COUNT];
+
+    /* The session the public getters report on, cleared before it is destroyed */
+    mutex_handle_t session_mutex;
+    raop_rtp_t *audio_session;
+    raop_rtp_mirror_t *mirror_session;
 };
 
 struct raop_conn_s {
@@ -64,8 +86,132 @@ struct raop_conn_s {
 };
 typedef struct raop_conn_s raop_conn_t;
 
+static void
+raop_set_audio_session(raop_t *raop, raop_rtp_t *raop_rtp) {
+    MUTEX_LOCK(raop->session_mutex);
+    raop->audio_session = raop_rtp;
+    MUTEX_UNLOCK(raop->session_mutex);
+}
+
+/* Called before destroying a session, which is only forgotten if it is still the reported one */
+static void
+raop_clear_audio_session(raop_t *raop, raop_rtp_t *raop_rtp) {
+    MUTEX_LOCK(raop->session_mutex);
+    if (raop->audio_session == raop_rtp) {
+        raop->audio_session = NULL;
+    }
+    MUTEX_UNLOCK(raop->session_mutex);
+}
+
+static void
+raop_set_mirror_session(raop_t *raop, raop_rtp_mirror_t *raop_rtp_mirror) {
+    MUTEX_LOCK(raop->session_mutex);
+    raop->mirror_session = raop_rtp_mirror;
+    MUTEX_UNLOCK(raop->session_mutex);
+}
+
+static void
+raop_clear_mirror_session(raop_t *raop, raop_rtp_mirror_t *raop_rtp_mirror) {
+    MUTEX_LOCK(raop->session_mutex);
+    if (raop->mirror_session == raop_rtp_mirror) {
+        raop->mirror_session = NULL;
+    }
+    MUTEX_UNLOCK(raop->session_mutex);
+}
+
 #include "raop_handlers.h"
 
+enum raop_route_e {
+    RAOP_ROUTE_INFO,
+    RAOP_ROUTE_PAIR_SETUP,
+    RAOP_ROUTE_PAIR_VERIFY,
+    RAOP_ROUTE_FP_SETUP,
+    RAOP_ROUTE_FEEDBACK,
+    RAOP_ROUTE_OPTIONS,
+    RAOP_ROUTE_SETUP,
+    RAOP_ROUTE_GET_PARAMETER,
+    RAOP_ROUTE_SET_PARAMETER,
+    RAOP_ROUTE_RECORD,
+    RAOP_ROUTE_FLUSH,
+    RAOP_ROUTE_TEARDOWN,
+    RAOP_ROUTE_OTHER
+};
+
+/* Sized by the public count, so a route added here without raising it does not compile */
+static const struct {
+    const char *name;
+    raop_handler_t handler;
+} raop_routes[RAOP_ROUTE_COUNT] = {
+    [RAOP_ROUTE_INFO] = { "GET /info", &raop_handler_info },
+    [RAOP_ROUTE_PAIR_SETUP] = { "POST /pair-setup", &raop_handler_pairsetup },
+    [RAOP_ROUTE_PAIR_VERIFY] = { "POST /pair-verify", &raop_handler_pairverify },
+    [RAOP_ROUTE_FP_SETUP] = { "POST /fp-setup", &raop_handler_fpsetup },
+    [RAOP_ROUTE_FEEDBACK] = { "POST /feedback", &raop_handler_feedback },
+    [RAOP_ROUTE_OPTIONS] = { "OPTIONS", &raop_handler_options },
+    [RAOP_ROUTE_SETUP] = { "SETUP", &raop_handler_setup },
+    [RAOP_ROUTE_GET_PARAMETER] = { "GET_PARAMETER", &raop_handler_get_parameter },
+    [RAOP_ROUTE_SET_PARAMETER] = { "SET_PARAMETER", &raop_handler_set_parameter },
+    [RAOP_ROUTE_RECORD] = { "RECORD", &raop_handler_record },
+    [RAOP_ROUTE_FLUSH] = { "FLUSH", &raop_handler_flush },
+    [RAOP_ROUTE_TEARDOWN] = { "TEARDOWN", &raop_handler_teardown },
+    [RAOP_ROUTE_OTHER] = { "OTHER", NULL },
+};
+
+/* RTSP methods route regardless of URL, only the HTTP ones look at it */
+static int
+raop_route(int method, const char *url)
+{
+    size_t url_len = url ? strlen(url) : 0;
+
+    switch (method) {
+        case HTTP_GET:
+            if (url_len == 5 && !memcmp(url, "/info", 5)) return RAOP_ROUTE_INFO;
+            break;
+        case HTTP_POST:
+            switch (url_len) {
+                case 9:
+                    if (!memcmp(url, "/fp-setup", 9)) return RAOP_ROUTE_FP_SETUP;
+                    if (!memcmp(url, "/feedback", 9)) return RAOP_ROUTE_FEEDBACK;
+                    break;
+                case 11:
+                    if (!memcmp(url, "/pair-setup", 11)) return RAOP_ROUTE_PAIR_SETUP;
+                    break;
+                case 12:
+                    if (!memcmp(url, "/pair-verify", 12)) return RAOP_ROUTE_PAIR_VERIFY;
+                    break;
+            }
+            break;
+        case HTTP_OPTIONS: return RAOP_ROUTE_OPTIONS;
+        case HTTP_SETUP: return RAOP_ROUTE_SETUP;
+        case HTTP_GET_PARAMETER: return RAOP_ROUTE_GET_PARAMETER;
+        case HTTP_SET_PARAMETER: return RAOP_ROUTE_SET_PARAMETER;
+        case HTTP_RECORD: return RAOP_ROUTE_RECORD;
+        case HTTP_FLUSH: return RAOP_ROUTE_FLUSH;
+        case HTTP_TEARDOWN: return RAOP_ROUTE_TEARDOWN;
+    }
+    return RAOP_ROUTE_OTHER;
+}
+
+static void
+raop_route_record(raop_t *raop, int route, uint64_t elapsed_us)
+{
+    raop_route_stats_t *stats = &raop->route_stats[route];
+    int bucket = 0;
+
+    while (bucket < RAOP_ROUTE_LATENCY_BUCKETS - 1 && elapsed_us >= (64ull << bucket)) {
+        bucket++;
+    }
+
+    MUTEX_LOCK(raop->stats_mutex);
+    stats->requests++;
+    stats->total_us += elapsed_us;
+    if (elapsed_us > stats->max_us) {
+        stats->max_us = elapsed_us;
+    }
+    stats->latency[bucket]++;
+    MUTEX_UNLOCK(raop->stats_mutex);
+}
+
 static void *
 conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remote, int remotelen) {
     raop_t *raop = opaque;
@@ -137,7 +283,7 @@ conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remot
 static void
 conn_request(void *ptr, http_request_t *request, http_response_t **response) {
     raop_conn_t *conn = ptr;
-    logger_log(conn->raop->logger, LOGGER_DEBUG, "conn_request");
+    LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "conn_request");
     const char *method;
     const char *url;
     const char *cseq;
@@ -147,7 +293,7 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
 
     method = http_request_get_method(request);
     url = http_request_get_url(request);
-    cseq = http_request_get_header(request, "CSeq");
+    cseq = http_request_get_header_key(request, HTTP_HEADER_CSEQ);
     if (!method || !cseq) {
         return;
     }
@@ -156,68 +302,19 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
 
     http_response_add_header(*response, "CSeq", cseq);
     //http_response_add_header(*response, "Apple-Jack-Status", "connected; type=analog");
-    http_response_add_header(*response, "Server", "AirTunes/220.68");
-
-    logger_log(conn->raop->logger, LOGGER_DEBUG, "Handling request %s with URL %s", method, url);
-    raop_handler_t handler = NULL;
-    if (!strcmp(method, "GET") && !strcmp(url, "/info")) {
-        handler = &raop_handler_info;
-    } else if (!strcmp(method, "POST") && !strcmp(url, "/pair-setup")) {
-        handler = &raop_handler_pairsetup;
-    } else if (!strcmp(method, "POST") && !strcmp(url, "/pair-verify")) {
-        handler = &raop_handler_pairverify;
-    } else if (!strcmp(method, "POST") && !strcmp(url, "/fp-setup")) {
-        handler = &raop_handler_fpsetup;
-    } else if (!strcmp(method, "OPTIONS")) {
-        handler = &raop_handler_options;
-    } else if (!strcmp(method, "SETUP")) {
-        handler = &raop_handler_setup;
-    } else if (!strcmp(method, "GET_PARAMETER")) {
-        handler = &raop_handler_get_parameter;
-    } else if (!strcmp(method, "SET_PARAMETER")) {
-        handler = &raop_handler_set_parameter;
-    } else if (!strcmp(method, "POST") && !strcmp(url, "/feedback")) {
-        handler = &raop_handler_feedback;
-    } else if (!strcmp(method, "RECORD")) {
-        handler = &raop_handler_record;
-    } else if (!strcmp(method, "FLUSH")) {
-        const char *rtpinfo;
-        int next_seq = -1;
-
-        rtpinfo = http_request_get_header(request, "RTP-Info");
-        if (rtpinfo) {
-            logger_log(conn->raop->logger, LOGGER_DEBUG, "Flush with RTP-Info: %s", rtpinfo);
-            if (!strncmp(rtpinfo, "seq=", 4)) {
-                next_seq = strtol(rtpinfo + 4, NULL, 10);
-            }
-        }
-        if (conn->raop_rtp) {
-            raop_rtp_flush(conn->raop_rtp, next_seq);
-        } else {
-            logger_log(conn->raop->logger, LOGGER_WARNING, "RAOP not initialized at FLUSH");
-        }
-    } else if (!strcmp(method, "TEARDOWN")) {
-        //http_response_add_header(*response, "Connection", "close");
-        if (conn->raop_rtp != NULL && raop_rtp_is_running(conn->raop_rtp)) {
-            /* Destroy our RTP session */
-            raop_rtp_stop(conn->raop_rtp);
-        } else if (conn->raop_rtp_mirror) {
-            /* Destroy our sessions */
-            raop_rtp_destroy(conn->raop_rtp);
-            conn->raop_rtp = NULL;
-            raop_rtp_mirror_destroy(conn->raop_rtp_mirror);
-            conn->raop_rtp_mirror = NULL;
-        }
-    }
+    http_response_add_header_line(*response, "Server: AirTunes/220.68\r\n");
+
+    LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "Handling request %s with URL %s", method, url);
+    uint64_t start_time = raop_ntp_get_local_time(conn->raop_ntp);
+    int route = raop_route(http_request_get_method_id(request), url);
+    raop_handler_t handler = raop_routes[route].handler;
     if (handler != NULL) {
         handler(conn, request, *response, &response_data, &response_datalen);
     }
-    http_response_finish(*response, response_data, response_datalen);
-    if (response_data) {
-        free(response_data);
-        response_data = NULL;
-        response_datalen = 0;
-    }
+    /* The body is sent straight from the handler's buffer, which the response frees */
+    http_response_finish_owned(*response, response_data, response_datalen);
+    uint64_t end_time = raop_ntp_get_local_time(conn->raop_ntp);
+    raop_route_record(conn->raop, route, end_time > start_time ? end_time - start_time : 0);
 }
 
 static void
@@ -237,10 +334,12 @@ conn_destroy(void *ptr) {
     }
     if (conn->raop_rtp) {
         /* This is done in case TEARDOWN was not called */
+        raop_clear_audio_session(conn->raop, conn->raop_rtp);
         raop_rtp_destroy(conn->raop_rtp);
     }
     if (conn->raop_rtp_mirror) {
         /* This is done in case TEARDOWN was not called */
+        raop_clear_mirror_session(conn->raop, conn->raop_rtp_mirror);
         raop_rtp_mirror_destroy(conn->raop_rtp_mirror);
     }
 
@@ -262,7 +361,7 @@ raop_init(int max_clients, raop_callbacks_t *callbacks) {
 
     assert(callbacks);
     assert(max_clients > 0);
-    assert(max_clients < 100);
+    assert(max_clients <= HTTPD_MAX_CONNECTIONS);
 
     /* Initialize the network */
     if (netutils_init() < 0) {
@@ -307,6 +406,12 @@ raop_init(int max_clients, raop_callbacks_t *callbacks) {
     memcpy(&raop->callbacks, callbacks, sizeof(raop_callbacks_t));
     raop->pairing = pairing;
     raop->httpd = httpd;
+
+    MUTEX_CREATE(raop->stats_mutex);
+    MUTEX_CREATE(raop->session_mutex);
+    for (int i = 0; i < RAOP_ROUTE_COUNT; i++) {
+        raop->route_stats[i].name = raop_routes[i].name;
+    }
     return raop;
 }
 
@@ -316,6 +421,8 @@ raop_destroy(raop_t *raop) {
         raop_stop(raop);
         pairing_destroy(raop->pairing);
         httpd_destroy(raop->httpd);
+        MUTEX_DESTROY(raop->stats_mutex);
+        MUTEX_DESTROY(raop->session_mutex);
         logger_destroy(raop->logger);
         free(raop);
 
@@ -344,6 +451,41 @@ raop_set_port(raop_t *raop, unsigned short port) {
     raop->port = port;
 }
 
+void
+raop_set_audio_buffer_bounds(raop_t *raop, unsigned short min_packets, unsigned short max_packets) {
+    assert(raop);
+    raop->audio_buffer_min = min_packets;
+    raop->audio_buffer_max = max_packets;
+}
+
+void
+raop_set_audio_playout(raop_t *raop, int enabled, unsigned int output_latency_us) {
+    assert(raop);
+    raop->audio_playout = enabled;
+    raop->audio_output_latency = output_latency_us;
+}
+
+void
+raop_set_audio_resampling(raop_t *raop, int enabled) {
+    assert(raop);
+    raop->audio_resampling = enabled;
+}
+
+void
+raop_set_video_queue_depth(raop_t *raop, int frames) {
+    assert(raop);
+    raop->video_queue_depth = frames;
+}
+
+void
+raop_set_video_hevc(raop_t *raop, int enabled) {
+    assert(raop);
+    raop->video_hevc = enabled;
+    if (raop->dnssd) {
+        dnssd_set_hevc(raop->dnssd, enabled);
+    }
+}
+
 unsigned short
 raop_get_port(raop_t *raop) {
     assert(raop);
@@ -367,6 +509,58 @@ void
 raop_set_dnssd(raop_t *raop, dnssd_t *dnssd) {
     assert(dnssd);
     raop->dnssd = dnssd;
+    dnssd_set_hevc(dnssd, raop->video_hevc);
+}
+
+void
+raop_get_route_stats(raop_t *raop, raop_route_stats_t stats[RAOP_ROUTE_COUNT]) {
+    assert(raop);
+    assert(stats);
+
+    MUTEX_LOCK(raop->stats_mutex);
+    memcpy(stats, raop->route_stats, sizeof(raop->route_stats));
+    MUTEX_UNLOCK(raop->stats_mutex);
+}
+
+int
+raop_get_audio_stats(raop_t *raop, raop_audio_stats_t *stats) {
+    assert(raop);
+    assert(stats);
+
+    memset(stats, 0, sizeof(raop_audio_stats_t));
+    /* Held throughout so the session cannot be destroyed while it is read */
+    MUTEX_LOCK(raop->session_mutex);
+    if (!raop->audio_session) {
+        MUTEX_UNLOCK(raop->session_mutex);
+        return -1;
+    }
+    raop_rtp_get_jitter(raop->audio_session, &stats->buffer_depth, &stats->jitter_us);
+    raop_rtp_get_clock_drift(raop->audio_session, &stats->drift_ppm);
+    raop_buffer_stats_t buffer_stats;
+    raop_rtp_get_buffer_stats(raop->audio_session, &buffer_stats);
+    stats->resend_requests = buffer_stats.resend_requests;
+    stats->resend_requested = buffer_stats.resend_requested;
+    stats->resend_recovered = buffer_stats.resend_recovered;
+    stats->resend_late = buffer_stats.resend_late;
+    stats->lost = buffer_stats.lost;
+    MUTEX_UNLOCK(raop->session_mutex);
+    return 0;
+}
+
+int
+raop_get_mirror_stats(raop_t *raop, raop_mirror_stats_t *stats) {
+    assert(raop);
+    assert(stats);
+
+    memset(stats, 0, sizeof(raop_mirror_stats_t));
+    MUTEX_LOCK(raop->session_mutex);
+    if (!raop->mirror_session) {
+        MUTEX_UNLOCK(raop->session_mutex);
+        return -1;
+    }
+    raop_rtp_mirror_get_stats(raop->mirror_session, stats);
+    MUTEX_UNLOCK(raop->session_mutex);
+    return 0;
 }
 
 
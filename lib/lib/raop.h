@@ -29,6 +29,66 @@ extern "C" {
 
 typedef struct raop_s raop_t;
 
+/* Requests told apart by the RTSP server, each with its own statistics */
+#define RAOP_ROUTE_COUNT 13
+/* Bucket i counts requests handled in under 64 << i us, the last one all slower ones */
+#define RAOP_ROUTE_LATENCY_BUCKETS 12
+
+typedef struct raop_route_stats_s {
+    /* Method and URL, "OTHER" for requests without a handler */
+    const char *name;
+    uint64_t requests;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t latency[RAOP_ROUTE_LATENCY_BUCKETS];
+} raop_route_stats_t;
+
+/* The audio session being received, see raop_get_audio_stats */
+typedef struct raop_audio_stats_s {
+    /* Reorder window in packets and the RFC 3550 interarrival jitter */
+    unsigned short buffer_depth;
+    double jitter_us;
+    /* Rate of the sender's clock against ours */
+    double drift_ppm;
+    /* Resend requests sent, packets asked for, packets that arrived in time and too late */
+    uint64_t resend_requests;
+    uint64_t resend_requested;
+    uint64_t resend_recovered;
+    uint64_t resend_late;
+    /* Packets skipped because they never arrived */
+    uint64_t lost;
+} raop_audio_stats_t;
+
+/* The screen mirroring session being received, see raop_get_mirror_stats */
+typedef struct raop_mirror_stats_s {
+    /* Frames put on the delivery queue, dropped under backpressure, and handed to video_process */
+    uint64_t queued;
+    uint64_t dropped;
+    uint64_t delivered;
+
+    /* The rest covers the last window_frames video frames of the session, times are in microseconds */
+    int window_frames;
+    double frame_rate;
+    double bitrate; // Bits per second of payload
+    int frame_size_avg; // Bytes
+    int frame_size_p50;
+    int frame_size_p95;
+    int frame_size_max;
+    /* From the sender's timestamp to arrival, only meaningful once the clocks are synchronized */
+    int64_t latency_p50;
+    int64_t latency_p95;
+    int64_t latency_p99;
+    int64_t latency_max;
+    uint32_t decrypt_avg;
+    uint32_t decrypt_max;
+    /* Spent in video_process */
+    uint32_t callback_avg;
+    uint32_t callback_max;
+    /* Frames waiting for the delivery thread when the last one arrived, and the most seen */
+    int queue_depth;
+    int queue_depth_max;
+} raop_mirror_stats_t;
+
 typedef void (*raop_log_callback_t)(void *cls, int level, const char *msg);
 
 struct raop_callbacks_s {
@@ -47,6 +107,8 @@ struct raop_callbacks_s {
     void  (*audio_set_coverart)(void *cls, const void *buffer, int buflen);
     void  (*audio_remote_control_id)(void *cls, const char *dacp_id, const char *active_remote_header);
     void  (*audio_set_progress)(void *cls, unsigned int start, unsigned int curr, unsigned int end);
+    /* When set, AAC audio is decoded in the library and delivered here instead of to audio_process */
+    void  (*audio_process_pcm)(void *cls, raop_ntp_t *ntp, pcm_decode_struct *data, unsigned int streamId);
 };
 typedef struct raop_callbacks_s raop_callbacks_t;
 
@@ -55,12 +117,26 @@ RAOP_API raop_t *raop_init(int max_clients, raop_callbacks_t *callbacks);
 RAOP_API void raop_set_log_level(raop_t *raop, int level);
 RAOP_API void raop_set_log_callback(raop_t *raop, raop_log_callback_t callback, void *cls);
 RAOP_API void raop_set_port(raop_t *raop, unsigned short port);
+RAOP_API void raop_set_audio_buffer_bounds(raop_t *raop, unsigned short min_packets, unsigned short max_packets);
+RAOP_API void raop_set_audio_playout(raop_t *raop, int enabled, unsigned int output_latency_us);
+RAOP_API void raop_set_audio_resampling(raop_t *raop, int enabled);
+/* Mirrored frames buffered ahead of video_process, which then runs on its own thread; 0 disables */
+RAOP_API void raop_set_video_queue_depth(raop_t *raop, int frames);
+/* Lets senders mirror in HEVC, video_process then sees frames tagged VIDEO_CODEC_HEVC. Needs to be set
+ * before the AirPlay service is registered */
+RAOP_API void raop_set_video_hevc(raop_t *raop, int enabled);
 RAOP_API unsigned short raop_get_port(raop_t *raop);
 RAOP_API void *raop_get_callback_cls(raop_t *raop);
 RAOP_API int raop_start(raop_t *raop, unsigned short *port);
 RAOP_API int raop_is_running(raop_t *raop);
 RAOP_API void raop_stop(raop_t *raop);
 RAOP_API void raop_set_dnssd(raop_t *raop, dnssd_t *dnssd);
+/* Copies the counters of every route since raop_init */
+RAOP_API void raop_get_route_stats(raop_t *raop, raop_route_stats_t stats[RAOP_ROUTE_COUNT]);
+/* Reports on the most recently set up audio session, returns -1 when there is none */
+RAOP_API int raop_get_audio_stats(raop_t *raop, raop_audio_stats_t *stats);
+/* Same for the most recently set up mirroring session */
+RAOP_API int raop_get_mirror_stats(raop_t *raop, raop_mirror_stats_t *stats);
 RAOP_API void raop_destroy(raop_t *raop);
 
 #ifdef __cplusplus
@@ -27,7 +27,22 @@
 #include "compat.h"
 #include "stream.h"
 
-#define RAOP_BUFFER_LENGTH 32
+/* Packets kept on top of the jitter estimate, leaves room for a resend round trip */
+#define RAOP_BUFFER_JITTER_MARGIN 4
+/* The window is sized to cover this many times the mean jitter */
+#define RAOP_BUFFER_JITTER_FACTOR 4.0
+/* Number of consecutive packets asking for a smaller window before shrinking by one */
+#define RAOP_BUFFER_SHRINK_HOLD 128
+
+/* Resend pacing: first retry interval in microseconds, doubled after every request */
+#define RAOP_BUFFER_RESEND_INTERVAL 20000
+#define RAOP_BUFFER_RESEND_RETRIES 4
+/* A missing packet is no longer requested this long after its loss was noticed */
+#define RAOP_BUFFER_RESEND_TIMEOUT 250000
+
+/* Payload slots are carved out of one slab, aligned to a cache line */
+#define RAOP_BUFFER_SLAB_ALIGN 64
+#define RAOP_BUFFER_SLOT_SIZE RAOP_PACKET_LEN
 
 typedef struct {
     /* Data available */
@@ -37,9 +52,16 @@ typedef struct {
     unsigned short seqnum;
     uint64_t timestamp;
 
-    /* Payload data */
+    /* Payload data, points into the slot owned by this entry */
     unsigned int payload_size;
-    void *payload_data;
+    unsigned char *payload_data;
+
+    /* Resend state while the packet for resend_seqnum is missing */
+    int resend_pending;
+    unsigned short resend_seqnum;
+    unsigned int resend_retries;
+    uint64_t resend_next;
+    uint64_t resend_deadline;
 } raop_buffer_entry_t;
 
 struct raop_buffer_s {
@@ -48,13 +70,31 @@ struct raop_buffer_s {
     unsigned char aeskey[RAOP_AESKEY_LEN];
     unsigned char aesiv[RAOP_AESIV_LEN];
 
+    /* Cipher context kept for the whole session, only the IV is reset per packet */
+    aes_ctx_t *aes_ctx;
+
     /* First and last seqnum */
     int is_empty;
     unsigned short first_seqnum;
     unsigned short last_seqnum;
 
+    /* Current reorder window and its bounds, in packets */
+    unsigned short buffer_length;
+    unsigned short min_length;
+    unsigned short max_length;
+    unsigned int shrink_count;
+
     /* RTP buffer entries */
     raop_buffer_entry_t entries[RAOP_BUFFER_LENGTH];
+
+    /* One bit per entry, set while the entry is filled */
+    uint32_t filled_map[(RAOP_BUFFER_LENGTH + 31) / 32];
+
+    /* Preallocated payload storage, one slot per entry */
+    unsigned char *payload_slab;
+
+    /* Statistics */
+    raop_buffer_stats_t stats;
 };
 
 void
@@ -102,29 +142,37 @@ raop_buffer_init(logger_t *logger,
     }
     raop_buffer->logger = logger;
     raop_buffer_init_key_iv(raop_buffer, aeskey, aesiv, ecdh_secret);
+    raop_buffer->aes_ctx = aes_cbc_init(raop_buffer->aeskey, raop_buffer->aesiv, AES_DECRYPT);
+
+    ALIGNED_MALLOC(raop_buffer->payload_slab, RAOP_BUFFER_SLAB_ALIGN, RAOP_BUFFER_LENGTH * RAOP_BUFFER_SLOT_SIZE);
+    if (!raop_buffer->payload_slab) {
+        aes_cbc_destroy(raop_buffer->aes_ctx);
+        free(raop_buffer);
+        return NULL;
+    }
 
     for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
         raop_buffer_entry_t *entry = &raop_buffer->entries[i];
-        entry->payload_data = NULL;
+        entry->payload_data = raop_buffer->payload_slab + i * RAOP_BUFFER_SLOT_SIZE;
         entry->payload_size = 0;
     }
 
     raop_buffer->is_empty = 1;
 
+    /* Start with the widest window and shrink once the link proves to be clean */
+    raop_buffer->min_length = RAOP_BUFFER_MIN_LENGTH;
+    raop_buffer->max_length = RAOP_BUFFER_LENGTH;
+    raop_buffer->buffer_length = RAOP_BUFFER_LENGTH;
+
     return raop_buffer;
 }
 
 void
 raop_buffer_destroy(raop_buffer_t *raop_buffer)
 {
-    for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
-        raop_buffer_entry_t *entry = &raop_buffer->entries[i];
-        if (entry->payload_data != NULL) {
-            free(entry->payload_data);
-        }
-    }
-
     if (raop_buffer) {
+        aes_cbc_destroy(raop_buffer->aes_ctx);
+        ALIGNED_FREE(raop_buffer->payload_slab);
         free(raop_buffer);
     }
 
@@ -145,6 +193,24 @@ seqnum_cmp(unsigned short s1, unsigned short s2)
     return (s1 - s2);
 }
 
+static inline void
+raop_buffer_set_filled(raop_buffer_t *raop_buffer, int index, int filled)
+{
+    raop_buffer->entries[index].filled = filled;
+    if (filled) {
+        raop_buffer->filled_map[index / 32] |= (1u << (index % 32));
+    } else {
+        raop_buffer->filled_map[index / 32] &= ~(1u << (index % 32));
+    }
+}
+
+static inline int
+raop_buffer_is_filled(raop_buffer_t *raop_buffer, unsigned short seqnum)
+{
+    int index = seqnum % RAOP_BUFFER_LENGTH;
+    return (raop_buffer->filled_map[index / 32] >> (index % 32)) & 1;
+}
+
 //#define DUMP_AUDIO
 
 #ifdef DUMP_AUDIO
@@ -173,10 +239,9 @@ raop_buffer_decrypt(raop_buffer_t *raop_buffer, unsigned char *data, unsigned ch
 
     encryptedlen = payload_size / 16*16;
     memset(output, 0, payload_size);
-    // Need to be initialized internally
-    aes_ctx_t *aes_ctx_audio = aes_cbc_init(raop_buffer->aeskey, raop_buffer->aesiv, AES_DECRYPT);
-    aes_cbc_decrypt(aes_ctx_audio, &data[12], output, encryptedlen);
-    aes_cbc_destroy(aes_ctx_audio);
+    // Every packet is encrypted from the session IV
+    aes_cbc_reset_iv(raop_buffer->aes_ctx, NULL);
+    aes_cbc_decrypt(raop_buffer->aes_ctx, &data[12], output, encryptedlen);
 
     memcpy(output + encryptedlen, &data[12 + encryptedlen], payload_size - encryptedlen);
     *outputlen = payload_size;
@@ -214,11 +279,12 @@ raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned sh
 
     /* If this packet is too late, just skip it */
     if (!raop_buffer->is_empty && seqnum_cmp(seqnum, raop_buffer->first_seqnum) < 0) {
+        raop_buffer->stats.resend_late++;
         return 0;
     }
 
     /* Check that there is always space in the buffer, otherwise flush */
-    if (seqnum_cmp(seqnum, raop_buffer->first_seqnum + RAOP_BUFFER_LENGTH) >= 0) {
+    if (seqnum_cmp(seqnum, raop_buffer->first_seqnum + raop_buffer->buffer_length) >= 0) {
         raop_buffer_flush(raop_buffer, seqnum);
     }
 
@@ -229,15 +295,22 @@ raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned sh
         return 0;
     }
 
+    /* A requested packet made it in time */
+    if (entry->resend_pending && entry->resend_seqnum == seqnum && entry->resend_retries > 0) {
+        raop_buffer->stats.resend_recovered++;
+    }
+    entry->resend_pending = 0;
+
     /* Update the raop_buffer entry header */
     entry->seqnum = seqnum;
     entry->timestamp = timestamp;
-    entry->filled = 1;
+    raop_buffer_set_filled(raop_buffer, seqnum % RAOP_BUFFER_LENGTH, 1);
 
-    entry->payload_data = malloc(payload_size);
+    /* Decrypt straight into the slot, no allocation needed */
     int decrypt_ret = raop_buffer_decrypt(raop_buffer, data, entry->payload_data, payload_size, &entry->payload_size);
     assert(decrypt_ret >= 0);
     assert(entry->payload_size <= payload_size);
+    raop_buffer->stats.enqueued++;
 
     /* Update the raop_buffer seqnums */
     if (raop_buffer->is_empty) {
@@ -252,8 +325,11 @@ raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned sh
 }
 
 void *
-raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *timestamp, int no_resend) {
+raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *timestamp, int no_resend, int *lost) {
     assert(raop_buffer);
+    assert(lost);
+
+    *lost = 0;
 
     /* Calculate number of entries in the current buffer */
     short entry_count = seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum)+1;
@@ -264,12 +340,13 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *
     }
 
     /* Get the first buffer entry for inspection */
-    raop_buffer_entry_t *entry = &raop_buffer->entries[raop_buffer->first_seqnum % RAOP_BUFFER_LENGTH];
+    int index = raop_buffer->first_seqnum % RAOP_BUFFER_LENGTH;
+    raop_buffer_entry_t *entry = &raop_buffer->entries[index];
     if (no_resend) {
         /* If we do no resends, always return the first entry */
     } else if (!entry->filled) {
         /* Check how much we have space left in the buffer */
-        if (entry_count < RAOP_BUFFER_LENGTH) {
+        if (entry_count < raop_buffer->buffer_length) {
             /* Return nothing and hope resend gets on time */
             return NULL;
         }
@@ -278,38 +355,74 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *
 
     /* Update buffer and validate entry */
     raop_buffer->first_seqnum += 1;
+    entry->resend_pending = 0;
     if (!entry->filled) {
+        raop_buffer->stats.lost++;
+        *lost = 1;
         return NULL;
     }
-    entry->filled = 0;
+    raop_buffer_set_filled(raop_buffer, index, 0);
 
-    /* Return entry payload buffer */
+    /* Lend out the slot, it is handed back on the next enqueue into it */
     *timestamp = entry->timestamp;
     *length = entry->payload_size;
     entry->payload_size = 0;
-    void* data = entry->payload_data;
-    entry->payload_data = NULL;
-    return data;
+    raop_buffer->stats.dequeued++;
+    return entry->payload_data;
+}
+
+static void
+raop_buffer_request_range(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque,
+                          unsigned short seqnum, unsigned short count)
+{
+    resend_cb(opaque, seqnum, count);
+    raop_buffer->stats.resend_requests++;
+    raop_buffer->stats.resend_requested += count;
 }
 
-void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque) {
+void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque, uint64_t now) {
     assert(raop_buffer);
     assert(resend_cb);
 
-    if (seqnum_cmp(raop_buffer->first_seqnum, raop_buffer->last_seqnum) < 0) {
-        int seqnum, count;
+    if (raop_buffer->is_empty) {
+        return;
+    }
 
-        for (seqnum = raop_buffer->first_seqnum; seqnum_cmp(seqnum, raop_buffer->last_seqnum) < 0; seqnum++) {
+    /* Walk the window up to the newest packet and coalesce every missing
+     * packet that is due for a request into as few requests as possible */
+    unsigned short range_start = 0;
+    unsigned short range_count = 0;
+    for (unsigned short seqnum = raop_buffer->first_seqnum; seqnum_cmp(seqnum, raop_buffer->last_seqnum) < 0; seqnum++) {
+        int due = 0;
+        if (!raop_buffer_is_filled(raop_buffer, seqnum)) {
             raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
-            if (entry->filled) {
-                break;
+            if (!entry->resend_pending || entry->resend_seqnum != seqnum) {
+                /* Newly noticed loss */
+                entry->resend_pending = 1;
+                entry->resend_seqnum = seqnum;
+                entry->resend_retries = 0;
+                entry->resend_next = now;
+                entry->resend_deadline = now + RAOP_BUFFER_RESEND_TIMEOUT;
+            }
+            if (entry->resend_retries < RAOP_BUFFER_RESEND_RETRIES &&
+                now >= entry->resend_next && now < entry->resend_deadline) {
+                entry->resend_next = now + ((uint64_t) RAOP_BUFFER_RESEND_INTERVAL << entry->resend_retries);
+                entry->resend_retries++;
+                due = 1;
             }
         }
-        if (seqnum_cmp(seqnum, raop_buffer->first_seqnum) == 0) {
-            return;
+        if (due) {
+            if (range_count == 0) {
+                range_start = seqnum;
+            }
+            range_count++;
+        } else if (range_count > 0) {
+            raop_buffer_request_range(raop_buffer, resend_cb, opaque, range_start, range_count);
+            range_count = 0;
         }
-        count = seqnum_cmp(seqnum, raop_buffer->first_seqnum);
-        resend_cb(opaque, raop_buffer->first_seqnum, count);
+    }
+    if (range_count > 0) {
+        raop_buffer_request_range(raop_buffer, resend_cb, opaque, range_start, range_count);
     }
 }
 
@@ -317,11 +430,9 @@ void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq) {
     assert(raop_buffer);
 
     for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
-        if (raop_buffer->entries[i].payload_data) {
-            free(raop_buffer->entries[i].payload_data);
-            raop_buffer->entries[i].payload_size = 0;
-        }
-        raop_buffer->entries[i].filled = 0;
+        raop_buffer->entries[i].payload_size = 0;
+        raop_buffer->entries[i].resend_pending = 0;
+        raop_buffer_set_filled(raop_buffer, i, 0);
     }
     if (next_seq < 0 || next_seq > 0xffff) {
         raop_buffer->is_empty = 1;
@@ -330,3 +441,70 @@ void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq) {
         raop_buffer->last_seqnum = next_seq - 1;
     }
 }
+
+void
+raop_buffer_get_stats(raop_buffer_t *raop_buffer, raop_buffer_stats_t *stats)
+{
+    assert(raop_buffer);
+    assert(stats);
+
+    memcpy(stats, &raop_buffer->stats, sizeof(raop_buffer_stats_t));
+}
+
+void
+raop_buffer_set_length_bounds(raop_buffer_t *raop_buffer, unsigned short min_length, unsigned short max_length)
+{
+    assert(raop_buffer);
+
+    if (max_length == 0 || max_length > RAOP_BUFFER_LENGTH) {
+        max_length = RAOP_BUFFER_LENGTH;
+    }
+    if (min_length == 0 || min_length > max_length) {
+        min_length = max_length;
+    }
+    raop_buffer->min_length = min_length;
+    raop_buffer->max_length = max_length;
+    if (raop_buffer->buffer_length < min_length) {
+        raop_buffer->buffer_length = min_length;
+    } else if (raop_buffer->buffer_length > max_length) {
+        raop_buffer->buffer_length = max_length;
+    }
+    raop_buffer->shrink_count = 0;
+}
+
+void
+raop_buffer_adapt_length(raop_buffer_t *raop_buffer, double jitter_packets)
+{
+    assert(raop_buffer);
+
+    int target = (int) ceil(RAOP_BUFFER_JITTER_FACTOR * jitter_packets) + RAOP_BUFFER_JITTER_MARGIN;
+    if (target < raop_buffer->min_length) {
+        target = raop_buffer->min_length;
+    } else if (target > raop_buffer->max_length) {
+        target = raop_buffer->max_length;
+    }
+
+    if (target > raop_buffer->buffer_length) {
+        /* Grow right away, late packets are lost packets */
+        raop_buffer->buffer_length = target;
+        raop_buffer->shrink_count = 0;
+        LOGGER_LOG(raop_buffer->logger, LOGGER_DEBUG, "raop_buffer window grown to %d", target);
+    } else if (target < raop_buffer->buffer_length) {
+        /* Shrink slowly and only when the queued entries still fit */
+        short entry_count = raop_buffer->is_empty ? 0 : seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum) + 1;
+        if (++raop_buffer->shrink_count >= RAOP_BUFFER_SHRINK_HOLD && entry_count < raop_buffer->buffer_length - 1) {
+            raop_buffer->buffer_length--;
+            raop_buffer->shrink_count = 0;
+            LOGGER_LOG(raop_buffer->logger, LOGGER_DEBUG, "raop_buffer window shrunk to %d", raop_buffer->buffer_length);
+        }
+    } else {
+        raop_buffer->shrink_count = 0;
+    }
+}
+
+unsigned short
+raop_buffer_get_length(raop_buffer_t *raop_buffer)
+{
+    assert(raop_buffer);
+    return raop_buffer->buffer_length;
+}
@@ -18,8 +18,24 @@
 #include "logger.h"
 #include "raop_rtp.h"
 
+/* Capacity of the reorder window, the adaptive length never exceeds it */
+#define RAOP_BUFFER_LENGTH 32
+#define RAOP_BUFFER_MIN_LENGTH 8
+
 typedef struct raop_buffer_s raop_buffer_t;
 
+typedef struct raop_buffer_stats_s {
+    uint64_t enqueued;
+    uint64_t dequeued;
+    /* Resend requests sent, packets asked for, packets that arrived in time and too late */
+    uint64_t resend_requests;
+    uint64_t resend_requested;
+    uint64_t resend_recovered;
+    uint64_t resend_late;
+    /* Packets skipped because they never arrived */
+    uint64_t lost;
+} raop_buffer_stats_t;
+
 typedef int (*raop_resend_cb_t)(void *opaque, unsigned short seqno, unsigned short count);
 
 raop_buffer_t *raop_buffer_init(logger_t *logger,
@@ -27,12 +43,20 @@ raop_buffer_t *raop_buffer_init(logger_t *logger,
                                 const unsigned char *aesiv,
                                 const unsigned char *ecdh_secret);
 int raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, uint64_t timestamp, int use_seqnum);
-void *raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *timestamp, int no_resend);
-void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque);
+/* The returned payload is owned by the buffer and stays valid until the next enqueue or flush */
+/* Returns NULL when nothing is due; lost is set when the head was given up on and skipped instead */
+void *raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *timestamp, int no_resend, int *lost);
+/* Requests every missing range in the window, paced per packet with backoff; now is in microseconds */
+void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque, uint64_t now);
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq);
 
+void raop_buffer_set_length_bounds(raop_buffer_t *raop_buffer, unsigned short min_length, unsigned short max_length);
+void raop_buffer_adapt_length(raop_buffer_t *raop_buffer, double jitter_packets);
+unsigned short raop_buffer_get_length(raop_buffer_t *raop_buffer);
+
 int raop_buffer_decrypt(raop_buffer_t *raop_buffer, unsigned char *data, unsigned char* output,
                         unsigned int datalen, unsigned int *outputlen);
+void raop_buffer_get_stats(raop_buffer_t *raop_buffer, raop_buffer_stats_t *stats);
 void raop_buffer_destroy(raop_buffer_t *raop_buffer);
 
 #endif
@@ -0,0 +1,211 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/*
+ * Decodes the AAC-LC / AAC-ELD audio frames of a session to interleaved
+ * 16 bit PCM with fdk-aac. One decoder lives as long as the session and
+ * decodes into a buffer allocated once, so nothing is allocated per frame.
+ * Frames lost in transit are concealed by the decoder itself so the PCM
+ * output keeps its cadence.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "raop_decoder.h"
+#include "compat.h"
+#include "aacdecoder_lib.h"
+
+/* Raw AudioSpecificConfig of the formats senders use: 44.1 kHz stereo, 480 samples per frame for ELD */
+static unsigned char aac_lc_config[] = { 0x12, 0x10 };
+static unsigned char aac_eld_config[] = { 0xf8, 0xe8, 0x50, 0x00 };
+
+struct raop_decoder_s {
+    logger_t *logger;
+    HANDLE_AACDECODER handle;
+
+    INT_PCM *output;
+
+    raop_decoder_stats_t stats;
+
+    /* MUTEX LOCKED VARIABLES START */
+    /* Frames are decoded on the delivering thread while a flush comes from the audio thread */
+    mutex_handle_t mutex;
+    int reset;
+    /* MUTEX LOCKED VARIABLES END */
+};
+
+raop_decoder_t *
+raop_decoder_init(logger_t *logger, int compression_type)
+{
+    raop_decoder_t *raop_decoder;
+    unsigned char *config;
+    unsigned int config_len;
+
+    switch (compression_type) {
+        case RAOP_CT_AAC_LC:
+            config = aac_lc_config;
+            config_len = sizeof(aac_lc_config);
+            break;
+        case RAOP_CT_AAC_ELD:
+            config = aac_eld_config;
+            config_len = sizeof(aac_eld_config);
+            break;
+        default:
+            logger_log(logger, LOGGER_ERR, "raop_decoder unsupported compression type %d", compression_type);
+            return NULL;
+    }
+
+    raop_decoder = calloc(1, sizeof(raop_decoder_t));
+    if (!raop_decoder) {
+        return NULL;
+    }
+    raop_decoder->logger = logger;
+
+    raop_decoder->output = malloc(RAOP_DECODER_MAX_FRAME_SIZE * RAOP_DECODER_CHANNELS * sizeof(INT_PCM));
+    if (!raop_decoder->output) {
+        free(raop_decoder);
+        return NULL;
+    }
+
+    raop_decoder->handle = aacDecoder_Open(TT_MP4_RAW, 1);
+    if (!raop_decoder->handle) {
+        logger_log(logger, LOGGER_ERR, "raop_decoder could not open the AAC decoder");
+        free(raop_decoder->output);
+        free(raop_decoder);
+        return NULL;
+    }
+
+    UCHAR *conf[] = { config };
+    UINT conf_len[] = { config_len };
+    if (aacDecoder_ConfigRaw(raop_decoder->handle, conf, conf_len) != AAC_DEC_OK) {
+        logger_log(logger, LOGGER_ERR, "raop_decoder could not configure the AAC decoder");
+        aacDecoder_Close(raop_decoder->handle);
+        free(raop_decoder->output);
+        free(raop_decoder);
+        return NULL;
+    }
+    aacDecoder_SetParam(raop_decoder->handle, AAC_PCM_MIN_OUTPUT_CHANNELS, RAOP_DECODER_CHANNELS);
+    aacDecoder_SetParam(raop_decoder->handle, AAC_PCM_MAX_OUTPUT_CHANNELS, RAOP_DECODER_CHANNELS);
+    /* Noise substitution, energy interpolation would add a frame of delay */
+    aacDecoder_SetParam(raop_decoder->handle, AAC_CONCEAL_METHOD, 1);
+
+    MUTEX_CREATE(raop_decoder->mutex);
+    LOGGER_LOG(logger, LOGGER_DEBUG, "raop_decoder initialized for compression type %d", compression_type);
+    return raop_decoder;
+}
+
+static void
+raop_decoder_fill_pcm(raop_decoder_t *raop_decoder, pcm_decode_struct *pcm)
+{
+    CStreamInfo *info = aacDecoder_GetStreamInfo(raop_decoder->handle);
+    pcm->data = raop_decoder->output;
+    pcm->frame_size = info->frameSize;
+    pcm->channels = info->numChannels;
+    pcm->sample_rate = info->sampleRate;
+    pcm->data_len = info->frameSize * info->numChannels * sizeof(INT_PCM);
+}
+
+int
+raop_decoder_decode(raop_decoder_t *raop_decoder, unsigned char *data, unsigned int datalen, pcm_decode_struct *pcm)
+{
+    UINT flags = 0;
+
+    assert(raop_decoder);
+    assert(pcm);
+
+    MUTEX_LOCK(raop_decoder->mutex);
+    if (raop_decoder->reset) {
+        aacDecoder_SetParam(raop_decoder->handle, AAC_TPDEC_CLEAR_BUFFER, 1);
+        flags = AACDEC_INTR | AACDEC_CLRHIST;
+        raop_decoder->reset = 0;
+    }
+
+    UCHAR *in[] = { data };
+    UINT in_len[] = { datalen };
+    UINT valid = datalen;
+    AAC_DECODER_ERROR err = aacDecoder_Fill(raop_decoder->handle, in, in_len, &valid);
+    if (err == AAC_DEC_OK) {
+        err = aacDecoder_DecodeFrame(raop_decoder->handle, raop_decoder->output,
+                                     RAOP_DECODER_MAX_FRAME_SIZE * RAOP_DECODER_CHANNELS, flags);
+    }
+    if (err != AAC_DEC_OK) {
+        raop_decoder->stats.errors++;
+        MUTEX_UNLOCK(raop_decoder->mutex);
+        LOGGER_LOG(raop_decoder->logger, LOGGER_DEBUG, "raop_decoder decode error 0x%x", err);
+        return -1;
+    }
+
+    raop_decoder_fill_pcm(raop_decoder, pcm);
+    raop_decoder->stats.decoded++;
+    MUTEX_UNLOCK(raop_decoder->mutex);
+    return 0;
+}
+
+int
+raop_decoder_conceal(raop_decoder_t *raop_decoder, pcm_decode_struct *pcm)
+{
+    assert(raop_decoder);
+    assert(pcm);
+
+    MUTEX_LOCK(raop_decoder->mutex);
+    CStreamInfo *info = aacDecoder_GetStreamInfo(raop_decoder->handle);
+    if (info->frameSize <= 0 || info->numChannels <= 0) {
+        /* Nothing decoded yet, so the frame length is unknown */
+        MUTEX_UNLOCK(raop_decoder->mutex);
+        return -1;
+    }
+
+    if (aacDecoder_DecodeFrame(raop_decoder->handle, raop_decoder->output,
+                               RAOP_DECODER_MAX_FRAME_SIZE * RAOP_DECODER_CHANNELS, AACDEC_CONCEAL) == AAC_DEC_OK) {
+        raop_decoder->stats.concealed++;
+    } else {
+        memset(raop_decoder->output, 0, info->frameSize * info->numChannels * sizeof(INT_PCM));
+        raop_decoder->stats.muted++;
+    }
+    raop_decoder_fill_pcm(raop_decoder, pcm);
+    MUTEX_UNLOCK(raop_decoder->mutex);
+    return 0;
+}
+
+void
+raop_decoder_flush(raop_decoder_t *raop_decoder)
+{
+    assert(raop_decoder);
+
+    MUTEX_LOCK(raop_decoder->mutex);
+    raop_decoder->reset = 1;
+    MUTEX_UNLOCK(raop_decoder->mutex);
+}
+
+void
+raop_decoder_get_stats(raop_decoder_t *raop_decoder, raop_decoder_stats_t *stats)
+{
+    assert(raop_decoder);
+    assert(stats);
+
+    MUTEX_LOCK(raop_decoder->mutex);
+    *stats = raop_decoder->stats;
+    MUTEX_UNLOCK(raop_decoder->mutex);
+}
+
+void
+raop_decoder_destroy(raop_decoder_t *raop_decoder)
+{
+    if (raop_decoder) {
+        aacDecoder_Close(raop_decoder->handle);
+        MUTEX_DESTROY(raop_decoder->mutex);
+        free(raop_decoder->output);
+        free(raop_decoder);
+    }
+}
@@ -0,0 +1,50 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_DECODER_H
+#define RAOP_DECODER_H
+
+#include "logger.h"
+#include "stream.h"
+
+/* Audio compression types as announced by the sender in SETUP ("ct") */
+#define RAOP_CT_PCM     1
+#define RAOP_CT_ALAC    2
+#define RAOP_CT_AAC_LC  4
+#define RAOP_CT_AAC_ELD 8
+
+/* Largest frame the decoder hands out, in samples per channel, and its channel count */
+#define RAOP_DECODER_MAX_FRAME_SIZE 2048
+#define RAOP_DECODER_CHANNELS 2
+
+typedef struct raop_decoder_s raop_decoder_t;
+
+typedef struct raop_decoder_stats_s {
+    uint64_t decoded;
+    uint64_t errors;
+    /* Frames synthesized for lost packets, and those that fell back to silence */
+    uint64_t concealed;
+    uint64_t muted;
+} raop_decoder_stats_t;
+
+/* Returns NULL for compression types that can not be decoded */
+raop_decoder_t *raop_decoder_init(logger_t *logger, int compression_type);
+/* Decodes one frame; pcm->data is owned by the decoder and valid until the next call */
+int raop_decoder_decode(raop_decoder_t *raop_decoder, unsigned char *data, unsigned int datalen, pcm_decode_struct *pcm);
+/* Produces a stand-in for one lost frame with the same length as the decoded ones */
+int raop_decoder_conceal(raop_decoder_t *raop_decoder, pcm_decode_struct *pcm);
+/* Drops decoder history, for discontinuities such as a flush */
+void raop_decoder_flush(raop_decoder_t *raop_decoder);
+void raop_decoder_get_stats(raop_decoder_t *raop_decoder, raop_decoder_stats_t *stats);
+void raop_decoder_destroy(raop_decoder_t *raop_decoder);
+
+#endif
@@ -51,7 +51,11 @@ raop_handler_info(raop_conn_t *conn,
     plist_t txt_airplay_node = plist_new_data(airplay_txt, airplay_txt_len);
     plist_dict_set_item(r_node, "txtAirPlay", txt_airplay_node);
 
-    plist_t features_node = plist_new_uint((uint64_t) 0x1E << 32 | 0x5A7FFFF7);
+    uint64_t features = (uint64_t) 0x1E << 32 | 0x5A7FFFF7;
+    if (conn->raop->video_hevc) {
+        features |= (uint64_t) 1 << AIRPLAY_FEATURE_SCREEN_MULTI_CODEC;
+    }
+    plist_t features_node = plist_new_uint(features);
     plist_dict_set_item(r_node, "features", features_node);
 
     plist_t name_node = plist_new_string(name);
@@ -134,10 +138,13 @@ raop_handler_info(raop_conn_t *conn,
     plist_t displays_0_uuid_node = plist_new_string("e0ff8a27-6738-3d56-8a16-cc53aacee925");
     plist_t displays_0_width_physical_node = plist_new_uint(0);
     plist_t displays_0_height_physical_node = plist_new_uint(0);
-    plist_t displays_0_width_node = plist_new_uint(1920);
-    plist_t displays_0_height_node = plist_new_uint(1080);
-    plist_t displays_0_width_pixels_node = plist_new_uint(1920);
-    plist_t displays_0_height_pixels_node = plist_new_uint(1080);
+    // Senders only pick HEVC for displays larger than 1080p
+    uint64_t display_width = conn->raop->video_hevc ? 3840 : 1920;
+    uint64_t display_height = conn->raop->video_hevc ? 2160 : 1080;
+    plist_t displays_0_width_node = plist_new_uint(display_width);
+    plist_t displays_0_height_node = plist_new_uint(display_height);
+    plist_t displays_0_width_pixels_node = plist_new_uint(display_width);
+    plist_t displays_0_height_pixels_node = plist_new_uint(display_height);
     plist_t displays_0_rotation_node = plist_new_bool(0);
     plist_t displays_0_refresh_rate_node = plist_new_real(1.0 / 60.0);
     plist_t displays_0_overscanned_node = plist_new_bool(1);
@@ -158,8 +165,8 @@ raop_handler_info(raop_conn_t *conn,
     plist_dict_set_item(r_node, "displays", displays_node);
 
     plist_to_bin(r_node, response_data, (uint32_t *) response_datalen);
-    logger_log(conn->raop->logger, LOGGER_DEBUG, "INFO len = %d", response_datalen);
-    http_response_add_header(response, "Content-Type", "application/x-apple-binary-plist");
+    LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "INFO len = %d", response_datalen);
+    http_response_add_header_line(response, "Content-Type: application/x-apple-binary-plist\r\n");
     free(pk);
     free(hw_addr);
 }
@@ -184,7 +191,7 @@ raop_handler_pairsetup(raop_conn_t *conn,
 
     *response_data = malloc(sizeof(public_key));
     if (*response_data) {
-        http_response_add_header(response, "Content-Type", "application/octet-stream");
+        http_response_add_header_line(response, "Content-Type: application/octet-stream\r\n");
         memcpy(*response_data, public_key, sizeof(public_key));
         *response_datalen = sizeof(public_key);
     }
@@ -226,7 +233,7 @@ raop_handler_pairverify(raop_conn_t *conn,
             }
             *response_data = malloc(sizeof(public_key) + sizeof(signature));
             if (*response_data) {
-                http_response_add_header(response, "Content-Type", "application/octet-stream");
+                http_response_add_header_line(response, "Content-Type: application/octet-stream\r\n");
                 memcpy(*response_data, public_key, sizeof(public_key));
                 memcpy(*response_data + sizeof(public_key), signature, sizeof(signature));
                 *response_datalen = sizeof(public_key) + sizeof(signature);
@@ -243,7 +250,7 @@ raop_handler_pairverify(raop_conn_t *conn,
                 http_response_set_disconnect(response, 1);
                 return;
             }
-            http_response_add_header(response, "Content-Type", "application/octet-stream");
+            http_response_add_header_line(response, "Content-Type: application/octet-stream\r\n");
             break;
     }
 }
@@ -260,7 +267,7 @@ raop_handler_fpsetup(raop_conn_t *conn,
     if (datalen == 16) {
         *response_data = malloc(142);
         if (*response_data) {
-            http_response_add_header(response, "Content-Type", "application/octet-stream");
+            http_response_add_header_line(response, "Content-Type: application/octet-stream\r\n");
             if (!fairplay_setup(conn->fairplay, data, (unsigned char *) *response_data)) {
                 *response_datalen = 142;
             } else {
@@ -272,7 +279,7 @@ raop_handler_fpsetup(raop_conn_t *conn,
     } else if (datalen == 164) {
         *response_data = malloc(32);
         if (*response_data) {
-            http_response_add_header(response, "Content-Type", "application/octet-stream");
+            http_response_add_header_line(response, "Content-Type: application/octet-stream\r\n");
             if (!fairplay_handshake(conn->fairplay, data, (unsigned char *) *response_data)) {
                 *response_datalen = 32;
             } else {
@@ -292,7 +299,7 @@ raop_handler_options(raop_conn_t *conn,
                      http_request_t *request, http_response_t *response,
                      char **response_data, int *response_datalen)
 {
-    http_response_add_header(response, "Public", "SETUP, RECORD, PAUSE, FLUSH, TEARDOWN, OPTIONS, GET_PARAMETER, SET_PARAMETER");
+    http_response_add_header_line(response, "Public: SETUP, RECORD, PAUSE, FLUSH, TEARDOWN, OPTIONS, GET_PARAMETER, SET_PARAMETER\r\n");
 }
 
 static void
@@ -312,23 +319,23 @@ raop_handler_setup(raop_conn_t *conn,
 
     data = http_request_get_data(request, &data_len);
 
-    dacp_id = http_request_get_header(request, "DACP-ID");
-    active_remote_header = http_request_get_header(request, "Active-Remote");
+    dacp_id = http_request_get_header_key(request, HTTP_HEADER_DACP_ID);
+    active_remote_header = http_request_get_header_key(request, HTTP_HEADER_ACTIVE_REMOTE);
 
     if (dacp_id && active_remote_header) {
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "DACP-ID: %s", dacp_id);
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "Active-Remote: %s", active_remote_header);
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "DACP-ID: %s", dacp_id);
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "Active-Remote: %s", active_remote_header);
         if (conn->raop_rtp) {
             raop_rtp_remote_control_id(conn->raop_rtp, dacp_id, active_remote_header);
         }
     }
 
-    transport = http_request_get_header(request, "Transport");
+    transport = http_request_get_header_key(request, HTTP_HEADER_TRANSPORT);
     if (transport) {
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "Transport: %s", transport);
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "Transport: %s", transport);
         use_udp = strncmp(transport, "RTP/AVP/TCP", 11);
     } else {
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "Transport: null");
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "Transport: null");
         use_udp = 0;
     }
 
@@ -347,22 +354,22 @@ raop_handler_setup(raop_conn_t *conn,
 
         unsigned char aesiv[16];
         unsigned char aeskey[16];
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "SETUP 1");
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "SETUP 1");
 
         // First setup
         char* eiv = NULL;
         uint64_t eiv_len = 0;
         plist_get_data_val(req_eiv_node, &eiv, &eiv_len);
         memcpy(aesiv, eiv, 16);
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "eiv_len = %llu", eiv_len);
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "eiv_len = %llu", eiv_len);
         char* ekey = NULL;
         uint64_t ekey_len = 0;
         plist_get_data_val(req_ekey_node, &ekey, &ekey_len);
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "ekey_len = %llu", ekey_len);
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "ekey_len = %llu", ekey_len);
 
         // ekey is 72 bytes, aeskey is 16 bytes
         int ret = fairplay_decrypt(conn->fairplay, (unsigned char*) ekey, aeskey);
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "fairplay_decrypt ret = %d", ret);
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "fairplay_decrypt ret = %d", ret);
         unsigned char ecdh_secret[X25519_KEY_SIZE];
         pairing_get_ecdh_secret_key(conn->pairing, ecdh_secret);
 
@@ -370,21 +377,39 @@ raop_handler_setup(raop_conn_t *conn,
         uint64_t timing_rport;
         plist_t time_note = plist_dict_get_item(req_root_node, "timingPort");
         plist_get_uint_val(time_note, &timing_rport);
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "timing_rport = %llu", timing_rport);
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "timing_rport = %llu", timing_rport);
 
         unsigned short timing_lport;
         conn->raop_ntp = raop_ntp_init(conn->raop->logger, conn->remote, conn->remotelen, timing_rport);
         raop_ntp_start(conn->raop_ntp, &timing_lport);
 
         conn->raop_rtp = raop_rtp_init(conn->raop->logger, &conn->raop->callbacks, conn->raop_ntp, conn->remote, conn->remotelen, aeskey, aesiv, ecdh_secret);
+        if (conn->raop_rtp && (conn->raop->audio_buffer_min || conn->raop->audio_buffer_max)) {
+            raop_rtp_set_buffer_bounds(conn->raop_rtp, conn->raop->audio_buffer_min, conn->raop->audio_buffer_max);
+        }
+        if (conn->raop_rtp && conn->raop->audio_playout) {
+            raop_rtp_set_playout(conn->raop_rtp, 1, conn->raop->audio_output_latency);
+        }
+        if (conn->raop_rtp && conn->raop->audio_resampling) {
+            raop_rtp_set_resampling(conn->raop_rtp, 1);
+        }
+        if (conn->raop_rtp) {
+            raop_set_audio_session(conn->raop, conn->raop_rtp);
+        }
         conn->raop_rtp_mirror = raop_rtp_mirror_init(conn->raop->logger, &conn->raop->callbacks, conn->raop_ntp, conn->remote, conn->remotelen, aeskey, ecdh_secret);
+        if (conn->raop_rtp_mirror && conn->raop->video_queue_depth) {
+            raop_rtp_mirror_set_queue_depth(conn->raop_rtp_mirror, conn->raop->video_queue_depth);
+        }
+        if (conn->raop_rtp_mirror) {
+            raop_set_mirror_session(conn->raop, conn->raop_rtp_mirror);
+        }
 
         plist_t res_event_port_node = plist_new_uint(conn->raop->port);
         plist_t res_timing_port_node = plist_new_uint(timing_lport);
         plist_dict_set_item(res_root_node, "timingPort", res_timing_port_node);
         plist_dict_set_item(res_root_node, "eventPort", res_event_port_node);
 
-        logger_log(conn->raop->logger, LOGGER_DEBUG, "eport = %d, tport = %d", conn->raop->port, timing_lport);
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "eport = %d, tport = %d", conn->raop->port, timing_lport);
     }
 
     // Process stream setup requests
@@ -397,7 +422,7 @@ raop_handler_setup(raop_conn_t *conn,
             plist_t req_stream_type_node = plist_dict_get_item(req_stream_node, "type");
             uint64_t type;
             plist_get_uint_val(req_stream_type_node, &type);
-            logger_log(conn->raop->logger, LOGGER_DEBUG, "type = %llu", type);
+            LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "type = %llu", type);
 
             switch (type) {
                 case 110: {
@@ -406,12 +431,12 @@ raop_handler_setup(raop_conn_t *conn,
                     plist_t stream_id_node = plist_dict_get_item(req_stream_node, "streamConnectionID");
                     uint64_t stream_connection_id;
                     plist_get_uint_val(stream_id_node, &stream_connection_id);
-                    logger_log(conn->raop->logger, LOGGER_DEBUG, "streamConnectionID = %llu", stream_connection_id);
+                    LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "streamConnectionID = %llu", stream_connection_id);
 
                     if (conn->raop_rtp_mirror) {
                         raop_rtp_init_mirror_aes(conn->raop_rtp_mirror, stream_connection_id);
                         raop_rtp_start_mirror(conn->raop_rtp_mirror, use_udp, &dport);
-                        logger_log(conn->raop->logger, LOGGER_DEBUG, "Mirroring initialized successfully");
+                        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "Mirroring initialized successfully");
                     } else {
                         logger_log(conn->raop->logger, LOGGER_ERR, "Mirroring not initialized at SETUP, playing will fail!");
                         http_response_set_disconnect(response, 1);
@@ -430,9 +455,17 @@ raop_handler_setup(raop_conn_t *conn,
 
                     unsigned short cport = 0, dport = 0;
 
+                    uint64_t ct = 0, spf = 0;
+                    plist_t req_stream_ct_node = plist_dict_get_item(req_stream_node, "ct");
+                    plist_t req_stream_spf_node = plist_dict_get_item(req_stream_node, "spf");
+                    if (PLIST_IS_UINT(req_stream_ct_node)) plist_get_uint_val(req_stream_ct_node, &ct);
+                    if (PLIST_IS_UINT(req_stream_spf_node)) plist_get_uint_val(req_stream_spf_node, &spf);
+                    LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "ct = %llu, spf = %llu", ct, spf);
+
                     if (conn->raop_rtp) {
+                        raop_rtp_set_audio_format(conn->raop_rtp, (int) ct, (unsigned int) spf);
                         raop_rtp_start_audio(conn->raop_rtp, use_udp, remote_cport, &cport, &dport);
-                        logger_log(conn->raop->logger, LOGGER_DEBUG, "RAOP initialized success");
+                        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "RAOP initialized success");
                     } else {
                         logger_log(conn->raop->logger, LOGGER_ERR, "RAOP not initialized at SETUP, playing will fail!");
                         http_response_set_disconnect(response, 1);
@@ -461,7 +494,7 @@ raop_handler_setup(raop_conn_t *conn,
     }
 
     plist_to_bin(res_root_node, response_data, (uint32_t*) response_datalen);
-    http_response_add_header(response, "Content-Type", "application/x-apple-binary-plist");
+    http_response_add_header_line(response, "Content-Type: application/x-apple-binary-plist\r\n");
 }
 
 static void
@@ -473,7 +506,7 @@ raop_handler_get_parameter(raop_conn_t *conn,
     const char *data;
     int datalen;
 
-    content_type = http_request_get_header(request, "Content-Type");
+    content_type = http_request_get_header_key(request, HTTP_HEADER_CONTENT_TYPE);
     data = http_request_get_data(request, &datalen);
     if (!strcmp(content_type, "text/parameters")) {
         const char *current = data;
@@ -485,7 +518,7 @@ raop_handler_get_parameter(raop_conn_t *conn,
             if ((datalen - (current - data) >= 8) && !strncmp(current, "volume\r\n", 8)) {
                 const char volume[] = "volume: 0.0\r\n";
 
-                http_response_add_header(response, "Content-Type", "text/parameters");
+                http_response_add_header_line(response, "Content-Type: text/parameters\r\n");
                 *response_data = strdup(volume);
                 if (*response_data) {
                     *response_datalen = strlen(*response_data);
@@ -519,7 +552,7 @@ raop_handler_set_parameter(raop_conn_t *conn,
     const char *data;
     int datalen;
 
-    content_type = http_request_get_header(request, "Content-Type");
+    content_type = http_request_get_header_key(request, HTTP_HEADER_CONTENT_TYPE);
     data = http_request_get_data(request, &datalen);
     if (!strcmp(content_type, "text/parameters")) {
         char *datastr;
@@ -562,7 +595,7 @@ raop_handler_feedback(raop_conn_t *conn,
                       http_request_t *request, http_response_t *response,
                       char **response_data, int *response_datalen)
 {
-    logger_log(conn->raop->logger, LOGGER_DEBUG, "raop_handler_feedback");
+    LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "raop_handler_feedback");
 }
 
 static void
@@ -570,7 +603,49 @@ raop_handler_record(raop_conn_t *conn,
                     http_request_t *request, http_response_t *response,
                     char **response_data, int *response_datalen)
 {
-    logger_log(conn->raop->logger, LOGGER_DEBUG, "raop_handler_record");
-    http_response_add_header(response, "Audio-Latency", "11025");
-    http_response_add_header(response, "Audio-Jack-Status", "connected; type=analog");
+    LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "raop_handler_record");
+    http_response_add_header_line(response, "Audio-Latency: 11025\r\n");
+    http_response_add_header_line(response, "Audio-Jack-Status: connected; type=analog\r\n");
+}
+
+static void
+raop_handler_flush(raop_conn_t *conn,
+                   http_request_t *request, http_response_t *response,
+                   char **response_data, int *response_datalen)
+{
+    const char *rtpinfo;
+    int next_seq = -1;
+
+    rtpinfo = http_request_get_header_key(request, HTTP_HEADER_RTP_INFO);
+    if (rtpinfo) {
+        LOGGER_LOG(conn->raop->logger, LOGGER_DEBUG, "Flush with RTP-Info: %s", rtpinfo);
+        if (!strncmp(rtpinfo, "seq=", 4)) {
+            next_seq = strtol(rtpinfo + 4, NULL, 10);
+        }
+    }
+    if (conn->raop_rtp) {
+        raop_rtp_flush(conn->raop_rtp, next_seq);
+    } else {
+        logger_log(conn->raop->logger, LOGGER_WARNING, "RAOP not initialized at FLUSH");
+    }
+}
+
+static void
+raop_handler_teardown(raop_conn_t *conn,
+                      http_request_t *request, http_response_t *response,
+                      char **response_data, int *response_datalen)
+{
+    //http_response_add_header(response, "Connection", "close");
+    if (conn->raop_rtp != NULL && raop_rtp_is_running(conn->raop_rtp)) {
+        /* Destroy our RTP session */
+        raop_rtp_stop(conn->raop_rtp);
+    } else if (conn->raop_rtp_mirror) {
+        /* Destroy our sessions */
+        raop_clear_audio_session(conn->raop, conn->raop_rtp);
+        raop_rtp_destroy(conn->raop_rtp);
+        conn->raop_rtp = NULL;
+        raop_clear_mirror_session(conn->raop, conn->raop_rtp_mirror);
+        raop_rtp_mirror_destroy(conn->raop_rtp_mirror);
+        conn->raop_rtp_mirror = NULL;
+    }
 }
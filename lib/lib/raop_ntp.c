@@ -114,7 +114,7 @@ raop_ntp_parse_remote_address(raop_ntp_t *raop_ntp, const unsigned char *remote_
     }
     memset(current, 0, sizeof(current));
     sprintf(current, "%d.%d.%d.%d", remote_addr[0], remote_addr[1], remote_addr[2], remote_addr[3]);
-    logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp parse remote ip = %s", current);
+    LOGGER_LOG(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp parse remote ip = %s", current);
     ret = netutils_parse_address(family, current,
                                  &raop_ntp->remote_saddr,
                                  sizeof(raop_ntp->remote_saddr));
@@ -289,7 +289,7 @@ raop_ntp_thread(void *arg)
         byteutils_put_ntp_timestamp(request, 24, send_time);
         int send_len = sendto(raop_ntp->tsock, (char *)request, sizeof(request), 0,
                               (struct sockaddr *) &raop_ntp->remote_saddr, raop_ntp->remote_saddr_len);
-        logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp send_len = %d", send_len);
+        LOGGER_LOG(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp send_len = %d", send_len);
         if (send_len < 0) {
             logger_log(raop_ntp->logger, LOGGER_ERR, "raop_ntp error sending request");
         } else {
@@ -299,7 +299,7 @@ raop_ntp_thread(void *arg)
             if (response_len < 0) {
                 logger_log(raop_ntp->logger, LOGGER_ERR, "raop_ntp receive timeout");
             } else {
-                logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp receive time type_t packetlen = %d", response_len);
+                LOGGER_LOG(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp receive time type_t packetlen = %d", response_len);
 
                 int64_t t3 = (int64_t) raop_ntp_get_local_time(raop_ntp);
                 // Local time of the client when the NTP request packet leaves the client
@@ -341,7 +341,7 @@ raop_ntp_thread(void *arg)
                 raop_ntp->sync_delay = delay;
                 MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
 
-                logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp sync correction = %lld", correction);
+                LOGGER_LOG(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp sync correction = %lld", correction);
             }
         }
 
@@ -361,14 +361,14 @@ raop_ntp_thread(void *arg)
     raop_ntp->running = false;
     MUTEX_UNLOCK(raop_ntp->run_mutex);
 
-    logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp exiting thread");
+    LOGGER_LOG(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp exiting thread");
     return 0;
 }
 
 void
 raop_ntp_start(raop_ntp_t *raop_ntp, unsigned short *timing_lport)
 {
-    logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp starting time");
+    LOGGER_LOG(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp starting time");
     int use_ipv6 = 0;
 
     assert(raop_ntp);
@@ -414,7 +414,7 @@ raop_ntp_stop(raop_ntp_t *raop_ntp)
     raop_ntp->running = 0;
     MUTEX_UNLOCK(raop_ntp->run_mutex);
 
-    logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp stopping time thread");
+    LOGGER_LOG(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp stopping time thread");
 
     MUTEX_LOCK(raop_ntp->wait_mutex);
     COND_SIGNAL(raop_ntp->wait_cond);
@@ -427,7 +427,7 @@ raop_ntp_stop(raop_ntp_t *raop_ntp)
 
     THREAD_JOIN(raop_ntp->thread);
 
-    logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp stopped time thread");
+    LOGGER_LOG(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp stopped time thread");
 
     /* Mark thread as joined */
     MUTEX_LOCK(raop_ntp->run_mutex);
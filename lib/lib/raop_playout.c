@@ -0,0 +1,234 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/*
+ * Holds decrypted audio frames until their presentation time minus the
+ * output latency and hands them out from a dedicated thread, so renderers
+ * receive frames on schedule instead of as soon as they arrive.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "raop_playout.h"
+#include "compat.h"
+
+/* Wake-up slack not counted as a late release */
+#define RAOP_PLAYOUT_LATE_SLACK 2000
+
+typedef struct {
+    uint64_t pts;
+    unsigned int datalen;
+    unsigned char *data;
+} raop_playout_entry_t;
+
+struct raop_playout_s {
+    logger_t *logger;
+    raop_ntp_t *ntp;
+
+    uint64_t output_latency;
+    raop_playout_cb_t callback;
+    void *opaque;
+
+    /* Ring of pending frames, slots come from one allocation */
+    raop_playout_entry_t entries[RAOP_PLAYOUT_LENGTH];
+    unsigned char *slab;
+    int head;
+    int count;
+
+    /* Frame being handed out, copied so the ring slot can be reused */
+    unsigned char scratch[RAOP_PLAYOUT_SLOT_SIZE];
+
+    /* Bumped on every flush so a frame popped before it is not delivered */
+    unsigned int generation;
+
+    raop_playout_stats_t stats;
+
+    /* MUTEX LOCKED VARIABLES START */
+    int running;
+    thread_handle_t thread;
+    mutex_handle_t run_mutex;
+    cond_handle_t wait_cond;
+    /* MUTEX LOCKED VARIABLES END */
+
+    /* Held while a frame is handed to the callback */
+    mutex_handle_t deliver_mutex;
+};
+
+static THREAD_RETVAL
+raop_playout_thread(void *arg)
+{
+    raop_playout_t *raop_playout = arg;
+    assert(raop_playout);
+
+    while (1) {
+        MUTEX_LOCK(raop_playout->run_mutex);
+        while (raop_playout->running && raop_playout->count == 0) {
+            pthread_cond_wait(&raop_playout->wait_cond, &raop_playout->run_mutex);
+        }
+        if (!raop_playout->running) {
+            MUTEX_UNLOCK(raop_playout->run_mutex);
+            break;
+        }
+
+        raop_playout_entry_t *entry = &raop_playout->entries[raop_playout->head];
+        uint64_t now = raop_ntp_get_local_time(raop_playout->ntp);
+        uint64_t due = entry->pts - raop_playout->output_latency;
+        if (entry->pts > raop_playout->output_latency && due > now && due - now < RAOP_PLAYOUT_MAX_HOLD) {
+            /* Sleep until the frame is due, an earlier frame or a flush wakes us up */
+            struct timespec wait_time;
+            wait_time.tv_sec = due / 1000000;
+            wait_time.tv_nsec = (due % 1000000) * 1000;
+            pthread_cond_timedwait(&raop_playout->wait_cond, &raop_playout->run_mutex, &wait_time);
+            MUTEX_UNLOCK(raop_playout->run_mutex);
+            continue;
+        }
+        if (due + RAOP_PLAYOUT_LATE_SLACK < now) {
+            raop_playout->stats.late++;
+        }
+
+        unsigned int datalen = entry->datalen;
+        uint64_t pts = entry->pts;
+        unsigned int generation = raop_playout->generation;
+        memcpy(raop_playout->scratch, entry->data, datalen);
+        raop_playout->head = (raop_playout->head + 1) % RAOP_PLAYOUT_LENGTH;
+        raop_playout->count--;
+        MUTEX_UNLOCK(raop_playout->run_mutex);
+
+        MUTEX_LOCK(raop_playout->deliver_mutex);
+        if (generation == raop_playout->generation) {
+            raop_playout->callback(raop_playout->opaque, raop_playout->scratch, datalen, pts);
+            raop_playout->stats.released++;
+        }
+        MUTEX_UNLOCK(raop_playout->deliver_mutex);
+    }
+
+    LOGGER_LOG(raop_playout->logger, LOGGER_DEBUG, "raop_playout exiting thread");
+    return 0;
+}
+
+raop_playout_t *
+raop_playout_init(logger_t *logger, raop_ntp_t *ntp, uint64_t output_latency,
+                  raop_playout_cb_t callback, void *opaque)
+{
+    raop_playout_t *raop_playout;
+
+    assert(logger);
+    assert(ntp);
+    assert(callback);
+
+    raop_playout = calloc(1, sizeof(raop_playout_t));
+    if (!raop_playout) {
+        return NULL;
+    }
+    raop_playout->slab = malloc(RAOP_PLAYOUT_LENGTH * RAOP_PLAYOUT_SLOT_SIZE);
+    if (!raop_playout->slab) {
+        free(raop_playout);
+        return NULL;
+    }
+    for (int i = 0; i < RAOP_PLAYOUT_LENGTH; i++) {
+        raop_playout->entries[i].data = raop_playout->slab + i * RAOP_PLAYOUT_SLOT_SIZE;
+    }
+
+    raop_playout->logger = logger;
+    raop_playout->ntp = ntp;
+    raop_playout->output_latency = output_latency;
+    raop_playout->callback = callback;
+    raop_playout->opaque = opaque;
+
+    MUTEX_CREATE(raop_playout->run_mutex);
+    MUTEX_CREATE(raop_playout->deliver_mutex);
+    COND_CREATE(raop_playout->wait_cond);
+
+    raop_playout->running = 1;
+    THREAD_CREATE(raop_playout->thread, raop_playout_thread, raop_playout);
+    return raop_playout;
+}
+
+int
+raop_playout_enqueue(raop_playout_t *raop_playout, const unsigned char *data, unsigned int datalen, uint64_t pts)
+{
+    assert(raop_playout);
+
+    MUTEX_LOCK(raop_playout->run_mutex);
+    if (datalen > RAOP_PLAYOUT_SLOT_SIZE || raop_playout->count == RAOP_PLAYOUT_LENGTH) {
+        raop_playout->stats.dropped++;
+        MUTEX_UNLOCK(raop_playout->run_mutex);
+        logger_log(raop_playout->logger, LOGGER_WARNING, "raop_playout dropped frame of %u bytes", datalen);
+        return -1;
+    }
+
+    raop_playout_entry_t *entry = &raop_playout->entries[(raop_playout->head + raop_playout->count) % RAOP_PLAYOUT_LENGTH];
+    if (datalen) {
+        memcpy(entry->data, data, datalen);
+    }
+    entry->datalen = datalen;
+    entry->pts = pts;
+    raop_playout->count++;
+    raop_playout->stats.queued++;
+
+    /* The thread only needs waking when this is the next frame due */
+    if (raop_playout->count == 1) {
+        COND_SIGNAL(raop_playout->wait_cond);
+    }
+    MUTEX_UNLOCK(raop_playout->run_mutex);
+    return 0;
+}
+
+void
+raop_playout_flush(raop_playout_t *raop_playout)
+{
+    assert(raop_playout);
+
+    MUTEX_LOCK(raop_playout->deliver_mutex);
+    MUTEX_LOCK(raop_playout->run_mutex);
+    raop_playout->head = 0;
+    raop_playout->count = 0;
+    raop_playout->generation++;
+    COND_SIGNAL(raop_playout->wait_cond);
+    MUTEX_UNLOCK(raop_playout->run_mutex);
+    MUTEX_UNLOCK(raop_playout->deliver_mutex);
+}
+
+void
+raop_playout_get_stats(raop_playout_t *raop_playout, raop_playout_stats_t *stats)
+{
+    assert(raop_playout);
+    assert(stats);
+
+    MUTEX_LOCK(raop_playout->deliver_mutex);
+    MUTEX_LOCK(raop_playout->run_mutex);
+    memcpy(stats, &raop_playout->stats, sizeof(raop_playout_stats_t));
+    MUTEX_UNLOCK(raop_playout->run_mutex);
+    MUTEX_UNLOCK(raop_playout->deliver_mutex);
+}
+
+void
+raop_playout_destroy(raop_playout_t *raop_playout)
+{
+    if (raop_playout) {
+        MUTEX_LOCK(raop_playout->run_mutex);
+        raop_playout->running = 0;
+        COND_SIGNAL(raop_playout->wait_cond);
+        MUTEX_UNLOCK(raop_playout->run_mutex);
+
+        THREAD_JOIN(raop_playout->thread);
+
+        COND_DESTROY(raop_playout->wait_cond);
+        MUTEX_DESTROY(raop_playout->deliver_mutex);
+        MUTEX_DESTROY(raop_playout->run_mutex);
+        free(raop_playout->slab);
+        free(raop_playout);
+    }
+}
@@ -0,0 +1,48 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_PLAYOUT_H
+#define RAOP_PLAYOUT_H
+
+#include <stdint.h>
+#include "logger.h"
+#include "raop_ntp.h"
+
+/* Frames due further ahead than this are not synchronised yet and go out right away */
+#define RAOP_PLAYOUT_MAX_HOLD 2000000
+/* Duration of the shortest frame, 352 samples at 44.1 kHz, rounded down */
+#define RAOP_PLAYOUT_FRAME_US 7981
+/* Frames held back at most, enough to cover RAOP_PLAYOUT_MAX_HOLD, and the largest frame a slot can take */
+#define RAOP_PLAYOUT_LENGTH ((RAOP_PLAYOUT_MAX_HOLD + RAOP_PLAYOUT_FRAME_US - 1) / RAOP_PLAYOUT_FRAME_US)
+#define RAOP_PLAYOUT_SLOT_SIZE 4096
+
+typedef struct raop_playout_s raop_playout_t;
+
+/* Called from the playout thread once a frame is due */
+typedef void (*raop_playout_cb_t)(void *opaque, unsigned char *data, unsigned int datalen, uint64_t pts);
+
+typedef struct raop_playout_stats_s {
+    uint64_t queued;
+    uint64_t released;
+    uint64_t late;
+    uint64_t dropped;
+} raop_playout_stats_t;
+
+raop_playout_t *raop_playout_init(logger_t *logger, raop_ntp_t *ntp, uint64_t output_latency,
+                                  raop_playout_cb_t callback, void *opaque);
+/* A zero length frame is delivered as is, standing in for a lost one */
+int raop_playout_enqueue(raop_playout_t *raop_playout, const unsigned char *data, unsigned int datalen, uint64_t pts);
+void raop_playout_flush(raop_playout_t *raop_playout);
+void raop_playout_get_stats(raop_playout_t *raop_playout, raop_playout_stats_t *stats);
+void raop_playout_destroy(raop_playout_t *raop_playout);
+
+#endif
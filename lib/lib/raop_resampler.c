@@ -0,0 +1,235 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/*
+ * Fractional resampler for decoded PCM, used to absorb the few ppm by which
+ * the sender's sample clock and ours disagree. Each output sample is a
+ * windowed-sinc FIR over the input, with the filter for the fractional
+ * position interpolated between two phases of a precomputed table.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "raop_resampler.h"
+#include "memalign.h"
+
+#define RAOP_RESAMPLER_ALIGN 16
+/* Passband edge relative to the input Nyquist frequency */
+#define RAOP_RESAMPLER_CUTOFF 0.9
+
+struct raop_resampler_s {
+    logger_t *logger;
+    int channels;
+    int max_frame_size;
+
+    /* (PHASES + 1) filters of TAPS coefficients, the last one repeats the first shifted by a sample */
+    float *coefs;
+    /* Filter for the current fractional position */
+    float *taps;
+
+    /* Per channel input not consumed yet, starting at sample 0 */
+    float *history[RAOP_RESAMPLER_MAX_CHANNELS];
+    int filled;
+    /* Position of the next output sample in the history */
+    double position;
+
+    short *output;
+};
+
+static float
+raop_resampler_dot(const float *a, const float *b)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    float32x4_t acc = vmulq_f32(vld1q_f32(a), vld1q_f32(b));
+    for (int k = 4; k < RAOP_RESAMPLER_TAPS; k += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(a + k), vld1q_f32(b + k));
+    }
+    float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#elif defined(__SSE__)
+    __m128 acc = _mm_mul_ps(_mm_load_ps(a), _mm_loadu_ps(b));
+    for (int k = 4; k < RAOP_RESAMPLER_TAPS; k += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load_ps(a + k), _mm_loadu_ps(b + k)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 0x55));
+    return _mm_cvtss_f32(acc);
+#else
+    float acc = 0.0f;
+    for (int k = 0; k < RAOP_RESAMPLER_TAPS; k++) {
+        acc += a[k] * b[k];
+    }
+    return acc;
+#endif
+}
+
+static void
+raop_resampler_init_coefs(float *coefs)
+{
+    const double center = RAOP_RESAMPLER_TAPS / 2 - 1;
+
+    for (int p = 0; p <= RAOP_RESAMPLER_PHASES; p++) {
+        float *filter = coefs + p * RAOP_RESAMPLER_TAPS;
+        double frac = (double) p / RAOP_RESAMPLER_PHASES;
+        double sum = 0.0;
+        for (int k = 0; k < RAOP_RESAMPLER_TAPS; k++) {
+            double x = k - center - frac;
+            double sinc = (x == 0.0) ? 1.0 : sin(M_PI * RAOP_RESAMPLER_CUTOFF * x) / (M_PI * RAOP_RESAMPLER_CUTOFF * x);
+            /* Blackman window over the filter span */
+            double w = (x + RAOP_RESAMPLER_TAPS / 2) / RAOP_RESAMPLER_TAPS;
+            double window = (w <= 0.0 || w >= 1.0) ? 0.0 : 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+            filter[k] = (float) (sinc * window);
+            sum += filter[k];
+        }
+        /* Unity gain at DC for every phase */
+        for (int k = 0; k < RAOP_RESAMPLER_TAPS; k++) {
+            filter[k] = (float) (filter[k] / sum);
+        }
+    }
+}
+
+raop_resampler_t *
+raop_resampler_init(logger_t *logger, int channels, int max_frame_size)
+{
+    raop_resampler_t *raop_resampler;
+
+    assert(channels > 0 && channels <= RAOP_RESAMPLER_MAX_CHANNELS);
+    assert(max_frame_size > 0);
+
+    raop_resampler = calloc(1, sizeof(raop_resampler_t));
+    if (!raop_resampler) {
+        return NULL;
+    }
+    raop_resampler->logger = logger;
+    raop_resampler->channels = channels;
+    raop_resampler->max_frame_size = max_frame_size;
+
+    ALIGNED_MALLOC(raop_resampler->coefs, RAOP_RESAMPLER_ALIGN, (RAOP_RESAMPLER_PHASES + 1) * RAOP_RESAMPLER_TAPS * sizeof(float));
+    ALIGNED_MALLOC(raop_resampler->taps, RAOP_RESAMPLER_ALIGN, RAOP_RESAMPLER_TAPS * sizeof(float));
+    /* Slightly more out than in when our clock runs slow */
+    raop_resampler->output = malloc((max_frame_size + RAOP_RESAMPLER_TAPS) * channels * sizeof(short));
+    int allocated = raop_resampler->coefs && raop_resampler->taps && raop_resampler->output;
+    for (int c = 0; c < channels; c++) {
+        raop_resampler->history[c] = malloc((max_frame_size + RAOP_RESAMPLER_TAPS) * sizeof(float));
+        allocated = allocated && raop_resampler->history[c];
+    }
+    if (!allocated) {
+        raop_resampler_destroy(raop_resampler);
+        return NULL;
+    }
+
+    raop_resampler_init_coefs(raop_resampler->coefs);
+    raop_resampler_reset(raop_resampler);
+    return raop_resampler;
+}
+
+int
+raop_resampler_process(raop_resampler_t *raop_resampler, pcm_decode_struct *pcm, double ppm)
+{
+    assert(raop_resampler);
+    assert(pcm);
+
+    int channels = raop_resampler->channels;
+    if (pcm->channels != channels || pcm->frame_size <= 0 || pcm->frame_size > raop_resampler->max_frame_size) {
+        return -1;
+    }
+
+    if (ppm > RAOP_RESAMPLER_MAX_PPM) ppm = RAOP_RESAMPLER_MAX_PPM;
+    if (ppm < -RAOP_RESAMPLER_MAX_PPM) ppm = -RAOP_RESAMPLER_MAX_PPM;
+    double step = 1.0 / (1.0 + ppm / 1000000.0);
+
+    /* Deinterleave the frame behind what is left of the previous one */
+    for (int i = 0; i < pcm->frame_size; i++) {
+        for (int c = 0; c < channels; c++) {
+            raop_resampler->history[c][raop_resampler->filled + i] = pcm->data[i * channels + c];
+        }
+    }
+    raop_resampler->filled += pcm->frame_size;
+
+    int out = 0;
+    double position = raop_resampler->position;
+    while ((int) position + RAOP_RESAMPLER_TAPS <= raop_resampler->filled) {
+        int index = (int) position;
+        double phase = (position - index) * RAOP_RESAMPLER_PHASES;
+        int p = (int) phase;
+        float a = (float) (phase - p);
+
+        /* Interpolate between the two nearest phases */
+        const float *c0 = raop_resampler->coefs + p * RAOP_RESAMPLER_TAPS;
+        const float *c1 = c0 + RAOP_RESAMPLER_TAPS;
+        for (int k = 0; k < RAOP_RESAMPLER_TAPS; k++) {
+            raop_resampler->taps[k] = c0[k] + a * (c1[k] - c0[k]);
+        }
+
+        for (int c = 0; c < channels; c++) {
+            float sample = raop_resampler_dot(raop_resampler->taps, raop_resampler->history[c] + index);
+            if (sample > 32767.0f) sample = 32767.0f;
+            if (sample < -32768.0f) sample = -32768.0f;
+            raop_resampler->output[out * channels + c] = (short) lrintf(sample);
+        }
+        out++;
+        position += step;
+    }
+
+    /* Keep the input the next outputs still need */
+    int consumed = (int) position;
+    if (consumed > raop_resampler->filled) {
+        consumed = raop_resampler->filled;
+    }
+    for (int c = 0; c < channels; c++) {
+        memmove(raop_resampler->history[c], raop_resampler->history[c] + consumed,
+                (raop_resampler->filled - consumed) * sizeof(float));
+    }
+    raop_resampler->filled -= consumed;
+    raop_resampler->position = position - consumed;
+
+    pcm->data = raop_resampler->output;
+    pcm->frame_size = out;
+    pcm->data_len = out * channels * sizeof(short);
+    return 0;
+}
+
+void
+raop_resampler_reset(raop_resampler_t *raop_resampler)
+{
+    assert(raop_resampler);
+
+    /* Start from silence so the first frame comes out at nearly full length */
+    for (int c = 0; c < raop_resampler->channels; c++) {
+        memset(raop_resampler->history[c], 0, (RAOP_RESAMPLER_TAPS - 1) * sizeof(float));
+    }
+    raop_resampler->filled = RAOP_RESAMPLER_TAPS - 1;
+    raop_resampler->position = 0.0;
+}
+
+void
+raop_resampler_destroy(raop_resampler_t *raop_resampler)
+{
+    if (raop_resampler) {
+        if (raop_resampler->coefs) ALIGNED_FREE(raop_resampler->coefs);
+        if (raop_resampler->taps) ALIGNED_FREE(raop_resampler->taps);
+        for (int c = 0; c < RAOP_RESAMPLER_MAX_CHANNELS; c++) {
+            free(raop_resampler->history[c]);
+        }
+        free(raop_resampler->output);
+        free(raop_resampler);
+    }
+}
@@ -0,0 +1,35 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_RESAMPLER_H
+#define RAOP_RESAMPLER_H
+
+#include "logger.h"
+#include "stream.h"
+
+/* Filter length per output sample and number of fractional phases in the table */
+#define RAOP_RESAMPLER_TAPS 32
+#define RAOP_RESAMPLER_PHASES 128
+#define RAOP_RESAMPLER_MAX_CHANNELS 2
+/* Largest correction applied, anything beyond is not drift */
+#define RAOP_RESAMPLER_MAX_PPM 1000.0
+
+typedef struct raop_resampler_s raop_resampler_t;
+
+raop_resampler_t *raop_resampler_init(logger_t *logger, int channels, int max_frame_size);
+/* Resamples a whole frame in place of pcm by ratio = 1 + ppm / 1e6 output samples per input sample;
+ * the result is owned by the resampler and valid until the next call */
+int raop_resampler_process(raop_resampler_t *raop_resampler, pcm_decode_struct *pcm, double ppm);
+void raop_resampler_reset(raop_resampler_t *raop_resampler);
+void raop_resampler_destroy(raop_resampler_t *raop_resampler);
+
+#endif
@@ -12,16 +12,35 @@
  *  Lesser General Public License for more details.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For recvmmsg */
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#endif
 
 #include "raop_rtp.h"
 #include "raop.h"
 #include "raop_buffer.h"
+#include "raop_playout.h"
+#include "raop_decoder.h"
+#include "raop_resampler.h"
+#include "spsc_queue.h"
 #include "netutils.h"
 #include "compat.h"
 #include "logger.h"
@@ -33,6 +52,39 @@
 
 #define RAOP_RTP_SAMPLE_RATE (44100.0 / 1000000.0)
 #define RAOP_RTP_SYNC_DATA_COUNT 8
+// Samples per packet assumed until two consecutive packets have been seen
+#define RAOP_RTP_DEFAULT_FRAME_SIZE 352
+#define RAOP_RTP_STATS_WORDS (sizeof(raop_buffer_stats_t) / sizeof(uint64_t))
+// Media time the sync packets must span before a clock drift estimate is trusted, in microseconds
+#define RAOP_RTP_DRIFT_MIN_SPAN 10000000
+// Weight of each new drift estimate
+#define RAOP_RTP_DRIFT_SMOOTHING 0.1
+// Datagrams taken from a socket per recvmmsg call, and the room for each, as much as a single read took
+#define RAOP_RTP_RECV_BATCH 16
+#define RAOP_RTP_RECV_SLOT RAOP_PACKET_LEN
+// Control updates that can wait for the audio thread at once
+#define RAOP_RTP_COMMAND_QUEUE_LENGTH 64
+
+typedef enum raop_rtp_command_type_e {
+    RAOP_RTP_COMMAND_METADATA,
+    RAOP_RTP_COMMAND_COVERART,
+    RAOP_RTP_COMMAND_REMOTE_CONTROL_ID
+} raop_rtp_command_type_t;
+
+// A control update from the RTSP thread, any memory it points to is handed over with it
+typedef struct raop_rtp_command_s {
+    raop_rtp_command_type_t type;
+    union {
+        struct {
+            unsigned char *data;
+            int len;
+        } buffer;
+        struct {
+            char *dacp_id;
+            char *active_remote_header;
+        } remote;
+    } args;
+} raop_rtp_command_t;
 
 typedef struct raop_rtp_sync_data_s {
     uint64_t ntp_time; // The local wall clock time at the time of rtp_time
@@ -50,17 +102,45 @@ struct raop_rtp_s {
     raop_rtp_sync_data_t sync_data[RAOP_RTP_SYNC_DATA_COUNT];
     int sync_data_index;
 
-    // Transmission Stats, could be used if a playout buffer is needed
-    // float interarrival_jitter; // As defined by RTP RFC 3550, Section 6.4.1
-    // unsigned int last_packet_transit_time;
-    //int transit = (packet_receive_time - packet_send_time);
-    // int d = transit - last_packet_transit_time;
-    // if (d < 0) d = -d;
-    // interarrival_jitter = (1.f / 16.f) * ((double) d - interarrival_jitter);
+    // Clock drift of the sender against us in ppm, from the first sync packet onwards
+    raop_rtp_sync_data_t drift_anchor;
+    int drift_anchor_valid;
+    int drift_valid;
+    double clock_drift;
+
+    // Transmission stats, used to size the playout buffer
+    double interarrival_jitter; // As defined by RTP RFC 3550, Section 6.4.1, in rtp units
+    int32_t last_packet_transit_time;
+    int transit_valid;
+    unsigned short last_seqnum;
+    uint32_t last_rtp_timestamp;
+    uint32_t frame_size; // Samples per packet
+
+    // Published copies of the jitter estimate, buffer depth and counters for the getters,
+    // odd while the audio thread replaces them. Doubles are kept as their bits
+    atomic_uint published_seq;
+    atomic_ullong jitter_published;
+    atomic_uint depth_published;
+    atomic_ullong stats_published[RAOP_RTP_STATS_WORDS];
+    // Read alone, also by the playout thread for the resampler
+    atomic_ullong drift_published;
 
     /* Buffer to handle all resends */
     raop_buffer_t *buffer;
 
+    /* Optional stage releasing frames at their presentation time */
+    raop_playout_t *playout;
+
+    /* Optional stage decoding frames to PCM, created when audio_process_pcm is set */
+    int compression_type;
+    raop_decoder_t *decoder;
+    /* Timestamp of the last frame handed on, lost frames are concealed after it */
+    uint64_t last_audio_pts;
+
+    /* Optional stage stretching decoded audio by the clock drift */
+    int resample;
+    raop_resampler_t *resampler;
+
     /* Remote address as sockaddr */
     struct sockaddr_storage remote_saddr;
     socklen_t remote_saddr_len;
@@ -70,30 +150,35 @@ struct raop_rtp_s {
     int running;
     int joined;
 
-    float volume;
-    int volume_changed;
-    unsigned char *metadata;
-    int metadata_len;
-    unsigned char *coverart;
-    int coverart_len;
-    char *dacp_id;
-    char *active_remote_header;
-    unsigned int progress_start;
-    unsigned int progress_curr;
-    unsigned int progress_end;
-    int progress_changed;
-
-    int flush;
     thread_handle_t thread;
     mutex_handle_t run_mutex;
     /* MUTEX LOCKED VARIABLES END */
 
+    /* Control updates pushed by the RTSP thread and drained by the audio thread when woken */
+    spsc_queue_t *commands;
+    /* Flush, volume and progress only matter by their latest value, so they are kept here
+     * instead of queued, and a full queue can never lose them */
+    atomic_int pending_flush;
+    atomic_uint pending_volume;
+    atomic_int volume_changed;
+    /* Odd while the RTSP thread replaces the progress values */
+    atomic_uint progress_seq;
+    atomic_uint progress_start, progress_curr, progress_end;
+    atomic_int progress_changed;
+    /* Tells the audio thread to exit */
+    atomic_int quit;
+
     /* Remote control and timing ports */
     unsigned short control_rport;
 
     /* Sockets for control and data */
     int csock, dsock;
 
+    /* Wakes the audio thread when an event is queued, -1 where the thread polls instead */
+    int event_fd;
+    /* Room for one batch of received datagrams */
+    unsigned char *recv_slab;
+
     /* Local control, timing and data ports */
     unsigned short control_lport;
     unsigned short data_lport;
@@ -120,7 +205,7 @@ raop_rtp_parse_remote(raop_rtp_t *raop_rtp, const unsigned char *remote, int rem
     }
     memset(current, 0, sizeof(current));
     sprintf(current, "%d.%d.%d.%d", remote[0], remote[1], remote[2], remote[3]);
-    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp parse remote ip = %s", current);
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp parse remote ip = %s", current);
     ret = netutils_parse_address(family, current,
                                  &raop_rtp->remote_saddr,
                                  sizeof(raop_rtp->remote_saddr));
@@ -168,24 +253,124 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, co
 
     raop_rtp->running = 0;
     raop_rtp->joined = 1;
-    raop_rtp->flush = NO_FLUSH;
+    atomic_init(&raop_rtp->quit, 0);
+
+    raop_rtp->frame_size = RAOP_RTP_DEFAULT_FRAME_SIZE;
+    raop_rtp->compression_type = RAOP_CT_AAC_ELD;
+    atomic_init(&raop_rtp->published_seq, 0);
+    atomic_init(&raop_rtp->jitter_published, 0);
+    atomic_init(&raop_rtp->depth_published, raop_buffer_get_length(raop_rtp->buffer));
+    for (int i = 0; i < RAOP_RTP_STATS_WORDS; i++) {
+        atomic_init(&raop_rtp->stats_published[i], 0);
+    }
+    atomic_init(&raop_rtp->drift_published, 0);
+
+    atomic_init(&raop_rtp->pending_flush, NO_FLUSH);
+    atomic_init(&raop_rtp->pending_volume, 0);
+    atomic_init(&raop_rtp->volume_changed, 0);
+    atomic_init(&raop_rtp->progress_seq, 0);
+    atomic_init(&raop_rtp->progress_start, 0);
+    atomic_init(&raop_rtp->progress_curr, 0);
+    atomic_init(&raop_rtp->progress_end, 0);
+    atomic_init(&raop_rtp->progress_changed, 0);
+    raop_rtp->commands = spsc_queue_init(RAOP_RTP_COMMAND_QUEUE_LENGTH, sizeof(raop_rtp_command_t));
+    if (!raop_rtp->commands) {
+        raop_buffer_destroy(raop_rtp->buffer);
+        free(raop_rtp);
+        return NULL;
+    }
+
+    raop_rtp->event_fd = -1;
+#if defined(__linux__)
+    raop_rtp->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    raop_rtp->recv_slab = malloc(RAOP_RTP_RECV_BATCH * RAOP_RTP_RECV_SLOT);
+    if (raop_rtp->event_fd == -1 || !raop_rtp->recv_slab) {
+        if (raop_rtp->event_fd != -1) close(raop_rtp->event_fd);
+        free(raop_rtp->recv_slab);
+        spsc_queue_destroy(raop_rtp->commands);
+        raop_buffer_destroy(raop_rtp->buffer);
+        free(raop_rtp);
+        return NULL;
+    }
+#endif
 
     MUTEX_CREATE(raop_rtp->run_mutex);
     return raop_rtp;
 }
 
 
+/* Lets the audio thread know a command or a stop request is waiting */
+static void
+raop_rtp_wakeup(raop_rtp_t *raop_rtp)
+{
+#if defined(__linux__)
+    uint64_t value = 1;
+    if (write(raop_rtp->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp error waking audio thread");
+    }
+#endif
+}
+
+/* Frees what undelivered commands carry, only once the audio thread is gone */
+static void
+raop_rtp_discard_commands(raop_rtp_t *raop_rtp)
+{
+    raop_rtp_command_t command;
+
+    while (spsc_queue_pop(raop_rtp->commands, &command) == 0) {
+        switch (command.type) {
+            case RAOP_RTP_COMMAND_METADATA:
+            case RAOP_RTP_COMMAND_COVERART:
+                free(command.args.buffer.data);
+                break;
+            case RAOP_RTP_COMMAND_REMOTE_CONTROL_ID:
+                free(command.args.remote.dacp_id);
+                free(command.args.remote.active_remote_header);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/* Forgets every control update not yet applied, so nothing meant for a stopped session replays on the next */
+static void
+raop_rtp_reset_events(raop_rtp_t *raop_rtp)
+{
+    raop_rtp_discard_commands(raop_rtp);
+    atomic_store_explicit(&raop_rtp->pending_flush, NO_FLUSH, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->volume_changed, 0, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->progress_changed, 0, memory_order_relaxed);
+}
+
+/* Queues a control update for the audio thread without waiting on it */
+static int
+raop_rtp_push_command(raop_rtp_t *raop_rtp, raop_rtp_command_t *command)
+{
+    if (spsc_queue_push(raop_rtp->commands, command) < 0) {
+        logger_log(raop_rtp->logger, LOGGER_WARNING, "raop_rtp command queue full, dropping command %d", command->type);
+        return -1;
+    }
+    raop_rtp_wakeup(raop_rtp);
+    return 0;
+}
+
 void
 raop_rtp_destroy(raop_rtp_t *raop_rtp)
 {
     if (raop_rtp) {
         raop_rtp_stop(raop_rtp);
         MUTEX_DESTROY(raop_rtp->run_mutex);
+        raop_playout_destroy(raop_rtp->playout);
+        raop_decoder_destroy(raop_rtp->decoder);
+        raop_resampler_destroy(raop_rtp->resampler);
         raop_buffer_destroy(raop_rtp->buffer);
-        free(raop_rtp->metadata);
-        free(raop_rtp->coverart);
-        free(raop_rtp->dacp_id);
-        free(raop_rtp->active_remote_header);
+#if defined(__linux__)
+        close(raop_rtp->event_fd);
+#endif
+        free(raop_rtp->recv_slab);
+        raop_rtp_discard_commands(raop_rtp);
+        spsc_queue_destroy(raop_rtp->commands);
         free(raop_rtp);
     }
 }
@@ -203,7 +388,7 @@ raop_rtp_resend_callback(void *opaque, unsigned short seqnum, unsigned short cou
     addr = (struct sockaddr *)&raop_rtp->control_saddr;
     addrlen = raop_rtp->control_saddr_len;
 
-    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp got resend request %d %d", seqnum, count);
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp got resend request %d %d", seqnum, count);
     ourseqnum = raop_rtp->control_seqnum++;
 
     /* Fill the request buffer */
@@ -239,6 +424,14 @@ raop_rtp_init_sockets(raop_rtp_t *raop_rtp, int use_ipv6, int use_udp)
         goto sockets_cleanup;
     }
 
+#if defined(SO_TIMESTAMPNS)
+    /* Have the kernel stamp each audio datagram on arrival, for the jitter estimate */
+    int timestamps = 1;
+    if (setsockopt(dsock, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps)) < 0) {
+        logger_log(raop_rtp->logger, LOGGER_WARNING, "raop_rtp could not enable receive timestamps");
+    }
+#endif
+
     /* Set socket descriptors */
     raop_rtp->csock = csock;
     raop_rtp->dsock = dsock;
@@ -257,63 +450,67 @@ raop_rtp_init_sockets(raop_rtp_t *raop_rtp, int use_ipv6, int use_udp)
 static int
 raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 {
-    int flush;
-    float volume;
-    int volume_changed;
-    unsigned char *metadata;
-    int metadata_len;
-    unsigned char *coverart;
-    int coverart_len;
-    char *dacp_id;
-    char *active_remote_header;
-    unsigned int progress_start;
-    unsigned int progress_curr;
-    unsigned int progress_end;
-    int progress_changed;
+    raop_rtp_command_t command;
+    int flush = NO_FLUSH;
+    float volume = 0.0f;
+    int volume_changed = 0;
+    unsigned char *metadata = NULL;
+    int metadata_len = 0;
+    unsigned char *coverart = NULL;
+    int coverart_len = 0;
+    char *dacp_id = NULL;
+    char *active_remote_header = NULL;
+    unsigned int progress_start = 0;
+    unsigned int progress_curr = 0;
+    unsigned int progress_end = 0;
+    int progress_changed = 0;
 
     assert(raop_rtp);
 
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    if (!raop_rtp->running) {
-        MUTEX_UNLOCK(raop_rtp->run_mutex);
+    if (atomic_load_explicit(&raop_rtp->quit, memory_order_acquire)) {
         return 1;
     }
 
-    /* Read the volume level */
-    volume = raop_rtp->volume;
-    volume_changed = raop_rtp->volume_changed;
-    raop_rtp->volume_changed = 0;
-
-    /* Read the flush value */
-    flush = raop_rtp->flush;
-    raop_rtp->flush = NO_FLUSH;
-
-    /* Read the metadata */
-    metadata = raop_rtp->metadata;
-    metadata_len = raop_rtp->metadata_len;
-    raop_rtp->metadata = NULL;
-    raop_rtp->metadata_len = 0;
-
-    /* Read the coverart */
-    coverart = raop_rtp->coverart;
-    coverart_len = raop_rtp->coverart_len;
-    raop_rtp->coverart = NULL;
-    raop_rtp->coverart_len = 0;
-
-    /* Read DACP remote control data */
-    dacp_id = raop_rtp->dacp_id;
-    active_remote_header = raop_rtp->active_remote_header;
-    raop_rtp->dacp_id = NULL;
-    raop_rtp->active_remote_header = NULL;
-
-    /* Read the progress values */
-    progress_start = raop_rtp->progress_start;
-    progress_curr = raop_rtp->progress_curr;
-    progress_end = raop_rtp->progress_end;
-    progress_changed = raop_rtp->progress_changed;
-    raop_rtp->progress_changed = 0;
+    /* Take the latest values set since the last wakeup */
+    flush = atomic_exchange_explicit(&raop_rtp->pending_flush, NO_FLUSH, memory_order_acquire);
+    if (atomic_exchange_explicit(&raop_rtp->volume_changed, 0, memory_order_acquire)) {
+        unsigned int bits = atomic_load_explicit(&raop_rtp->pending_volume, memory_order_relaxed);
+        memcpy(&volume, &bits, sizeof(volume));
+        volume_changed = 1;
+    }
+    if (atomic_exchange_explicit(&raop_rtp->progress_changed, 0, memory_order_acquire)) {
+        unsigned int seq;
+        do {
+            seq = atomic_load_explicit(&raop_rtp->progress_seq, memory_order_acquire);
+            progress_start = atomic_load_explicit(&raop_rtp->progress_start, memory_order_relaxed);
+            progress_curr = atomic_load_explicit(&raop_rtp->progress_curr, memory_order_relaxed);
+            progress_end = atomic_load_explicit(&raop_rtp->progress_end, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+        } while ((seq & 1) || seq != atomic_load_explicit(&raop_rtp->progress_seq, memory_order_relaxed));
+        progress_changed = 1;
+    }
 
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    /* Collapse everything queued since the last wakeup, newer values replace older ones */
+    while (spsc_queue_pop(raop_rtp->commands, &command) == 0) {
+        switch (command.type) {
+            case RAOP_RTP_COMMAND_METADATA:
+                free(metadata);
+                metadata = command.args.buffer.data;
+                metadata_len = command.args.buffer.len;
+                break;
+            case RAOP_RTP_COMMAND_COVERART:
+                free(coverart);
+                coverart = command.args.buffer.data;
+                coverart_len = command.args.buffer.len;
+                break;
+            case RAOP_RTP_COMMAND_REMOTE_CONTROL_ID:
+                free(dacp_id);
+                free(active_remote_header);
+                dacp_id = command.args.remote.dacp_id;
+                active_remote_header = command.args.remote.active_remote_header;
+                break;
+        }
+    }
 
     /* Call set_volume callback if changed */
     if (volume_changed) {
@@ -325,6 +522,16 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 
     /* Handle flush if requested */
     if (flush != NO_FLUSH) {
+        if (raop_rtp->playout) {
+            raop_playout_flush(raop_rtp->playout);
+        }
+        if (raop_rtp->decoder) {
+            raop_decoder_flush(raop_rtp->decoder);
+        }
+        raop_rtp->last_audio_pts = 0;
+        if (raop_rtp->resampler) {
+            raop_resampler_reset(raop_rtp->resampler);
+        }
         if (raop_rtp->callbacks.audio_flush) {
             raop_rtp->callbacks.audio_flush(raop_rtp->callbacks.cls);
         }
@@ -363,7 +570,46 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
     return 0;
 }
 
+static void
+raop_rtp_estimate_drift(raop_rtp_t *raop_rtp, uint32_t rtp_time, uint64_t ntp_time)
+{
+    if (!raop_rtp->drift_anchor_valid) {
+        raop_rtp->drift_anchor.rtp_time = rtp_time;
+        raop_rtp->drift_anchor.ntp_time = ntp_time;
+        raop_rtp->drift_anchor_valid = 1;
+        return;
+    }
+
+    // Slope of local time against media time over everything seen so far, so sync jitter averages out
+    double media_elapsed = ((double) (uint32_t) (rtp_time - raop_rtp->drift_anchor.rtp_time)) / RAOP_RTP_SAMPLE_RATE;
+    double local_elapsed = (double) (int64_t) (ntp_time - raop_rtp->drift_anchor.ntp_time);
+    if (media_elapsed < RAOP_RTP_DRIFT_MIN_SPAN) {
+        return;
+    }
+    double drift = (local_elapsed / media_elapsed - 1.0) * 1000000.0;
+    if (fabs(drift) > RAOP_RESAMPLER_MAX_PPM) {
+        // Not drift but a jump of either clock, start over
+        LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp drift estimate of %.1f ppm discarded", drift);
+        raop_rtp->drift_anchor_valid = 0;
+        raop_rtp->drift_valid = 0;
+        raop_rtp->clock_drift = 0.0;
+    } else if (!raop_rtp->drift_valid) {
+        raop_rtp->clock_drift = drift;
+        raop_rtp->drift_valid = 1;
+    } else {
+        raop_rtp->clock_drift += (drift - raop_rtp->clock_drift) * RAOP_RTP_DRIFT_SMOOTHING;
+    }
+    raop_rtp->rtp_sync_scale = RAOP_RTP_SAMPLE_RATE / (1.0 + raop_rtp->clock_drift / 1000000.0);
+
+    unsigned long long bits;
+    memcpy(&bits, &raop_rtp->clock_drift, sizeof(bits));
+    atomic_store_explicit(&raop_rtp->drift_published, bits, memory_order_relaxed);
+}
+
 void raop_rtp_sync_clock(raop_rtp_t *raop_rtp, uint32_t rtp_time, uint64_t ntp_time) {
+    // Rescale first, the offsets below are recomputed with the current scale
+    raop_rtp_estimate_drift(raop_rtp, rtp_time, ntp_time);
+
     raop_rtp->sync_data_index = (raop_rtp->sync_data_index + 1) % RAOP_RTP_SYNC_DATA_COUNT;
     raop_rtp->sync_data[raop_rtp->sync_data_index].rtp_time = rtp_time;
     raop_rtp->sync_data[raop_rtp->sync_data_index].ntp_time = ntp_time;
@@ -380,13 +626,359 @@ void raop_rtp_sync_clock(raop_rtp_t *raop_rtp, uint32_t rtp_time, uint64_t ntp_t
     int64_t correction = avg_offset - raop_rtp->rtp_sync_offset;
     raop_rtp->rtp_sync_offset = avg_offset;
 
-    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp sync correction=%lld", correction);
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp sync correction=%lld, drift=%.2f ppm", correction, raop_rtp->clock_drift);
 }
 
 uint64_t raop_rtp_convert_rtp_time(raop_rtp_t *raop_rtp, uint32_t rtp_time) {
     return (uint64_t) (((double) rtp_time) / raop_rtp->rtp_sync_scale) - raop_rtp->rtp_sync_offset;
 }
 
+// Publishes the jitter estimate, buffer depth and counters, readers retry while the count is odd or moved
+static void
+raop_rtp_publish_stats(raop_rtp_t *raop_rtp)
+{
+    double jitter = raop_rtp->interarrival_jitter / RAOP_RTP_SAMPLE_RATE;
+    unsigned long long jitter_bits;
+    uint64_t words[RAOP_RTP_STATS_WORDS];
+    raop_buffer_stats_t stats;
+
+    memcpy(&jitter_bits, &jitter, sizeof(jitter_bits));
+    raop_buffer_get_stats(raop_rtp->buffer, &stats);
+    memcpy(words, &stats, sizeof(words));
+
+    unsigned int seq = atomic_load_explicit(&raop_rtp->published_seq, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->published_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&raop_rtp->jitter_published, jitter_bits, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->depth_published, raop_buffer_get_length(raop_rtp->buffer), memory_order_relaxed);
+    for (int i = 0; i < RAOP_RTP_STATS_WORDS; i++) {
+        atomic_store_explicit(&raop_rtp->stats_published[i], words[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&raop_rtp->published_seq, seq + 2, memory_order_release);
+}
+
+static void
+raop_rtp_update_jitter(raop_rtp_t *raop_rtp, unsigned short seqnum, uint32_t rtp_timestamp, uint64_t ntp_now)
+{
+    // Arrival time in rtp units, only differences matter so wrapping is fine
+    uint32_t arrival = (uint32_t) (uint64_t) ((double) ntp_now * RAOP_RTP_SAMPLE_RATE);
+    int32_t transit = (int32_t) (arrival - rtp_timestamp);
+
+    if (raop_rtp->transit_valid) {
+        int32_t d = transit - raop_rtp->last_packet_transit_time;
+        if (d < 0) d = -d;
+        raop_rtp->interarrival_jitter += (1.0 / 16.0) * ((double) d - raop_rtp->interarrival_jitter);
+
+        if ((unsigned short) (seqnum - raop_rtp->last_seqnum) == 1) {
+            uint32_t frame_size = rtp_timestamp - raop_rtp->last_rtp_timestamp;
+            if (frame_size > 0 && frame_size < 44100) {
+                raop_rtp->frame_size = frame_size;
+            }
+        }
+    }
+    raop_rtp->last_packet_transit_time = transit;
+    raop_rtp->last_seqnum = seqnum;
+    raop_rtp->last_rtp_timestamp = rtp_timestamp;
+    raop_rtp->transit_valid = 1;
+
+    raop_buffer_adapt_length(raop_rtp->buffer, raop_rtp->interarrival_jitter / raop_rtp->frame_size);
+}
+
+static void
+raop_rtp_process_audio(void *opaque, unsigned char *data, unsigned int datalen, uint64_t pts)
+{
+    raop_rtp_t *raop_rtp = opaque;
+    aac_decode_struct aac_data;
+    unsigned char *remote;
+    int remote_len;
+    unsigned int streamId = 0;
+
+    aac_data.data_len = datalen;
+    aac_data.data = data;
+    aac_data.pts = pts;
+
+    remote = netutils_get_address(&raop_rtp->remote_saddr, &remote_len);
+    memcpy(&streamId, remote, 4);
+
+    if (raop_rtp->decoder) {
+        pcm_decode_struct pcm_data;
+        /* Lost or undecodable frames are concealed so the output keeps its cadence */
+        if ((datalen == 0 || raop_decoder_decode(raop_rtp->decoder, data, datalen, &pcm_data) < 0) &&
+            raop_decoder_conceal(raop_rtp->decoder, &pcm_data) < 0) {
+            return;
+        }
+        if (raop_rtp->resampler) {
+            unsigned long long bits = atomic_load_explicit(&raop_rtp->drift_published, memory_order_relaxed);
+            double drift;
+            memcpy(&drift, &bits, sizeof(drift));
+            raop_resampler_process(raop_rtp->resampler, &pcm_data, drift);
+        }
+        pcm_data.pts = pts;
+        raop_rtp->callbacks.audio_process_pcm(raop_rtp->callbacks.cls, raop_rtp->ntp, &pcm_data, streamId);
+        return;
+    }
+    if (datalen == 0) {
+        return;
+    }
+    raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &aac_data, streamId);
+}
+
+static void
+raop_rtp_handle_control(raop_rtp_t *raop_rtp, unsigned char *packet, unsigned int packetlen,
+                        struct sockaddr_storage *saddr, socklen_t saddrlen)
+{
+    memcpy(&raop_rtp->control_saddr, saddr, saddrlen);
+    raop_rtp->control_saddr_len = saddrlen;
+    int type_c = packet[1] & ~0x80;
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp type_c 0x%02x, packetlen = %d", type_c, packetlen);
+    if (type_c == 0x56) {
+        /* Handle resent data packet */
+        uint32_t rtp_timestamp =  (packet[4 + 4] << 24) | (packet[4 + 5] << 16) | (packet[4 + 6] << 8) | packet[4 + 7];
+        uint64_t ntp_timestamp = raop_rtp_convert_rtp_time(raop_rtp, rtp_timestamp);
+        uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp->ntp);
+        LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp audio resent: ntp = %llu, now = %llu, latency=%lld, rtp=%u",
+                   ntp_timestamp, ntp_now, ((int64_t) ntp_now) - ((int64_t) ntp_timestamp), rtp_timestamp);
+        int result = raop_buffer_enqueue(raop_rtp->buffer, packet + 4, packetlen - 4, ntp_timestamp, 1);
+        assert(result >= 0);
+    } else if (type_c == 0x54 && packetlen >= 20) {
+        // The unit for the rtp clock is 1 / sample rate = 1 / 44100
+        uint32_t sync_rtp = byteutils_get_int_be(packet, 4) - 11025;
+        uint64_t sync_ntp_raw = byteutils_get_long_be(packet, 8);
+        uint64_t sync_ntp_remote = raop_ntp_timestamp_to_micro_seconds(sync_ntp_raw, true);
+        uint64_t sync_ntp_local = raop_ntp_convert_remote_time(raop_rtp->ntp, sync_ntp_remote);
+        // It's not clear what the additional rtp timestamp indicates
+        uint32_t next_rtp = byteutils_get_int_be(packet, 16);
+        LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp sync: ntp=%llu, local ntp: %llu, rtp=%u, rtp_next=%u",
+                   sync_ntp_remote, sync_ntp_local, sync_rtp, next_rtp);
+        raop_rtp_sync_clock(raop_rtp, sync_rtp, sync_ntp_local);
+    } else {
+        LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp unknown packet");
+    }
+}
+
+// Queues one audio data packet that reached us at local time arrival, returns 0 if it was too short to carry audio
+static int
+raop_rtp_handle_data(raop_rtp_t *raop_rtp, unsigned char *packet, unsigned int packetlen, uint64_t arrival)
+{
+    // Len = 16 appears if there is no time
+    if (packetlen < 12) {
+        return 0;
+    }
+
+    uint32_t rtp_timestamp =  (packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+    uint64_t ntp_timestamp = raop_rtp_convert_rtp_time(raop_rtp, rtp_timestamp);
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp audio: ntp = %llu, arrival = %llu, latency=%lld, rtp=%u",
+               ntp_timestamp, arrival, ((int64_t) arrival) - ((int64_t) ntp_timestamp), rtp_timestamp);
+
+    raop_rtp_update_jitter(raop_rtp, (packet[2] << 8) | packet[3], rtp_timestamp, arrival);
+
+    int result = raop_buffer_enqueue(raop_rtp->buffer, packet, packetlen, ntp_timestamp, 1);
+    assert(result >= 0);
+    return 1;
+}
+
+// Hands on everything now in order in the buffer and asks for what is missing
+static void
+raop_rtp_deliver_audio(raop_rtp_t *raop_rtp)
+{
+    int no_resend = (raop_rtp->control_rport == 0);// false
+
+    // Render continuous buffer entries
+    void *payload = NULL;
+    unsigned int payload_size;
+    uint64_t timestamp;
+    int lost;
+    while ((payload = raop_buffer_dequeue(raop_rtp->buffer, &payload_size, &timestamp, no_resend, &lost)) || lost) {
+        if (payload) {
+            raop_rtp->last_audio_pts = timestamp;
+        } else if (raop_rtp->decoder && raop_rtp->last_audio_pts) {
+            /* Hand on an empty frame where the lost one was due, to be concealed */
+            raop_rtp->last_audio_pts += (uint64_t) (raop_rtp->frame_size / RAOP_RTP_SAMPLE_RATE);
+            timestamp = raop_rtp->last_audio_pts;
+            payload_size = 0;
+        } else {
+            continue;
+        }
+        if (raop_rtp->playout) {
+            raop_playout_enqueue(raop_rtp->playout, payload, payload_size, timestamp);
+        } else {
+            raop_rtp_process_audio(raop_rtp, payload, payload_size, timestamp);
+        }
+    }
+
+    /* Handle possible resend requests */
+    if (!no_resend) {
+        raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp,
+                                   raop_ntp_get_local_time(raop_rtp->ntp));
+    }
+
+    raop_rtp_publish_stats(raop_rtp);
+}
+
+#if defined(__linux__)
+
+// Room for the receive timestamp of one datagram, aligned for the header
+typedef union raop_rtp_cmsg_u {
+    char buf[CMSG_SPACE(sizeof(struct timespec))];
+    struct cmsghdr align;
+} raop_rtp_cmsg_t;
+
+// Fills the receive slab with as many waiting datagrams as fit, without blocking
+static int
+raop_rtp_receive_batch(raop_rtp_t *raop_rtp, int sock, struct mmsghdr *msgs, struct iovec *iovs,
+                       struct sockaddr_storage *saddrs, raop_rtp_cmsg_t *cmsgs)
+{
+    for (int i = 0; i < RAOP_RTP_RECV_BATCH; i++) {
+        iovs[i].iov_base = raop_rtp->recv_slab + i * RAOP_RTP_RECV_SLOT;
+        iovs[i].iov_len = RAOP_RTP_RECV_SLOT;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &saddrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(saddrs[i]);
+        msgs[i].msg_hdr.msg_control = cmsgs[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i].buf);
+    }
+    return recvmmsg(sock, msgs, RAOP_RTP_RECV_BATCH, MSG_DONTWAIT, NULL);
+}
+
+// Local time the kernel stamped on the datagram, or fallback where it did not
+static uint64_t
+raop_rtp_arrival_time(struct msghdr *msg, uint64_t fallback)
+{
+#if defined(SO_TIMESTAMPNS)
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec time;
+            memcpy(&time, CMSG_DATA(cmsg), sizeof(time));
+            return (uint64_t) time.tv_sec * 1000000 + (uint64_t) (time.tv_nsec / 1000);
+        }
+    }
+#endif
+    return fallback;
+}
+
+static THREAD_RETVAL
+raop_rtp_thread_udp(void *arg)
+{
+    raop_rtp_t *raop_rtp = arg;
+    struct mmsghdr msgs[RAOP_RTP_RECV_BATCH];
+    struct iovec iovs[RAOP_RTP_RECV_BATCH];
+    struct sockaddr_storage saddrs[RAOP_RTP_RECV_BATCH];
+    raop_rtp_cmsg_t cmsgs[RAOP_RTP_RECV_BATCH];
+    int order[RAOP_RTP_RECV_BATCH];
+    struct epoll_event events[3];
+    int epfd;
+
+    assert(raop_rtp);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp error creating epoll instance");
+        goto thread_exit;
+    }
+    int fds[] = { raop_rtp->event_fd, raop_rtp->csock, raop_rtp->dsock };
+    for (int i = 0; i < 3; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+            logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp error adding socket to epoll");
+            goto thread_exit;
+        }
+    }
+
+    /* Events queued before the thread started */
+    int stopped = raop_rtp_process_events(raop_rtp, NULL);
+    while (!stopped) {
+        /* Nothing to do until a packet or an event arrives */
+        int nfds = epoll_wait(epfd, events, 3, -1);
+        if (nfds == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp error in epoll_wait");
+            break;
+        }
+
+        for (int n = 0; n < nfds && !stopped; n++) {
+            int fd = events[n].data.fd;
+            int count;
+            if (fd == raop_rtp->event_fd) {
+                uint64_t value;
+                if (read(raop_rtp->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp error reading event counter");
+                }
+                stopped = raop_rtp_process_events(raop_rtp, NULL);
+            } else if (fd == raop_rtp->csock) {
+                do {
+                    count = raop_rtp_receive_batch(raop_rtp, raop_rtp->csock, msgs, iovs, saddrs, cmsgs);
+                    for (int i = 0; i < count; i++) {
+                        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                            logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp dropped oversized control packet");
+                            continue;
+                        }
+                        raop_rtp_handle_control(raop_rtp, iovs[i].iov_base, msgs[i].msg_len,
+                                                &saddrs[i], msgs[i].msg_hdr.msg_namelen);
+                    }
+                } while (count == RAOP_RTP_RECV_BATCH);
+            } else if (fd == raop_rtp->dsock) {
+                do {
+                    count = raop_rtp_receive_batch(raop_rtp, raop_rtp->dsock, msgs, iovs, saddrs, cmsgs);
+                    if (count <= 0) {
+                        break;
+                    }
+                    /* Stands in for the kernel timestamps if there are none, still taken before sorting */
+                    uint64_t received = raop_ntp_get_local_time(raop_rtp->ntp);
+
+                    /* Queue the batch in sequence order, it may have been reordered on the way */
+                    for (int i = 0; i < count; i++) {
+                        int j = i;
+                        unsigned char *packet = iovs[i].iov_base;
+                        unsigned short seqnum = (packet[2] << 8) | packet[3];
+                        while (j > 0) {
+                            unsigned char *prev = iovs[order[j - 1]].iov_base;
+                            if ((short) (seqnum - ((prev[2] << 8) | prev[3])) >= 0) {
+                                break;
+                            }
+                            order[j] = order[j - 1];
+                            j--;
+                        }
+                        order[j] = i;
+                    }
+                    int queued = 0;
+                    for (int i = 0; i < count; i++) {
+                        struct mmsghdr *msg = &msgs[order[i]];
+                        if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+                            logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp dropped oversized packet");
+                            continue;
+                        }
+                        queued += raop_rtp_handle_data(raop_rtp, iovs[order[i]].iov_base, msg->msg_len,
+                                                       raop_rtp_arrival_time(&msg->msg_hdr, received));
+                    }
+                    if (queued) {
+                        raop_rtp_deliver_audio(raop_rtp);
+                    }
+                } while (count == RAOP_RTP_RECV_BATCH);
+            }
+        }
+    }
+
+    thread_exit:
+    if (epfd != -1) close(epfd);
+
+    // Ensure running reflects the actual state
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    raop_rtp->running = false;
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp exiting thread");
+
+    return 0;
+}
+
+#else
+
 static THREAD_RETVAL
 raop_rtp_thread_udp(void *arg)
 {
@@ -396,10 +988,6 @@ raop_rtp_thread_udp(void *arg)
     struct sockaddr_storage saddr;
     socklen_t saddrlen;
 
-    int remote_len;
-    unsigned char* remote;
-    unsigned int streamId = 0;
-
     assert(raop_rtp);
 
     while(1) {
@@ -439,81 +1027,17 @@ raop_rtp_thread_udp(void *arg)
             saddrlen = sizeof(saddr);
             packetlen = recvfrom(raop_rtp->csock, (char *)packet, sizeof(packet), 0,
                                  (struct sockaddr *)&saddr, &saddrlen);
-
-            memcpy(&raop_rtp->control_saddr, &saddr, saddrlen);
-            raop_rtp->control_saddr_len = saddrlen;
-            int type_c = packet[1] & ~0x80;
-            logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp type_c 0x%02x, packetlen = %d", type_c, packetlen);
-            if (type_c == 0x56) {
-                /* Handle resent data packet */
-                uint32_t rtp_timestamp =  (packet[4 + 4] << 24) | (packet[4 + 5] << 16) | (packet[4 + 6] << 8) | packet[4 + 7];
-                uint64_t ntp_timestamp = raop_rtp_convert_rtp_time(raop_rtp, rtp_timestamp);
-                uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp->ntp);
-                logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp audio resent: ntp = %llu, now = %llu, latency=%lld, rtp=%u",
-                           ntp_timestamp, ntp_now, ((int64_t) ntp_now) - ((int64_t) ntp_timestamp), rtp_timestamp);
-                int result = raop_buffer_enqueue(raop_rtp->buffer, packet + 4, packetlen - 4, ntp_timestamp, 1);
-                assert(result >= 0);
-            } else if (type_c == 0x54 && packetlen >= 20) {
-                // The unit for the rtp clock is 1 / sample rate = 1 / 44100
-                uint32_t sync_rtp = byteutils_get_int_be(packet, 4) - 11025;
-                uint64_t sync_ntp_raw = byteutils_get_long_be(packet, 8);
-                uint64_t sync_ntp_remote = raop_ntp_timestamp_to_micro_seconds(sync_ntp_raw, true);
-                uint64_t sync_ntp_local = raop_ntp_convert_remote_time(raop_rtp->ntp, sync_ntp_remote);
-                // It's not clear what the additional rtp timestamp indicates
-                uint32_t next_rtp = byteutils_get_int_be(packet, 16);
-                logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp sync: ntp=%llu, local ntp: %llu, rtp=%u, rtp_next=%u",
-                           sync_ntp_remote, sync_ntp_local, sync_rtp, next_rtp);
-                raop_rtp_sync_clock(raop_rtp, sync_rtp, sync_ntp_local);
-            } else {
-                logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp unknown packet");
-            }
+            raop_rtp_handle_control(raop_rtp, packet, packetlen, &saddr, saddrlen);
         }
 
         if (FD_ISSET(raop_rtp->dsock, &rfds)) {
-            //logger_log(raop_rtp->logger, LOGGER_INFO, "Would have data packet in queue");
             // Receiving audio data here
             saddrlen = sizeof(saddr);
             packetlen = recvfrom(raop_rtp->dsock, (char *)packet, sizeof(packet), 0,
                                  (struct sockaddr *)&saddr, &saddrlen);
-            // rtp payload type
-            int type_d = packet[1] & ~0x80;
-            //logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp_thread_udp type_d 0x%02x, packetlen = %d", type_d, packetlen);
-
-            // Len = 16 appears if there is no time
-            if (packetlen >= 12) {
-                int no_resend = (raop_rtp->control_rport == 0);// false
-
-                uint32_t rtp_timestamp =  (packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
-                uint64_t ntp_timestamp = raop_rtp_convert_rtp_time(raop_rtp, rtp_timestamp);
-                uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp->ntp);
-                logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp audio: ntp = %llu, now = %llu, latency=%lld, rtp=%u",
-                           ntp_timestamp, ntp_now, ((int64_t) ntp_now) - ((int64_t) ntp_timestamp), rtp_timestamp);
-
-                int result = raop_buffer_enqueue(raop_rtp->buffer, packet, packetlen, ntp_timestamp, 1);
-                assert(result >= 0);
-
-                // Render continuous buffer entries
-                void *payload = NULL;
-                unsigned int payload_size;
-                uint64_t timestamp;
-                while ((payload = raop_buffer_dequeue(raop_rtp->buffer, &payload_size, &timestamp, no_resend))) {
-                    aac_decode_struct aac_data;
-                    aac_data.data_len = payload_size;
-                    aac_data.data = payload;
-                    aac_data.pts = timestamp;
-
-                    remote = netutils_get_address(&raop_rtp->remote_saddr, &remote_len);
-                    memcpy(&streamId, remote, 4);
-                    raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &aac_data, streamId);
-                    free(payload);
-                }
-
-                /* Handle possible resend requests */
-                if (!no_resend) {
-                    raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp);
-                }
+            if (raop_rtp_handle_data(raop_rtp, packet, packetlen, raop_ntp_get_local_time(raop_rtp->ntp))) {
+                raop_rtp_deliver_audio(raop_rtp);
             }
-
         }
     }
 
@@ -522,11 +1046,13 @@ raop_rtp_thread_udp(void *arg)
     raop_rtp->running = false;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
 
-    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp exiting thread");
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp exiting thread");
 
     return 0;
 }
 
+#endif
+
 // Start rtp service, three udp ports
 void
 raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport,
@@ -543,6 +1069,20 @@ raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_r
         return;
     }
 
+    /* Check this before any socket is opened, so a failed start leaves nothing behind */
+    if (raop_rtp->callbacks.audio_process_pcm && !raop_rtp->decoder) {
+        raop_rtp->decoder = raop_decoder_init(raop_rtp->logger, raop_rtp->compression_type);
+    }
+    if (raop_rtp->decoder && raop_rtp->resample && !raop_rtp->resampler) {
+        raop_rtp->resampler = raop_resampler_init(raop_rtp->logger, RAOP_DECODER_CHANNELS, RAOP_DECODER_MAX_FRAME_SIZE);
+    }
+    if (!raop_rtp->decoder && !raop_rtp->callbacks.audio_process) {
+        logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp has no way to deliver audio of compression type %d",
+                   raop_rtp->compression_type);
+        MUTEX_UNLOCK(raop_rtp->run_mutex);
+        return;
+    }
+
     /* Initialize ports and sockets */
     raop_rtp->control_rport = control_rport;
     if (raop_rtp->remote_saddr.ss_family == AF_INET6) {
@@ -559,11 +1099,126 @@ raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_r
     /* Create the thread and initialize running values */
     raop_rtp->running = 1;
     raop_rtp->joined = 0;
+    atomic_store_explicit(&raop_rtp->quit, 0, memory_order_relaxed);
 
     THREAD_CREATE(raop_rtp->thread, raop_rtp_thread_udp, raop_rtp);
     MUTEX_UNLOCK(raop_rtp->run_mutex);
 }
 
+void
+raop_rtp_set_audio_format(raop_rtp_t *raop_rtp, int compression_type, unsigned int samples_per_frame)
+{
+    assert(raop_rtp);
+
+    /* Only allowed before the audio thread starts */
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    if (!raop_rtp->running) {
+        if (compression_type && compression_type != raop_rtp->compression_type) {
+            raop_rtp->compression_type = compression_type;
+            raop_decoder_destroy(raop_rtp->decoder);
+            raop_rtp->decoder = NULL;
+        }
+        if (samples_per_frame) {
+            raop_rtp->frame_size = samples_per_frame;
+        }
+    }
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+}
+
+void
+raop_rtp_set_buffer_bounds(raop_rtp_t *raop_rtp, unsigned short min_packets, unsigned short max_packets)
+{
+    assert(raop_rtp);
+
+    /* Only allowed before the audio thread owns the buffer */
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    if (!raop_rtp->running) {
+        raop_buffer_set_length_bounds(raop_rtp->buffer, min_packets, max_packets);
+        raop_rtp_publish_stats(raop_rtp);
+    }
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+}
+
+void
+raop_rtp_set_playout(raop_rtp_t *raop_rtp, int enabled, unsigned int output_latency_us)
+{
+    assert(raop_rtp);
+
+    /* Only allowed before the audio thread starts delivering */
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    if (!raop_rtp->running) {
+        raop_playout_destroy(raop_rtp->playout);
+        raop_rtp->playout = NULL;
+        if (enabled) {
+            raop_rtp->playout = raop_playout_init(raop_rtp->logger, raop_rtp->ntp, output_latency_us,
+                                                  raop_rtp_process_audio, raop_rtp);
+        }
+    }
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+}
+
+void
+raop_rtp_set_resampling(raop_rtp_t *raop_rtp, int enabled)
+{
+    assert(raop_rtp);
+
+    /* Only allowed before the audio thread starts */
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    if (!raop_rtp->running) {
+        raop_rtp->resample = enabled;
+        if (!enabled) {
+            raop_resampler_destroy(raop_rtp->resampler);
+            raop_rtp->resampler = NULL;
+        }
+    }
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+}
+
+void
+raop_rtp_get_clock_drift(raop_rtp_t *raop_rtp, double *ppm)
+{
+    assert(raop_rtp);
+    assert(ppm);
+
+    unsigned long long bits = atomic_load_explicit(&raop_rtp->drift_published, memory_order_relaxed);
+    memcpy(ppm, &bits, sizeof(*ppm));
+}
+
+void
+raop_rtp_get_jitter(raop_rtp_t *raop_rtp, unsigned short *depth, double *jitter_us)
+{
+    assert(raop_rtp);
+
+    unsigned long long jitter_bits;
+    unsigned int depth_published, seq;
+    do {
+        seq = atomic_load_explicit(&raop_rtp->published_seq, memory_order_acquire);
+        jitter_bits = atomic_load_explicit(&raop_rtp->jitter_published, memory_order_relaxed);
+        depth_published = atomic_load_explicit(&raop_rtp->depth_published, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&raop_rtp->published_seq, memory_order_relaxed));
+    if (depth) *depth = depth_published;
+    if (jitter_us) memcpy(jitter_us, &jitter_bits, sizeof(*jitter_us));
+}
+
+void
+raop_rtp_get_buffer_stats(raop_rtp_t *raop_rtp, raop_buffer_stats_t *stats)
+{
+    assert(raop_rtp);
+    assert(stats);
+
+    uint64_t words[RAOP_RTP_STATS_WORDS];
+    unsigned int seq;
+    do {
+        seq = atomic_load_explicit(&raop_rtp->published_seq, memory_order_acquire);
+        for (int i = 0; i < RAOP_RTP_STATS_WORDS; i++) {
+            words[i] = atomic_load_explicit(&raop_rtp->stats_published[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&raop_rtp->published_seq, memory_order_relaxed));
+    memcpy(stats, words, sizeof(raop_buffer_stats_t));
+}
+
 void
 raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
 {
@@ -576,10 +1231,11 @@ raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume)
     }
 
     /* Set volume in thread instead */
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    raop_rtp->volume = volume;
-    raop_rtp->volume_changed = 1;
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    unsigned int bits;
+    memcpy(&bits, &volume, sizeof(bits));
+    atomic_store_explicit(&raop_rtp->pending_volume, bits, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->volume_changed, 1, memory_order_release);
+    raop_rtp_wakeup(raop_rtp);
 }
 
 void
@@ -597,10 +1253,13 @@ raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen)
     memcpy(metadata, data, datalen);
 
     /* Set metadata in thread instead */
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    raop_rtp->metadata = metadata;
-    raop_rtp->metadata_len = datalen;
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_command_t command;
+    command.type = RAOP_RTP_COMMAND_METADATA;
+    command.args.buffer.data = metadata;
+    command.args.buffer.len = datalen;
+    if (raop_rtp_push_command(raop_rtp, &command) < 0) {
+        free(metadata);
+    }
 }
 
 void
@@ -618,10 +1277,13 @@ raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen)
     memcpy(coverart, data, datalen);
 
     /* Set coverart in thread instead */
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    raop_rtp->coverart = coverart;
-    raop_rtp->coverart_len = datalen;
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_command_t command;
+    command.type = RAOP_RTP_COMMAND_COVERART;
+    command.args.buffer.data = coverart;
+    command.args.buffer.len = datalen;
+    if (raop_rtp_push_command(raop_rtp, &command) < 0) {
+        free(coverart);
+    }
 }
 
 void
@@ -634,10 +1296,14 @@ raop_rtp_remote_control_id(raop_rtp_t *raop_rtp, const char *dacp_id, const char
     }
 
     /* Set dacp stuff in thread instead */
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    raop_rtp->dacp_id = strdup(dacp_id);
-    raop_rtp->active_remote_header = strdup(active_remote_header);
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    raop_rtp_command_t command;
+    command.type = RAOP_RTP_COMMAND_REMOTE_CONTROL_ID;
+    command.args.remote.dacp_id = strdup(dacp_id);
+    command.args.remote.active_remote_header = strdup(active_remote_header);
+    if (raop_rtp_push_command(raop_rtp, &command) < 0) {
+        free(command.args.remote.dacp_id);
+        free(command.args.remote.active_remote_header);
+    }
 }
 
 void
@@ -645,13 +1311,16 @@ raop_rtp_set_progress(raop_rtp_t *raop_rtp, unsigned int start, unsigned int cur
 {
     assert(raop_rtp);
 
-    /* Set progress in thread instead */
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    raop_rtp->progress_start = start;
-    raop_rtp->progress_curr = curr;
-    raop_rtp->progress_end = end;
-    raop_rtp->progress_changed = 1;
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    /* Set progress in thread instead, the audio thread retries if it reads while the count is odd or moved */
+    unsigned int seq = atomic_load_explicit(&raop_rtp->progress_seq, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->progress_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&raop_rtp->progress_start, start, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->progress_curr, curr, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->progress_end, end, memory_order_relaxed);
+    atomic_store_explicit(&raop_rtp->progress_seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&raop_rtp->progress_changed, 1, memory_order_release);
+    raop_rtp_wakeup(raop_rtp);
 }
 
 void
@@ -659,10 +1328,9 @@ raop_rtp_flush(raop_rtp_t *raop_rtp, int next_seq)
 {
     assert(raop_rtp);
 
-    /* Call flush in thread instead */
-    MUTEX_LOCK(raop_rtp->run_mutex);
-    raop_rtp->flush = next_seq;
-    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    /* Call flush in thread instead, a later flush supersedes one not yet handled */
+    atomic_store_explicit(&raop_rtp->pending_flush, next_seq, memory_order_release);
+    raop_rtp_wakeup(raop_rtp);
 }
 
 void
@@ -679,6 +1347,8 @@ raop_rtp_stop(raop_rtp_t *raop_rtp)
     }
     raop_rtp->running = 0;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
+    atomic_store_explicit(&raop_rtp->quit, 1, memory_order_release);
+    raop_rtp_wakeup(raop_rtp);
 
     /* Join the thread */
     THREAD_JOIN(raop_rtp->thread);
@@ -686,8 +1356,30 @@ raop_rtp_stop(raop_rtp_t *raop_rtp)
     if (raop_rtp->csock != -1) closesocket(raop_rtp->csock);
     if (raop_rtp->dsock != -1) closesocket(raop_rtp->dsock);
 
+    /* The thread is gone, whatever it did not apply belongs to the stopped session */
+    raop_rtp_reset_events(raop_rtp);
+
+    raop_buffer_stats_t stats;
+    raop_buffer_get_stats(raop_rtp->buffer, &stats);
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp buffer stats: enqueued=%llu, dequeued=%llu",
+               stats.enqueued, stats.dequeued);
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp resend stats: requests=%llu, requested=%llu, recovered=%llu, late=%llu",
+               stats.resend_requests, stats.resend_requested, stats.resend_recovered, stats.resend_late);
+    LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp lost packets: %llu", stats.lost);
+
     /* Flush buffer into initial state */
     raop_buffer_flush(raop_rtp->buffer, -1);
+    raop_rtp->last_audio_pts = 0;
+    if (raop_rtp->playout) {
+        raop_playout_flush(raop_rtp->playout);
+    }
+    if (raop_rtp->decoder) {
+        raop_decoder_stats_t decoder_stats;
+        raop_decoder_get_stats(raop_rtp->decoder, &decoder_stats);
+        LOGGER_LOG(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp decoder stats: decoded=%llu, errors=%llu, concealed=%llu, muted=%llu",
+                   decoder_stats.decoded, decoder_stats.errors, decoder_stats.concealed, decoder_stats.muted);
+        raop_decoder_flush(raop_rtp->decoder);
+    }
 
     /* Mark thread as joined */
     MUTEX_LOCK(raop_rtp->run_mutex);
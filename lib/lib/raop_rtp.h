@@ -25,6 +25,7 @@
 #define RAOP_PACKET_LEN 32768
 
 typedef struct raop_rtp_s raop_rtp_t;
+struct raop_buffer_stats_s;
 
 raop_rtp_t *raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, const unsigned char *remote, int remotelen,
                           const unsigned char *aeskey, const unsigned char *aesiv, const unsigned char *ecdh_secret);
@@ -32,6 +33,20 @@ raop_rtp_t *raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_nt
 void raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short control_rport,
                           unsigned short *control_lport, unsigned short *data_lport);
 
+/* Compression type ("ct") and samples per frame ("spf") announced in SETUP, 0 keeps the current value */
+void raop_rtp_set_audio_format(raop_rtp_t *raop_rtp, int compression_type, unsigned int samples_per_frame);
+void raop_rtp_set_buffer_bounds(raop_rtp_t *raop_rtp, unsigned short min_packets, unsigned short max_packets);
+/* Hold frames until their presentation time minus output_latency_us instead of releasing them on arrival */
+void raop_rtp_set_playout(raop_rtp_t *raop_rtp, int enabled, unsigned int output_latency_us);
+/* Stretch decoded audio to follow the sender's sample clock, needs audio_process_pcm */
+void raop_rtp_set_resampling(raop_rtp_t *raop_rtp, int enabled);
+/* Estimated rate of the sender's clock against ours, in ppm */
+void raop_rtp_get_clock_drift(raop_rtp_t *raop_rtp, double *ppm);
+/* Current reorder window in packets and the RFC 3550 interarrival jitter in microseconds */
+void raop_rtp_get_jitter(raop_rtp_t *raop_rtp, unsigned short *depth, double *jitter_us);
+/* Reorder buffer counters as of the last delivery, safe to call from any thread */
+void raop_rtp_get_buffer_stats(raop_rtp_t *raop_rtp, struct raop_buffer_stats_s *stats);
+
 void raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume);
 void raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen);
 void raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen);
@@ -20,11 +20,19 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #ifdef WIN32
 #include <WinSock2.h>
 #define SOL_TCP IPPROTO_TCP
 #else
 #include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#endif
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #include "raop.h"
@@ -33,7 +41,36 @@
 #include "logger.h"
 #include "byteutils.h"
 #include "mirror_buffer.h"
+#include "spsc_queue.h"
 #include "stream.h"
+#include "h264_parser.h"
+
+/* What was measured for one video frame on its way through */
+typedef struct raop_mirror_sample_s {
+    uint64_t arrival;
+    int size;
+    int64_t latency;
+    uint32_t decrypt_time;
+    int queue_depth;
+} raop_mirror_sample_t;
+
+/* Deepest delivery queue the frame pool can back */
+#define RAOP_RTP_MIRROR_MAX_QUEUE_DEPTH (MIRROR_BUFFER_POOL_SIZE - 2)
+
+/* What a frame means to the decoder, in order of importance when frames have to go */
+typedef enum {
+    RAOP_MIRROR_FRAME_NON_REFERENCE,
+    RAOP_MIRROR_FRAME_REFERENCE,
+    RAOP_MIRROR_FRAME_IDR,
+    RAOP_MIRROR_FRAME_CONFIG
+} raop_mirror_frame_kind_t;
+
+typedef struct raop_mirror_frame_s {
+    h264_decode_struct h264;
+    unsigned int streamId;
+    /* Handle of the pool frame the data is in, to give back rather than free, -1 for a copy */
+    int pool_frame;
+} raop_mirror_frame_t;
 
 
 struct h264codec_s {
@@ -73,6 +110,31 @@ struct raop_rtp_mirror_s {
 
     /* MUTEX LOCKED VARIABLES END */
     int mirror_data_sock;
+    /* Wakes the mirror thread when it has to stop */
+    int event_fd;
+
+    /* Frames between the network thread and the delivery thread, only when queue_depth > 0 */
+    unsigned int queue_depth;
+    spsc_queue_t *frames;
+    thread_handle_t thread_delivery;
+    atomic_int delivery_quit;
+    atomic_int delivery_waiting;
+    mutex_handle_t delivery_mutex;
+    cond_handle_t delivery_cond;
+
+    atomic_uint_fast64_t frames_queued;
+    atomic_uint_fast64_t frames_dropped;
+    atomic_uint_fast64_t frames_delivered;
+
+    /* MUTEX LOCKED VARIABLES START */
+    /* Rolling statistics of the session, the network thread adds samples and the
+     * delivery thread callback times; both rings are indexed by count modulo the window */
+    mutex_handle_t stats_mutex;
+    raop_mirror_sample_t samples[RAOP_RTP_MIRROR_STATS_WINDOW];
+    unsigned int sample_count;
+    uint32_t callback_times[RAOP_RTP_MIRROR_STATS_WINDOW];
+    unsigned int callback_count;
+    /* MUTEX LOCKED VARIABLES END */
 
     unsigned short mirror_data_lport;
 };
@@ -93,7 +155,7 @@ raop_rtp_parse_remote(raop_rtp_mirror_t *raop_rtp_mirror, const unsigned char *r
     }
     memset(current, 0, sizeof(current));
     sprintf(current, "%d.%d.%d.%d", remote[0], remote[1], remote[2], remote[3]);
-    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror parse remote ip = %s", current);
+    LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror parse remote ip = %s", current);
     ret = netutils_parse_address(family, current,
                                  &raop_rtp_mirror->remote_saddr,
                                  sizeof(raop_rtp_mirror->remote_saddr));
@@ -128,14 +190,32 @@ raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *call
         return NULL;
     }
     if (raop_rtp_parse_remote(raop_rtp_mirror, remote, remotelen) < 0) {
+        mirror_buffer_destroy(raop_rtp_mirror->buffer);
         free(raop_rtp_mirror);
         return NULL;
     }
+    raop_rtp_mirror->event_fd = -1;
+#if defined(__linux__)
+    raop_rtp_mirror->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (raop_rtp_mirror->event_fd == -1) {
+        mirror_buffer_destroy(raop_rtp_mirror->buffer);
+        free(raop_rtp_mirror);
+        return NULL;
+    }
+#endif
     raop_rtp_mirror->running = 0;
     raop_rtp_mirror->joined = 1;
     raop_rtp_mirror->flush = NO_FLUSH;
+    atomic_init(&raop_rtp_mirror->delivery_quit, 0);
+    atomic_init(&raop_rtp_mirror->delivery_waiting, 0);
+    atomic_init(&raop_rtp_mirror->frames_queued, 0);
+    atomic_init(&raop_rtp_mirror->frames_dropped, 0);
+    atomic_init(&raop_rtp_mirror->frames_delivered, 0);
 
     MUTEX_CREATE(raop_rtp_mirror->run_mutex);
+    MUTEX_CREATE(raop_rtp_mirror->delivery_mutex);
+    COND_CREATE(raop_rtp_mirror->delivery_cond);
+    MUTEX_CREATE(raop_rtp_mirror->stats_mutex);
     return raop_rtp_mirror;
 }
 
@@ -148,6 +228,727 @@ raop_rtp_init_mirror_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t streamConn
 //#define DUMP_H264
 
 #define RAOP_PACKET_LEN 32768
+/* Every frame starts with a fixed size header, followed by payload_size bytes */
+#define RAOP_MIRROR_HEADER_LEN 128
+/* Anything larger is a corrupt stream rather than a video frame */
+#define RAOP_MIRROR_MAX_PAYLOAD (16 * 1024 * 1024)
+/* Bytes read past the current frame per call, enough for several small frames */
+#define RAOP_MIRROR_STAGING_LEN 16384
+
+typedef enum {
+    RAOP_MIRROR_READ_HEADER,
+    RAOP_MIRROR_READ_PAYLOAD
+} raop_mirror_read_state_t;
+
+/* Incremental parser of the stream, fed by whatever a non-blocking read returned */
+typedef struct raop_mirror_reader_s {
+    raop_mirror_read_state_t state;
+    unsigned char header[RAOP_MIRROR_HEADER_LEN];
+    unsigned char *payload;
+    /* Handle of the pool frame holding the payload, -1 when none */
+    int payload_frame;
+    int payload_size;
+    /* Bytes of the header or payload received so far */
+    int filled;
+
+    unsigned char staging[RAOP_MIRROR_STAGING_LEN];
+
+    /* Last parameter sets in Annex-B form, the codec they are for, and what they say about the stream */
+    unsigned char *sps_pps;
+    int codec;
+    video_stream_info info;
+    /* The size changed and the IDR that starts it has not been seen yet */
+    int resolution_pending;
+
+    /* A copy of the SPS and PPS that did not fit in the delivery queue yet, data is NULL when none */
+    raop_mirror_frame_t pending_config;
+    /* Set once a frame others depend on was dropped, cleared by the next IDR */
+    int drop_until_idr;
+
+    /* Position in the stream, carried into every frame */
+    int gop_index;
+    int frame_poc;
+#ifdef DUMP_H264
+    FILE *file;
+    FILE *file_source;
+    FILE *file_len;
+#endif
+} raop_mirror_reader_t;
+
+/* Lets the mirror thread know it has to stop */
+static void
+raop_rtp_mirror_wakeup(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+#if defined(__linux__)
+    uint64_t value = 1;
+    if (write(raop_rtp_mirror->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error waking mirror thread");
+    }
+#endif
+}
+
+static void
+raop_rtp_mirror_release(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_frame_t *frame)
+{
+    if (frame->pool_frame >= 0) {
+        mirror_buffer_release_frame(raop_rtp_mirror->buffer, frame->pool_frame);
+    } else {
+        free(frame->h264.data);
+    }
+}
+
+/* Calls video_process and records how long it took */
+static void
+raop_rtp_mirror_video_process(raop_rtp_mirror_t *raop_rtp_mirror, h264_decode_struct *h264, unsigned int streamId)
+{
+    uint64_t start = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+    raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, h264, streamId);
+    uint64_t end = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+    atomic_fetch_add_explicit(&raop_rtp_mirror->frames_delivered, 1, memory_order_relaxed);
+
+    MUTEX_LOCK(raop_rtp_mirror->stats_mutex);
+    raop_rtp_mirror->callback_times[raop_rtp_mirror->callback_count++ % RAOP_RTP_MIRROR_STATS_WINDOW] =
+            end > start ? (uint32_t) (end - start) : 0;
+    MUTEX_UNLOCK(raop_rtp_mirror->stats_mutex);
+}
+
+static THREAD_RETVAL
+raop_rtp_mirror_delivery_thread(void *arg)
+{
+    raop_rtp_mirror_t *raop_rtp_mirror = arg;
+    raop_mirror_frame_t frame;
+    assert(raop_rtp_mirror);
+
+    while (!atomic_load(&raop_rtp_mirror->delivery_quit)) {
+        if (spsc_queue_pop(raop_rtp_mirror->frames, &frame) == 0) {
+            raop_rtp_mirror_video_process(raop_rtp_mirror, &frame.h264, frame.streamId);
+            raop_rtp_mirror_release(raop_rtp_mirror, &frame);
+            continue;
+        }
+
+        /* The network thread only takes the mutex to wake us once we announced we sleep */
+        MUTEX_LOCK(raop_rtp_mirror->delivery_mutex);
+        atomic_store(&raop_rtp_mirror->delivery_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (spsc_queue_count(raop_rtp_mirror->frames) == 0 && !atomic_load(&raop_rtp_mirror->delivery_quit)) {
+            pthread_cond_wait(&raop_rtp_mirror->delivery_cond, &raop_rtp_mirror->delivery_mutex);
+        }
+        atomic_store(&raop_rtp_mirror->delivery_waiting, 0);
+        MUTEX_UNLOCK(raop_rtp_mirror->delivery_mutex);
+    }
+
+    LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror exiting delivery thread");
+    return 0;
+}
+
+/* Queues a frame for the delivery thread, returns -1 when the queue is at its depth */
+static int
+raop_rtp_mirror_enqueue(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_frame_t *frame)
+{
+    if (spsc_queue_count(raop_rtp_mirror->frames) >= raop_rtp_mirror->queue_depth ||
+        spsc_queue_push(raop_rtp_mirror->frames, frame) < 0) {
+        return -1;
+    }
+    atomic_fetch_add_explicit(&raop_rtp_mirror->frames_queued, 1, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&raop_rtp_mirror->delivery_waiting)) {
+        MUTEX_LOCK(raop_rtp_mirror->delivery_mutex);
+        COND_SIGNAL(raop_rtp_mirror->delivery_cond);
+        MUTEX_UNLOCK(raop_rtp_mirror->delivery_mutex);
+    }
+    return 0;
+}
+
+/* Lists a NAL unit in the frame's index */
+static void
+raop_rtp_mirror_index_nal(h264_decode_struct *h264, int offset, int length)
+{
+    if (h264->nal_count < H264_MAX_NAL_UNITS) {
+        h264_nal_unit *nal = &h264->nal_units[h264->nal_count++];
+        nal->offset = offset;
+        nal->length = length;
+        if (h264->codec == VIDEO_CODEC_HEVC) {
+            nal->type = (h264->data[offset] >> 1) & 0x3f;
+            // The even VCL types up to 14 are pictures nothing else refers to
+            nal->ref_idc = nal->type > 14 || (nal->type & 1);
+        } else {
+            nal->type = h264->data[offset] & 0x1f;
+            nal->ref_idc = (h264->data[offset] >> 5) & 0x03;
+        }
+    }
+}
+
+/* HEVC random access points count as IDR, they start a sequence the same way */
+static int
+raop_rtp_mirror_nal_is_idr(int codec, int type)
+{
+    return codec == VIDEO_CODEC_HEVC ? (type >= 16 && type <= 21) : type == 5;
+}
+
+static int
+raop_rtp_mirror_nal_is_slice(int codec, int type)
+{
+    return codec == VIDEO_CODEC_HEVC ? type <= 9 : (type >= 1 && type <= 4);
+}
+
+static int
+raop_rtp_mirror_nal_is_parameter_set(int codec, int type)
+{
+    return codec == VIDEO_CODEC_HEVC ? (type >= 32 && type <= 34) : (type == 7 || type == 8);
+}
+
+/* Sets the frame type from the indexed NAL units and places the frame in its GOP */
+static void
+raop_rtp_mirror_classify(raop_mirror_reader_t *reader, h264_decode_struct *h264)
+{
+    int slices = 0;
+    int parameter_sets = 0;
+
+    h264->frame_type = H264_FRAME_TYPE_NON_IDR;
+    for (int i = 0; i < h264->nal_count; i++) {
+        if (raop_rtp_mirror_nal_is_idr(h264->codec, h264->nal_units[i].type)) {
+            h264->frame_type = H264_FRAME_TYPE_IDR;
+            break;
+        } else if (raop_rtp_mirror_nal_is_slice(h264->codec, h264->nal_units[i].type)) {
+            slices++;
+        } else if (raop_rtp_mirror_nal_is_parameter_set(h264->codec, h264->nal_units[i].type)) {
+            parameter_sets++;
+        }
+    }
+    if (h264->frame_type == H264_FRAME_TYPE_NON_IDR && parameter_sets && !slices) {
+        h264->frame_type = H264_FRAME_TYPE_PARAMETER_SETS;
+    }
+
+    if (h264->frame_type == H264_FRAME_TYPE_IDR) {
+        reader->gop_index++;
+        reader->frame_poc = 0;
+    } else if (h264->frame_type == H264_FRAME_TYPE_NON_IDR) {
+        reader->frame_poc++;
+    }
+    h264->n_gop_index = reader->gop_index;
+    h264->n_frame_poc = reader->frame_poc;
+}
+
+static raop_mirror_frame_kind_t
+raop_rtp_mirror_frame_kind(const h264_decode_struct *h264)
+{
+    if (h264->frame_type == H264_FRAME_TYPE_PARAMETER_SETS) {
+        return RAOP_MIRROR_FRAME_CONFIG;
+    } else if (h264->frame_type == H264_FRAME_TYPE_IDR) {
+        return RAOP_MIRROR_FRAME_IDR;
+    }
+    // Slices with a non-zero nal_ref_idc are referenced by later frames
+    for (int i = 0; i < h264->nal_count; i++) {
+        if (raop_rtp_mirror_nal_is_slice(h264->codec, h264->nal_units[i].type) && h264->nal_units[i].ref_idc) {
+            return RAOP_MIRROR_FRAME_REFERENCE;
+        }
+    }
+    return RAOP_MIRROR_FRAME_NON_REFERENCE;
+}
+
+/* Hands a frame to video_process, directly or through the queue. When the consumer falls
+ * behind, frames are dropped, and once a frame others depend on is gone everything up to
+ * the next IDR goes with it. The latest SPS and PPS are always kept. */
+static void
+raop_rtp_mirror_deliver(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_reader_t *reader,
+                        h264_decode_struct *h264, unsigned int streamId)
+{
+    raop_mirror_frame_t frame;
+    raop_mirror_frame_kind_t kind = raop_rtp_mirror_frame_kind(h264);
+
+    if (!raop_rtp_mirror->frames) {
+        raop_rtp_mirror_video_process(raop_rtp_mirror, h264, streamId);
+        return;
+    }
+
+    if (kind == RAOP_MIRROR_FRAME_CONFIG) {
+        /* The reader keeps its own copy, the queue gets one the consumer frees */
+        unsigned char *config = malloc(h264->data_len);
+        if (!config) {
+            return;
+        }
+        memcpy(config, h264->data, h264->data_len);
+        if (reader->pending_config.h264.data) {
+            free(reader->pending_config.h264.data);
+            atomic_fetch_add_explicit(&raop_rtp_mirror->frames_dropped, 1, memory_order_relaxed);
+        }
+        reader->pending_config.h264 = *h264;
+        reader->pending_config.h264.data = config;
+        reader->pending_config.streamId = streamId;
+        reader->pending_config.pool_frame = -1;
+    }
+
+    if (reader->pending_config.h264.data) {
+        if (raop_rtp_mirror_enqueue(raop_rtp_mirror, &reader->pending_config) == 0) {
+            reader->pending_config.h264.data = NULL;
+        }
+    }
+    if (kind == RAOP_MIRROR_FRAME_CONFIG) {
+        return;
+    }
+
+    /* Frames can not overtake the parameter sets they are coded with */
+    if (!reader->pending_config.h264.data && (!reader->drop_until_idr || kind == RAOP_MIRROR_FRAME_IDR)) {
+        frame.h264 = *h264;
+        frame.streamId = streamId;
+        frame.pool_frame = reader->payload_frame;
+        if (raop_rtp_mirror_enqueue(raop_rtp_mirror, &frame) == 0) {
+            /* The delivery thread gives the buffer back */
+            reader->payload = NULL;
+            reader->payload_frame = -1;
+            reader->drop_until_idr = 0;
+            return;
+        }
+    }
+
+    atomic_fetch_add_explicit(&raop_rtp_mirror->frames_dropped, 1, memory_order_relaxed);
+    if (kind != RAOP_MIRROR_FRAME_NON_REFERENCE && !reader->drop_until_idr) {
+        reader->drop_until_idr = 1;
+        LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror video consumer behind, dropping until the next IDR");
+    }
+}
+
+/* An HEVCDecoderConfigurationRecord has fixed one bits an avcC record does not have at those offsets */
+static int
+raop_rtp_mirror_is_hvcc(const unsigned char *payload, int payload_size)
+{
+    return payload_size >= 23 && payload[0] == 1 &&
+           (payload[13] & 0xf0) == 0xf0 && (payload[15] & 0xfc) == 0xfc && (payload[16] & 0xfc) == 0xfc &&
+           (payload[17] & 0xf8) == 0xf8 && (payload[18] & 0xf8) == 0xf8;
+}
+
+/* Turns an avcC record with one SPS and one PPS into an Annex-B frame in config, and parses both */
+static int
+raop_rtp_mirror_parse_avcc(raop_rtp_mirror_t *raop_rtp_mirror, const unsigned char *payload, int payload_size,
+                           h264_decode_struct *config, video_stream_info *info)
+{
+    if (payload_size < 11) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror truncated codec config of %d bytes", payload_size);
+        return -1;
+    }
+    h264codec_t h264;
+    h264.version = payload[0];
+    h264.profile_high = payload[1];
+    h264.compatibility = payload[2];
+    h264.level = payload[3];
+    h264.reserved_6_and_nal = payload[4];
+    h264.reserved_3_and_sps = payload[5];
+    h264.sps_size = (short) (((payload[6] & 255) << 8) + (payload[7] & 255));
+    LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror sps size = %d", h264.sps_size);
+    if (h264.sps_size <= 0 || h264.sps_size > payload_size - 11) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror invalid sps size %d", h264.sps_size);
+        return -1;
+    }
+    h264.number_of_pps = payload[h264.sps_size + 8];
+    h264.pps_size = (short) (((payload[h264.sps_size + 9] & 255) << 8) + (payload[h264.sps_size + 10] & 255));
+    LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror pps size = %d", h264.pps_size);
+    if (h264.pps_size <= 0 || h264.pps_size > payload_size - 11 - h264.sps_size) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror invalid pps size %d", h264.pps_size);
+        return -1;
+    }
+    h264.sequence_parameter_set = (unsigned char *) payload + 8;
+    h264.picture_parameter_set = (unsigned char *) payload + h264.sps_size + 11;
+
+    // Copy the sps and pps into a buffer to hand to the decoder
+    int sps_pps_len = (h264.sps_size + h264.pps_size) + 8;
+    unsigned char *sps_pps = malloc(sps_pps_len);
+    if (!sps_pps) {
+        return -1;
+    }
+    sps_pps[0] = 0;
+    sps_pps[1] = 0;
+    sps_pps[2] = 0;
+    sps_pps[3] = 1;
+    memcpy(sps_pps + 4, h264.sequence_parameter_set, h264.sps_size);
+    sps_pps[h264.sps_size + 4] = 0;
+    sps_pps[h264.sps_size + 5] = 0;
+    sps_pps[h264.sps_size + 6] = 0;
+    sps_pps[h264.sps_size + 7] = 1;
+    memcpy(sps_pps + h264.sps_size + 8, h264.picture_parameter_set, h264.pps_size);
+
+    config->data = sps_pps;
+    config->data_len = sps_pps_len;
+    raop_rtp_mirror_index_nal(config, 4, h264.sps_size);
+    raop_rtp_mirror_index_nal(config, h264.sps_size + 8, h264.pps_size);
+
+    if (h264_parse_sps(h264.sequence_parameter_set, h264.sps_size, info) < 0 ||
+        h264_parse_pps(h264.picture_parameter_set, h264.pps_size, info) < 0) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not parse the SPS / PPS");
+        memset(info, 0, sizeof(video_stream_info));
+    }
+    return 0;
+}
+
+/* Turns the VPS, SPS and PPS arrays of an hvcC record into an Annex-B frame in config, and parses the SPS */
+static int
+raop_rtp_mirror_parse_hvcc(raop_rtp_mirror_t *raop_rtp_mirror, const unsigned char *payload, int payload_size,
+                           h264_decode_struct *config, video_stream_info *info)
+{
+    unsigned char *data = NULL;
+    int data_len = 0;
+    int sps_parsed = 0;
+
+    // The first pass checks the record and sizes the frame, the second one fills it
+    for (int pass = 0; pass < 2; pass++) {
+        int pos = 23;
+        int len = 0;
+        for (int a = 0; a < payload[22]; a++) {
+            if (payload_size - pos < 3) {
+                goto malformed;
+            }
+            int count = (payload[pos + 1] << 8) | payload[pos + 2];
+            pos += 3;
+            for (int n = 0; n < count; n++) {
+                if (payload_size - pos < 2) {
+                    goto malformed;
+                }
+                int nal_len = (payload[pos] << 8) | payload[pos + 1];
+                pos += 2;
+                if (nal_len < 2 || nal_len > payload_size - pos) {
+                    goto malformed;
+                }
+                if (data) {
+                    data[len + 0] = 0;
+                    data[len + 1] = 0;
+                    data[len + 2] = 0;
+                    data[len + 3] = 1;
+                    memcpy(data + len + 4, payload + pos, nal_len);
+                    raop_rtp_mirror_index_nal(config, len + 4, nal_len);
+                    if (!sps_parsed && ((payload[pos] >> 1) & 0x3f) == 33) {
+                        sps_parsed = hevc_parse_sps(payload + pos, nal_len, info) == 0;
+                    }
+                }
+                len += nal_len + 4;
+                pos += nal_len;
+            }
+        }
+        if (!data) {
+            if (len == 0) {
+                goto malformed;
+            }
+            data = malloc(len);
+            if (!data) {
+                return -1;
+            }
+            data_len = len;
+            config->data = data;
+            config->data_len = data_len;
+        }
+    }
+
+    if (!sps_parsed) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not parse the HEVC SPS");
+        memset(info, 0, sizeof(video_stream_info));
+    }
+    return 0;
+
+malformed:
+    logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror malformed hvcC record of %d bytes", payload_size);
+    return -1;
+}
+
+static void
+raop_rtp_mirror_process_frame(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_reader_t *reader)
+{
+    unsigned char *packet = reader->header;
+    unsigned char *payload = reader->payload;
+    int payload_size = reader->payload_size;
+    unsigned short payload_type = byteutils_get_short(packet, 4) & 0xff;
+    int remote_len;
+    unsigned char *remote;
+    unsigned int streamId = 0;
+
+    if (payload_type == 0) {
+        // Normal video data (VCL NAL)
+
+        // Conveniently, the video data is already stamped with the remote wall clock time,
+        // so no additional clock syncing needed. The only thing odd here is that the video
+        // ntp time stamps don't include the SECONDS_FROM_1900_TO_1970, so it's really just
+        // counting micro seconds since last boot.
+        uint64_t ntp_timestamp_raw = byteutils_get_long(packet, 8);
+        uint64_t ntp_timestamp_remote = raop_ntp_timestamp_to_micro_seconds(ntp_timestamp_raw, false);
+        uint64_t ntp_timestamp = raop_ntp_convert_remote_time(raop_rtp_mirror->ntp, ntp_timestamp_remote);
+
+        uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+        LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror video ntp = %llu, now = %llu, latency = %lld",
+                   ntp_timestamp, ntp_now, ((int64_t) ntp_now) - ((int64_t) ntp_timestamp));
+
+#ifdef DUMP_H264
+        fwrite(payload, payload_size, 1, reader->file_source);
+        fwrite(&payload_size, sizeof(payload_size), 1, reader->file_len);
+#endif
+
+        // Decrypt data
+        uint64_t decrypt_start = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+        mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload, payload_size);
+        unsigned char* payload_decrypted = payload;
+
+        raop_mirror_sample_t sample;
+        sample.arrival = ntp_now;
+        sample.size = payload_size;
+        sample.latency = ((int64_t) ntp_now) - ((int64_t) ntp_timestamp);
+        uint64_t decrypt_end = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+        sample.decrypt_time = decrypt_end > decrypt_start ? (uint32_t) (decrypt_end - decrypt_start) : 0;
+
+        h264_decode_struct h264_data;
+        memset(&h264_data, 0, sizeof(h264_data));
+        h264_data.data_len = payload_size;
+        h264_data.data = payload_decrypted;
+        h264_data.pts = ntp_timestamp;
+        h264_data.codec = reader->codec;
+        h264_data.info = reader->info;
+
+        int nalu_size = 0;
+
+        // It seems the AirPlay protocol prepends NALs with their size, which we're replacing with the 4-byte
+        // start code for the NAL Byte-Stream Format, noting where each NAL is on the way.
+        while (nalu_size < payload_size) {
+            if (payload_size - nalu_size < 5) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror truncated NAL at %d of %d", nalu_size, payload_size);
+                return;
+            }
+            int nc_len = (payload_decrypted[nalu_size + 0] << 24) | (payload_decrypted[nalu_size + 1] << 16) |
+                         (payload_decrypted[nalu_size + 2] << 8) | (payload_decrypted[nalu_size + 3]);
+            if (nc_len <= 0 || nc_len > payload_size - nalu_size - 4) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror invalid NAL length %d at %d of %d", nc_len, nalu_size, payload_size);
+                return;
+            }
+
+            payload_decrypted[nalu_size + 0] = 0;
+            payload_decrypted[nalu_size + 1] = 0;
+            payload_decrypted[nalu_size + 2] = 0;
+            payload_decrypted[nalu_size + 3] = 1;
+            raop_rtp_mirror_index_nal(&h264_data, nalu_size + 4, nc_len);
+            nalu_size += nc_len + 4;
+        }
+        raop_rtp_mirror_classify(reader, &h264_data);
+        if (h264_data.frame_type == H264_FRAME_TYPE_IDR && reader->resolution_pending) {
+            h264_data.resolution_changed = 1;
+            reader->resolution_pending = 0;
+        }
+
+#ifdef DUMP_H264
+        fwrite(payload_decrypted, payload_size, 1, reader->file);
+#endif
+
+        remote = netutils_get_address(&raop_rtp_mirror->remote_saddr, &remote_len);
+        memcpy(&streamId, remote, 4);
+        raop_rtp_mirror_deliver(raop_rtp_mirror, reader, &h264_data, streamId);
+
+        sample.queue_depth = raop_rtp_mirror->frames ? (int) spsc_queue_count(raop_rtp_mirror->frames) : 0;
+        MUTEX_LOCK(raop_rtp_mirror->stats_mutex);
+        raop_rtp_mirror->samples[raop_rtp_mirror->sample_count++ % RAOP_RTP_MIRROR_STATS_WINDOW] = sample;
+        MUTEX_UNLOCK(raop_rtp_mirror->stats_mutex);
+
+    } else if ((payload_type & 255) == 1) {
+        // The information in the payload contains the parameter sets, which are not encrypted
+
+        float width_source = byteutils_get_float(packet, 40);
+        float height_source = byteutils_get_float(packet, 44);
+        float width = byteutils_get_float(packet, 56);
+        float height = byteutils_get_float(packet, 60);
+        LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror width_source = %f height_source = %f width = %f height = %f",
+                   width_source, height_source, width, height);
+
+        h264_decode_struct h264_data;
+        memset(&h264_data, 0, sizeof(h264_data));
+        video_stream_info info = reader->info;
+        int ret;
+        if (raop_rtp_mirror_is_hvcc(payload, payload_size)) {
+            h264_data.codec = VIDEO_CODEC_HEVC;
+            ret = raop_rtp_mirror_parse_hvcc(raop_rtp_mirror, payload, payload_size, &h264_data, &info);
+        } else {
+            h264_data.codec = VIDEO_CODEC_H264;
+            ret = raop_rtp_mirror_parse_avcc(raop_rtp_mirror, payload, payload_size, &h264_data, &info);
+        }
+        if (ret < 0) {
+            return;
+        }
+
+        // Keep the Annex-B copy for the decoder
+        free(reader->sps_pps);
+        reader->sps_pps = h264_data.data;
+
+#ifdef DUMP_H264
+        fwrite(h264_data.data, h264_data.data_len, 1, reader->file);
+#endif
+
+        if (info.valid && (!reader->info.valid || reader->codec != h264_data.codec ||
+                           info.width != reader->info.width || info.height != reader->info.height)) {
+            int level = h264_data.codec == VIDEO_CODEC_HEVC ? info.level_idc / 3 : info.level_idc;
+            logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
+                       "raop_rtp_mirror video %s %dx%d (coded %dx%d), profile %d level %d.%d, %u/%u fps, reorder %d",
+                       h264_data.codec == VIDEO_CODEC_HEVC ? "HEVC" : "H.264",
+                       info.width, info.height, info.coded_width, info.coded_height, info.profile_idc,
+                       level / 10, level % 10, info.fps_num, info.fps_den, info.reorder_frames);
+            h264_data.resolution_changed = 1;
+            reader->resolution_pending = 1;
+        }
+        reader->codec = h264_data.codec;
+        reader->info = info;
+        h264_data.info = info;
+        raop_rtp_mirror_classify(reader, &h264_data);
+
+        remote = netutils_get_address(&raop_rtp_mirror->remote_saddr, &remote_len);
+        memcpy(&streamId, remote, 4);
+        raop_rtp_mirror_deliver(raop_rtp_mirror, reader, &h264_data, streamId);
+    }
+}
+
+/* Moves the state machine on as far as the bytes received allow */
+static int
+raop_rtp_mirror_advance(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_reader_t *reader)
+{
+    for (;;) {
+        if (reader->state == RAOP_MIRROR_READ_HEADER) {
+            if (reader->filled < RAOP_MIRROR_HEADER_LEN) {
+                return 0;
+            }
+            int payload_size = (int) byteutils_get_int(reader->header, 0);
+            if (payload_size < 0 || payload_size > RAOP_MIRROR_MAX_PAYLOAD) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror invalid payload size %d", payload_size);
+                return -1;
+            }
+            // Read straight into a pooled frame that is decrypted and handed out in place
+            reader->payload_frame = mirror_buffer_acquire_frame(raop_rtp_mirror->buffer, payload_size, &reader->payload);
+            if (reader->payload_frame < 0) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror no frame buffer for %d bytes", payload_size);
+                return -1;
+            }
+            reader->payload_size = payload_size;
+            reader->state = RAOP_MIRROR_READ_PAYLOAD;
+            reader->filled = 0;
+        } else {
+            if (reader->filled < reader->payload_size) {
+                return 0;
+            }
+            raop_rtp_mirror_process_frame(raop_rtp_mirror, reader);
+            if (reader->payload) {
+                mirror_buffer_release_frame(raop_rtp_mirror->buffer, reader->payload_frame);
+                reader->payload = NULL;
+                reader->payload_frame = -1;
+            }
+            reader->state = RAOP_MIRROR_READ_HEADER;
+            reader->filled = 0;
+        }
+    }
+}
+
+/* Copies bytes that were read ahead into the frames they belong to */
+static int
+raop_rtp_mirror_feed(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_reader_t *reader, const unsigned char *data, int datalen)
+{
+    while (datalen > 0) {
+        unsigned char *target;
+        int missing;
+        if (reader->state == RAOP_MIRROR_READ_HEADER) {
+            target = reader->header + reader->filled;
+            missing = RAOP_MIRROR_HEADER_LEN - reader->filled;
+        } else {
+            target = reader->payload + reader->filled;
+            missing = reader->payload_size - reader->filled;
+        }
+        int count = datalen < missing ? datalen : missing;
+        memcpy(target, data, count);
+        reader->filled += count;
+        data += count;
+        datalen -= count;
+        if (raop_rtp_mirror_advance(raop_rtp_mirror, reader) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads until the socket has nothing more; returns 1 when the sender closed the stream, -1 on errors */
+static int
+raop_rtp_mirror_read_stream(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_reader_t *reader, int stream_fd)
+{
+    for (;;) {
+        struct iovec iov[2];
+        if (reader->state == RAOP_MIRROR_READ_HEADER) {
+            iov[0].iov_base = reader->header + reader->filled;
+            iov[0].iov_len = RAOP_MIRROR_HEADER_LEN - reader->filled;
+        } else {
+            iov[0].iov_base = reader->payload + reader->filled;
+            iov[0].iov_len = reader->payload_size - reader->filled;
+        }
+        // Whatever follows the current frame lands in the staging area
+        iov[1].iov_base = reader->staging;
+        iov[1].iov_len = RAOP_MIRROR_STAGING_LEN;
+
+#if defined(WIN32)
+        int ret = recv(stream_fd, iov[0].iov_base, iov[0].iov_len, 0);
+#else
+        ssize_t ret = readv(stream_fd, iov, 2);
+#endif
+        if (ret == 0) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror tcp socket closed");
+            return 1;
+        } else if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in recv: %d", errno);
+            return -1;
+        }
+
+        int direct = ret < (ssize_t) iov[0].iov_len ? (int) ret : (int) iov[0].iov_len;
+        reader->filled += direct;
+        if (raop_rtp_mirror_advance(raop_rtp_mirror, reader) < 0 ||
+            raop_rtp_mirror_feed(raop_rtp_mirror, reader, reader->staging, (int) ret - direct) < 0) {
+            return -1;
+        }
+    }
+}
+
+static int
+raop_rtp_mirror_accept(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+    struct sockaddr_storage saddr;
+    socklen_t saddrlen;
+    int stream_fd;
+
+    LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror accepting client");
+    saddrlen = sizeof(saddr);
+    stream_fd = accept(raop_rtp_mirror->mirror_data_sock, (struct sockaddr *)&saddr, &saddrlen);
+    if (stream_fd == -1) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in accept %d %s", errno, strerror(errno));
+        return -1;
+    }
+
+    // The stream is only ever read as far as the socket has data
+#if defined(WIN32)
+    u_long nonblocking = 1;
+    if (ioctlsocket(stream_fd, FIONBIO, &nonblocking) != 0) {
+#else
+    int flags = fcntl(stream_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(stream_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+#endif
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror could not make stream socket non-blocking %d %s", errno, strerror(errno));
+        closesocket(stream_fd);
+        return -1;
+    }
+    int option;
+    option = 1;
+    if (setsockopt(stream_fd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option)) < 0) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive %d %s", errno, strerror(errno));
+    }
+    option = 60;
+    if (setsockopt(stream_fd, SOL_TCP, TCP_KEEPIDLE, &option, sizeof(option)) < 0) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive time %d %s", errno, strerror(errno));
+    }
+    option = 10;
+    if (setsockopt(stream_fd, SOL_TCP, TCP_KEEPINTVL, &option, sizeof(option)) < 0) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive interval %d %s", errno, strerror(errno));
+    }
+    option = 6;
+    if (setsockopt(stream_fd, SOL_TCP, TCP_KEEPCNT, &option, sizeof(option)) < 0) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive probes %d %s", errno, strerror(errno));
+    }
+    return stream_fd;
+}
+
 /**
  * Mirror
  */
@@ -158,28 +959,44 @@ raop_rtp_mirror_thread(void *arg)
     assert(raop_rtp_mirror);
 
     int stream_fd = -1;
-    unsigned char packet[128];
-    memset(packet, 0 , 128);
-    unsigned char* sps_pps = NULL;
-    unsigned char* payload = NULL;
-    unsigned int readstart = 0;
-
-    int remote_len;
-    unsigned char* remote;
-    unsigned int streamId = 0;
+    raop_mirror_reader_t *reader = calloc(1, sizeof(raop_mirror_reader_t));
+    if (!reader) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror could not allocate stream reader");
+        goto thread_exit;
+    }
+    reader->state = RAOP_MIRROR_READ_HEADER;
+    reader->payload_frame = -1;
+    reader->gop_index = -1;
 
 #ifdef DUMP_H264
     // C decrypted
-    FILE* file = fopen("/home/pi/Airplay.h264", "wb");
+    reader->file = fopen("/home/pi/Airplay.h264", "wb");
     // Encrypted source file
-    FILE* file_source = fopen("/home/pi/Airplay.source", "wb");
-    FILE* file_len = fopen("/home/pi/Airplay.len", "wb");
+    reader->file_source = fopen("/home/pi/Airplay.source", "wb");
+    reader->file_len = fopen("/home/pi/Airplay.len", "wb");
+#endif
+
+#if defined(__linux__)
+    struct epoll_event events[3];
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error creating epoll instance");
+        goto thread_exit;
+    }
+    int fds[] = { raop_rtp_mirror->event_fd, raop_rtp_mirror->mirror_data_sock };
+    for (int i = 0; i < 2; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error adding socket to epoll");
+            close(epfd);
+            goto thread_exit;
+        }
+    }
 #endif
 
     while (1) {
-        fd_set rfds;
-        struct timeval tv;
-        int nfds, ret;
         MUTEX_LOCK(raop_rtp_mirror->run_mutex);
         if (!raop_rtp_mirror->running) {
             MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
@@ -187,6 +1004,33 @@ raop_rtp_mirror_thread(void *arg)
         }
         MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
+        int accept_ready = 0;
+        int stream_ready = 0;
+#if defined(__linux__)
+        /* Sleeps until data arrives or the thread is asked to stop */
+        int nfds = epoll_wait(epfd, events, 3, -1);
+        if (nfds == -1) {
+            if (errno == EINTR) continue;
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in epoll_wait");
+            break;
+        }
+        for (int n = 0; n < nfds; n++) {
+            if (events[n].data.fd == raop_rtp_mirror->event_fd) {
+                uint64_t value;
+                if (read(raop_rtp_mirror->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error reading event counter");
+                }
+            } else if (events[n].data.fd == raop_rtp_mirror->mirror_data_sock) {
+                accept_ready = 1;
+            } else if (events[n].data.fd == stream_fd) {
+                stream_ready = 1;
+            }
+        }
+#else
+        fd_set rfds;
+        struct timeval tv;
+        int nfds, ret;
+
         /* Set timeout value to 5ms */
         tv.tv_sec = 0;
         tv.tv_usec = 5000;
@@ -208,225 +1052,75 @@ raop_rtp_mirror_thread(void *arg)
             logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in select");
             break;
         }
+        accept_ready = (stream_fd == -1 && FD_ISSET(raop_rtp_mirror->mirror_data_sock, &rfds));
+        stream_ready = (stream_fd != -1 && FD_ISSET(stream_fd, &rfds));
+#endif
 
-        if (stream_fd == -1 && FD_ISSET(raop_rtp_mirror->mirror_data_sock, &rfds)) {
-            struct sockaddr_storage saddr;
-            socklen_t saddrlen;
-
-            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror accepting client");
-            saddrlen = sizeof(saddr);
-            stream_fd = accept(raop_rtp_mirror->mirror_data_sock, (struct sockaddr *)&saddr, &saddrlen);
+        if (accept_ready && stream_fd == -1) {
+            stream_fd = raop_rtp_mirror_accept(raop_rtp_mirror);
             if (stream_fd == -1) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in accept %d %s", errno, strerror(errno));
                 break;
             }
-
-            // We're calling recv for a certain amount of data, so we need a timeout
-            struct timeval tv;
-            tv.tv_sec = 0;
-            tv.tv_usec = 5000;
-            if (setsockopt(stream_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror could not set stream socket timeout %d %s", errno, strerror(errno));
+#if defined(__linux__)
+            /* Edge triggered, the reader always drains the socket; one sender at a time */
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.fd = stream_fd;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, raop_rtp_mirror->mirror_data_sock, NULL);
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, stream_fd, &ev) == -1) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error adding stream to epoll");
                 break;
             }
-            int option;
-            option = 1;
-            if (setsockopt(stream_fd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option)) < 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive %d %s", errno, strerror(errno));
-            }
-            option = 60;
-            if (setsockopt(stream_fd, SOL_TCP, TCP_KEEPIDLE, &option, sizeof(option)) < 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive time %d %s", errno, strerror(errno));
-            }
-            option = 10;
-            if (setsockopt(stream_fd, SOL_TCP, TCP_KEEPINTVL, &option, sizeof(option)) < 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive interval %d %s", errno, strerror(errno));
-            }
-            option = 6;
-            if (setsockopt(stream_fd, SOL_TCP, TCP_KEEPCNT, &option, sizeof(option)) < 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive probes %d %s", errno, strerror(errno));
-            }
-            readstart = 0;
+            /* Data may have arrived before the socket was watched */
+            stream_ready = 1;
+#endif
+            reader->state = RAOP_MIRROR_READ_HEADER;
+            reader->filled = 0;
         }
 
-        if (stream_fd != -1 && FD_ISSET(stream_fd, &rfds)) {
-
-            // The first 128 bytes are some kind of header for the payload that follows
-            while (payload == NULL && readstart < 128) {
-                ret = recv(stream_fd, packet + readstart, 128 - readstart, 0);
-                if (ret <= 0) break;
-                readstart = readstart + ret;
-            }
-
-            if (payload == NULL && ret == 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror tcp socket closed");
-                FD_CLR(stream_fd, &rfds);
-                stream_fd = -1;
-                continue;
-            } else if (payload == NULL && ret == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue; // Timeouts can happen even if the connection is fine
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in header recv: %d", errno);
+        if (stream_fd != -1 && stream_ready) {
+            int ret = raop_rtp_mirror_read_stream(raop_rtp_mirror, reader, stream_fd);
+            if (ret < 0) {
                 break;
-            }
-
-            int payload_size = byteutils_get_int(packet, 0);
-            unsigned short payload_type = byteutils_get_short(packet, 4) & 0xff;
-            unsigned short payload_option = byteutils_get_short(packet, 6);
-
-            if (payload == NULL) {
-                payload = malloc(payload_size);
-                readstart = 0;
-            }
-
-            while (readstart < payload_size) {
-                // Payload data
-                ret = recv(stream_fd, payload + readstart, payload_size - readstart, 0);
-                if (ret <= 0) break;
-                readstart = readstart + ret;
-            }
-
-            if (ret == 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror tcp socket closed");
-                break;
-            } else if (ret == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue; // Timeouts can happen even if the connection is fine
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in recv: %d", errno);
-                break;
-            }
-
-            if (payload_type == 0) {
-                // Normal video data (VCL NAL)
-
-                // Conveniently, the video data is already stamped with the remote wall clock time,
-                // so no additional clock syncing needed. The only thing odd here is that the video
-                // ntp time stamps don't include the SECONDS_FROM_1900_TO_1970, so it's really just
-                // counting micro seconds since last boot.
-                uint64_t ntp_timestamp_raw = byteutils_get_long(packet, 8);
-                uint64_t ntp_timestamp_remote = raop_ntp_timestamp_to_micro_seconds(ntp_timestamp_raw, false);
-                uint64_t ntp_timestamp = raop_ntp_convert_remote_time(raop_rtp_mirror->ntp, ntp_timestamp_remote);
-
-                uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror video ntp = %llu, now = %llu, latency = %lld",
-                           ntp_timestamp, ntp_now, ((int64_t) ntp_now) - ((int64_t) ntp_timestamp));
-
-#ifdef DUMP_H264
-                fwrite(payload, payload_size, 1, file_source);
-                fwrite(&readstart, sizeof(readstart), 1, file_len);
-#endif
-
-                // Decrypt data
-                unsigned char* payload_decrypted = malloc(payload_size);
-                mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload, payload_decrypted, payload_size);
-
-                int nalu_type = payload[4] & 0x1f;
-                int nalu_size = 0;
-                int nalus_count = 0;
-
-                // It seems the AirPlay protocol prepends NALs with their size, which we're replacing with the 4-byte
-                // start code for the NAL Byte-Stream Format.
-                while (nalu_size < payload_size) {
-                    int nc_len = (payload_decrypted[nalu_size + 0] << 24) | (payload_decrypted[nalu_size + 1] << 16) |
-                                 (payload_decrypted[nalu_size + 2] << 8) | (payload_decrypted[nalu_size + 3]);
-                    assert(nc_len > 0);
-
-                    payload_decrypted[nalu_size + 0] = 0;
-                    payload_decrypted[nalu_size + 1] = 0;
-                    payload_decrypted[nalu_size + 2] = 0;
-                    payload_decrypted[nalu_size + 3] = 1;
-                    nalu_size += nc_len + 4;
-                    nalus_count++;
+            } else if (ret > 0) {
+                /* Drop what was left of the frame and wait for the sender to reconnect */
+                if (reader->payload) {
+                    mirror_buffer_release_frame(raop_rtp_mirror->buffer, reader->payload_frame);
+                    reader->payload = NULL;
+                    reader->payload_frame = -1;
+                }
+                closesocket(stream_fd);
+                stream_fd = -1;
+#if defined(__linux__)
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.fd = raop_rtp_mirror->mirror_data_sock;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, raop_rtp_mirror->mirror_data_sock, &ev) == -1) {
+                    logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error adding socket to epoll");
+                    break;
                 }
-
-                // logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalutype = %d", nalu_type);
-                // logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu_size = %d, payloadsize = %d nalus_count = %d",
-                //        nalu_size, payload_size, nalus_count);
-
-#ifdef DUMP_H264
-                fwrite(payload_decrypted, payload_size, 1, file);
 #endif
+            }
+        }
+    }
 
-                h264_decode_struct h264_data;
-                h264_data.data_len = payload_size;
-                h264_data.data = payload_decrypted;
-                h264_data.frame_type = 1;
-                h264_data.pts = ntp_timestamp;
-
-                remote = netutils_get_address(&raop_rtp_mirror->remote_saddr, &remote_len);
-                memcpy(&streamId, remote, 4);
-                raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, &h264_data, streamId);
-                free(payload_decrypted);
-
-            } else if ((payload_type & 255) == 1) {
-                // The information in the payload contains an SPS and a PPS NAL
-
-                float width_source = byteutils_get_float(packet, 40);
-                float height_source = byteutils_get_float(packet, 44);
-                float width = byteutils_get_float(packet, 56);
-                float height = byteutils_get_float(packet, 60);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror width_source = %f height_source = %f width = %f height = %f",
-                           width_source, height_source, width, height);
-
-                // The sps_pps is not encrypted
-                h264codec_t h264;
-                h264.version = payload[0];
-                h264.profile_high = payload[1];
-                h264.compatibility = payload[2];
-                h264.level = payload[3];
-                h264.reserved_6_and_nal = payload[4];
-                h264.reserved_3_and_sps = payload[5];
-                h264.sps_size = (short) (((payload[6] & 255) << 8) + (payload[7] & 255));
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror sps size = %d", h264.sps_size);
-                h264.sequence_parameter_set = malloc(h264.sps_size);
-                memcpy(h264.sequence_parameter_set, payload + 8, h264.sps_size);
-                h264.number_of_pps = payload[h264.sps_size + 8];
-                h264.pps_size = (short) (((payload[h264.sps_size + 9] & 2040) + payload[h264.sps_size + 10]) & 255);
-                h264.picture_parameter_set = malloc(h264.pps_size);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror pps size = %d", h264.pps_size);
-                memcpy(h264.picture_parameter_set, payload + h264.sps_size + 11, h264.pps_size);
-
-                if (h264.sps_size + h264.pps_size < 102400) {
-                    // Copy the sps and pps into a buffer to hand to the decoder
-                    if (sps_pps) {
-                        free(sps_pps);
-                        sps_pps = NULL;
-                    }
-                    int sps_pps_len = (h264.sps_size + h264.pps_size) + 8;
-                    //unsigned char sps_pps[sps_pps_len];
-                    sps_pps = malloc(sps_pps_len);
-                    sps_pps[0] = 0;
-                    sps_pps[1] = 0;
-                    sps_pps[2] = 0;
-                    sps_pps[3] = 1;
-                    memcpy(sps_pps + 4, h264.sequence_parameter_set, h264.sps_size);
-                    sps_pps[h264.sps_size + 4] = 0;
-                    sps_pps[h264.sps_size + 5] = 0;
-                    sps_pps[h264.sps_size + 6] = 0;
-                    sps_pps[h264.sps_size + 7] = 1;
-                    memcpy(sps_pps + h264.sps_size + 8, h264.picture_parameter_set, h264.pps_size);
-
-#ifdef DUMP_H264
-                    fwrite(sps_pps, sps_pps_len, 1, file);
+#if defined(__linux__)
+    if (epfd != -1) close(epfd);
 #endif
 
-                    h264_decode_struct h264_data;
-                    h264_data.data_len = sps_pps_len;
-                    h264_data.data = sps_pps;
-                    h264_data.frame_type = 0;
-                    h264_data.pts = 0;
-
-                    remote = netutils_get_address(&raop_rtp_mirror->remote_saddr, &remote_len);
-                    memcpy(&streamId, remote, 4);
-                    raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, &h264_data, streamId);
-                }
-                free(h264.picture_parameter_set);
-                free(h264.sequence_parameter_set);
-            }
-
-            free(payload);
-            payload = NULL;
-            memset(packet, 0, 128);
-            readstart = 0;
+    thread_exit:
+    if (reader) {
+        if (reader->payload) {
+            mirror_buffer_release_frame(raop_rtp_mirror->buffer, reader->payload_frame);
         }
+        free(reader->sps_pps);
+        free(reader->pending_config.h264.data);
+#ifdef DUMP_H264
+        fclose(reader->file);
+        fclose(reader->file_source);
+        fclose(reader->file_len);
+#endif
+        free(reader);
     }
 
     /* Close the stream file descriptor */
@@ -434,22 +1128,116 @@ raop_rtp_mirror_thread(void *arg)
         closesocket(stream_fd);
     }
 
-#ifdef DUMP_H264
-        fclose(file);
-    fclose(file_source);
-    fclose(file_len);
-#endif
-
     // Ensure running reflects the actual state
     MUTEX_LOCK(raop_rtp_mirror->run_mutex);
     raop_rtp_mirror->running = false;
     MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
-    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror exiting TCP thread");
+    LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror exiting TCP thread");
 
     return 0;
 }
 
+void
+raop_rtp_mirror_set_queue_depth(raop_rtp_mirror_t *raop_rtp_mirror, int depth)
+{
+    assert(raop_rtp_mirror);
+
+    if (depth < 0) depth = 0;
+    if (depth > RAOP_RTP_MIRROR_MAX_QUEUE_DEPTH) depth = RAOP_RTP_MIRROR_MAX_QUEUE_DEPTH;
+    raop_rtp_mirror->queue_depth = (unsigned int) depth;
+}
+
+static int
+raop_rtp_mirror_compare(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int64_t
+raop_rtp_mirror_percentile(const int64_t *sorted, int count, int percentile)
+{
+    return sorted[(count - 1) * percentile / 100];
+}
+
+void
+raop_rtp_mirror_get_stats(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_stats_t *stats)
+{
+    raop_mirror_sample_t samples[RAOP_RTP_MIRROR_STATS_WINDOW];
+    uint32_t callback_times[RAOP_RTP_MIRROR_STATS_WINDOW];
+    int64_t values[RAOP_RTP_MIRROR_STATS_WINDOW];
+
+    assert(raop_rtp_mirror);
+    assert(stats);
+
+    memset(stats, 0, sizeof(raop_mirror_stats_t));
+    stats->queued = atomic_load_explicit(&raop_rtp_mirror->frames_queued, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&raop_rtp_mirror->frames_dropped, memory_order_relaxed);
+    stats->delivered = atomic_load_explicit(&raop_rtp_mirror->frames_delivered, memory_order_relaxed);
+
+    /* Copy the windows out so the threads recording are held up as little as possible */
+    MUTEX_LOCK(raop_rtp_mirror->stats_mutex);
+    unsigned int sample_count = raop_rtp_mirror->sample_count;
+    int count = sample_count < RAOP_RTP_MIRROR_STATS_WINDOW ? (int) sample_count : RAOP_RTP_MIRROR_STATS_WINDOW;
+    memcpy(samples, raop_rtp_mirror->samples, count * sizeof(raop_mirror_sample_t));
+    unsigned int callback_count = raop_rtp_mirror->callback_count;
+    int callbacks = callback_count < RAOP_RTP_MIRROR_STATS_WINDOW ? (int) callback_count : RAOP_RTP_MIRROR_STATS_WINDOW;
+    memcpy(callback_times, raop_rtp_mirror->callback_times, callbacks * sizeof(uint32_t));
+    MUTEX_UNLOCK(raop_rtp_mirror->stats_mutex);
+
+    if (count > 0) {
+        int first = (sample_count - count) % RAOP_RTP_MIRROR_STATS_WINDOW;
+        int last = (sample_count - 1) % RAOP_RTP_MIRROR_STATS_WINDOW;
+        uint64_t bytes = 0;
+        uint64_t decrypt = 0;
+        for (int i = 0; i < count; i++) {
+            bytes += samples[i].size;
+            decrypt += samples[i].decrypt_time;
+            if (samples[i].decrypt_time > stats->decrypt_max) stats->decrypt_max = samples[i].decrypt_time;
+            if (samples[i].queue_depth > stats->queue_depth_max) stats->queue_depth_max = samples[i].queue_depth;
+        }
+        stats->window_frames = count;
+        stats->frame_size_avg = (int) (bytes / count);
+        stats->decrypt_avg = (uint32_t) (decrypt / count);
+        stats->queue_depth = samples[last].queue_depth;
+
+        /* Rates over the time between the first and the last arrival, which the first frame does not add to */
+        uint64_t span = samples[last].arrival - samples[first].arrival;
+        if (count > 1 && samples[last].arrival > samples[first].arrival) {
+            stats->frame_rate = (count - 1) * 1000000.0 / span;
+            stats->bitrate = (bytes - samples[first].size) * 8 * 1000000.0 / span;
+        }
+
+        for (int i = 0; i < count; i++) {
+            values[i] = samples[i].size;
+        }
+        qsort(values, count, sizeof(int64_t), raop_rtp_mirror_compare);
+        stats->frame_size_p50 = (int) raop_rtp_mirror_percentile(values, count, 50);
+        stats->frame_size_p95 = (int) raop_rtp_mirror_percentile(values, count, 95);
+        stats->frame_size_max = (int) values[count - 1];
+
+        for (int i = 0; i < count; i++) {
+            values[i] = samples[i].latency;
+        }
+        qsort(values, count, sizeof(int64_t), raop_rtp_mirror_compare);
+        stats->latency_p50 = raop_rtp_mirror_percentile(values, count, 50);
+        stats->latency_p95 = raop_rtp_mirror_percentile(values, count, 95);
+        stats->latency_p99 = raop_rtp_mirror_percentile(values, count, 99);
+        stats->latency_max = values[count - 1];
+    }
+
+    if (callbacks > 0) {
+        uint64_t total = 0;
+        for (int i = 0; i < callbacks; i++) {
+            total += callback_times[i];
+            if (callback_times[i] > stats->callback_max) stats->callback_max = callback_times[i];
+        }
+        stats->callback_avg = (uint32_t) (total / callbacks);
+    }
+}
+
 void
 raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, int use_udp, unsigned short *mirror_data_lport)
 {
@@ -475,6 +1263,23 @@ raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, int use_udp, unsigned
     }
     if (mirror_data_lport) *mirror_data_lport = raop_rtp_mirror->mirror_data_lport;
 
+    /* Every session starts its statistics afresh */
+    MUTEX_LOCK(raop_rtp_mirror->stats_mutex);
+    raop_rtp_mirror->sample_count = 0;
+    raop_rtp_mirror->callback_count = 0;
+    MUTEX_UNLOCK(raop_rtp_mirror->stats_mutex);
+
+    /* Decouple video_process from the socket when asked to */
+    if (raop_rtp_mirror->queue_depth > 0) {
+        raop_rtp_mirror->frames = spsc_queue_init(raop_rtp_mirror->queue_depth, sizeof(raop_mirror_frame_t));
+        if (raop_rtp_mirror->frames) {
+            atomic_store(&raop_rtp_mirror->delivery_quit, 0);
+            THREAD_CREATE(raop_rtp_mirror->thread_delivery, raop_rtp_mirror_delivery_thread, raop_rtp_mirror);
+        } else {
+            logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not create frame queue, delivering directly");
+        }
+    }
+
     /* Create the thread and initialize running values */
     raop_rtp_mirror->running = 1;
     raop_rtp_mirror->joined = 0;
@@ -495,6 +1300,7 @@ void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror) {
     }
     raop_rtp_mirror->running = 0;
     MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
+    raop_rtp_mirror_wakeup(raop_rtp_mirror);
 
     if (raop_rtp_mirror->mirror_data_sock != -1) {
         closesocket(raop_rtp_mirror->mirror_data_sock);
@@ -504,6 +1310,33 @@ void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror) {
     /* Join the thread */
     THREAD_JOIN(raop_rtp_mirror->thread_mirror);
 
+    /* Then the delivery thread, nothing is queued any more */
+    if (raop_rtp_mirror->frames) {
+        raop_mirror_frame_t frame;
+        MUTEX_LOCK(raop_rtp_mirror->delivery_mutex);
+        atomic_store(&raop_rtp_mirror->delivery_quit, 1);
+        COND_SIGNAL(raop_rtp_mirror->delivery_cond);
+        MUTEX_UNLOCK(raop_rtp_mirror->delivery_mutex);
+        THREAD_JOIN(raop_rtp_mirror->thread_delivery);
+
+        while (spsc_queue_pop(raop_rtp_mirror->frames, &frame) == 0) {
+            raop_rtp_mirror_release(raop_rtp_mirror, &frame);
+            atomic_fetch_add_explicit(&raop_rtp_mirror->frames_dropped, 1, memory_order_relaxed);
+        }
+        spsc_queue_destroy(raop_rtp_mirror->frames);
+        raop_rtp_mirror->frames = NULL;
+    }
+
+    raop_mirror_stats_t stats;
+    raop_rtp_mirror_get_stats(raop_rtp_mirror, &stats);
+    LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror frame stats: queued=%llu, dropped=%llu, delivered=%llu",
+               stats.queued, stats.dropped, stats.delivered);
+    LOGGER_LOG(raop_rtp_mirror->logger, LOGGER_DEBUG,
+               "raop_rtp_mirror last %d frames: %.1f fps, %.0f kbit/s, latency p50=%lld p95=%lld p99=%lld us, "
+               "decrypt avg=%u us, video_process avg=%u max=%u us, queue max=%d",
+               stats.window_frames, stats.frame_rate, stats.bitrate / 1000.0, stats.latency_p50, stats.latency_p95,
+               stats.latency_p99, stats.decrypt_avg, stats.callback_avg, stats.callback_max, stats.queue_depth_max);
+
     /* Mark thread as joined */
     MUTEX_LOCK(raop_rtp_mirror->run_mutex);
     raop_rtp_mirror->joined = 1;
@@ -514,6 +1347,12 @@ void raop_rtp_mirror_destroy(raop_rtp_mirror_t *raop_rtp_mirror) {
     if (raop_rtp_mirror) {
         raop_rtp_mirror_stop(raop_rtp_mirror);
         MUTEX_DESTROY(raop_rtp_mirror->run_mutex);
+        MUTEX_DESTROY(raop_rtp_mirror->stats_mutex);
+        MUTEX_DESTROY(raop_rtp_mirror->delivery_mutex);
+        COND_DESTROY(raop_rtp_mirror->delivery_cond);
+#if defined(__linux__)
+        close(raop_rtp_mirror->event_fd);
+#endif
         mirror_buffer_destroy(raop_rtp_mirror->buffer);
         free(raop_rtp_mirror);
     }
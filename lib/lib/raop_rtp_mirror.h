@@ -23,10 +23,17 @@
 typedef struct raop_rtp_mirror_s raop_rtp_mirror_t;
 typedef struct h264codec_s h264codec_t;
 
+/* Frames the rolling statistics look back over */
+#define RAOP_RTP_MIRROR_STATS_WINDOW 256
+
 raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp,
                                         const unsigned char *remote, int remotelen,
                                         const unsigned char *aeskey, const unsigned char *ecdh_secret);
 void raop_rtp_init_mirror_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t streamConnectionID);
+/* Frames buffered between the socket and video_process, 0 calls video_process on the network thread.
+ * Only takes effect on the next start */
+void raop_rtp_mirror_set_queue_depth(raop_rtp_mirror_t *raop_rtp_mirror, int depth);
+void raop_rtp_mirror_get_stats(raop_rtp_mirror_t *raop_rtp_mirror, raop_mirror_stats_t *stats);
 void raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, int use_udp, unsigned short *mirror_data_lport);
 
 static int raop_rtp_init_mirror_sockets(raop_rtp_mirror_t *raop_rtp_mirror, int use_ipv6);
@@ -0,0 +1,116 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+/*
+ * Ring buffer with one index owned by each side. The producer publishes an
+ * element by storing the tail with release order after copying it in, and
+ * the consumer hands the slot back the same way through the head, so
+ * neither side ever waits for the other.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "spsc_queue.h"
+
+/* Keeps the two indexes on separate cache lines */
+#define SPSC_QUEUE_CACHE_LINE 64
+
+struct spsc_queue_s {
+    unsigned int mask;
+    size_t element_size;
+    unsigned char *elements;
+
+    /* Next slot to read, written by the consumer only */
+    _Alignas(SPSC_QUEUE_CACHE_LINE) atomic_uint head;
+    /* Next slot to write, written by the producer only */
+    _Alignas(SPSC_QUEUE_CACHE_LINE) atomic_uint tail;
+};
+
+spsc_queue_t *
+spsc_queue_init(unsigned int capacity, size_t element_size)
+{
+    spsc_queue_t *spsc_queue;
+    unsigned int size = 1;
+
+    assert(capacity > 0);
+    assert(element_size > 0);
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    spsc_queue = calloc(1, sizeof(spsc_queue_t));
+    if (!spsc_queue) {
+        return NULL;
+    }
+    spsc_queue->elements = malloc(size * element_size);
+    if (!spsc_queue->elements) {
+        free(spsc_queue);
+        return NULL;
+    }
+    spsc_queue->mask = size - 1;
+    spsc_queue->element_size = element_size;
+    atomic_init(&spsc_queue->head, 0);
+    atomic_init(&spsc_queue->tail, 0);
+    return spsc_queue;
+}
+
+int
+spsc_queue_push(spsc_queue_t *spsc_queue, const void *element)
+{
+    assert(spsc_queue);
+
+    unsigned int tail = atomic_load_explicit(&spsc_queue->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&spsc_queue->head, memory_order_acquire);
+    if (tail - head > spsc_queue->mask) {
+        return -1;
+    }
+    memcpy(spsc_queue->elements + (tail & spsc_queue->mask) * spsc_queue->element_size, element, spsc_queue->element_size);
+    atomic_store_explicit(&spsc_queue->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+int
+spsc_queue_pop(spsc_queue_t *spsc_queue, void *element)
+{
+    assert(spsc_queue);
+
+    unsigned int head = atomic_load_explicit(&spsc_queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&spsc_queue->tail, memory_order_acquire);
+    if (head == tail) {
+        return -1;
+    }
+    memcpy(element, spsc_queue->elements + (head & spsc_queue->mask) * spsc_queue->element_size, spsc_queue->element_size);
+    atomic_store_explicit(&spsc_queue->head, head + 1, memory_order_release);
+    return 0;
+}
+
+unsigned int
+spsc_queue_count(spsc_queue_t *spsc_queue)
+{
+    assert(spsc_queue);
+
+    return atomic_load_explicit(&spsc_queue->tail, memory_order_acquire) -
+           atomic_load_explicit(&spsc_queue->head, memory_order_acquire);
+}
+
+void
+spsc_queue_destroy(spsc_queue_t *spsc_queue)
+{
+    if (spsc_queue) {
+        free(spsc_queue->elements);
+        free(spsc_queue);
+    }
+}
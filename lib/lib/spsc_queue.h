@@ -0,0 +1,31 @@
+/**
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+
+/* Bounded lock-free queue of fixed size elements between exactly one producer and one consumer thread */
+typedef struct spsc_queue_s spsc_queue_t;
+
+/* Capacity is rounded up to a power of two */
+spsc_queue_t *spsc_queue_init(unsigned int capacity, size_t element_size);
+/* Producer side, copies the element in; returns -1 without waiting when full */
+int spsc_queue_push(spsc_queue_t *spsc_queue, const void *element);
+/* Consumer side, copies the oldest element out; returns -1 when empty */
+int spsc_queue_pop(spsc_queue_t *spsc_queue, void *element);
+/* Elements queued, exact only on the consumer side */
+unsigned int spsc_queue_count(spsc_queue_t *spsc_queue);
+void spsc_queue_destroy(spsc_queue_t *spsc_queue);
+
+#endif
@@ -17,14 +17,59 @@
 
 #include <stdint.h>
 
+/* Values of h264_decode_struct.codec */
+#define VIDEO_CODEC_H264 0
+#define VIDEO_CODEC_HEVC 1
+
+/* Values of h264_decode_struct.frame_type, IDR stands for any HEVC random access point */
+#define H264_FRAME_TYPE_PARAMETER_SETS 0 // Only SPS / PPS, and VPS for HEVC
+#define H264_FRAME_TYPE_NON_IDR 1
+#define H264_FRAME_TYPE_IDR 2
+
+/* NAL units indexed per frame, any beyond are not listed */
+#define H264_MAX_NAL_UNITS 32
+
+typedef struct {
+    int offset; // Of the NAL header in data, just past the start code
+    int length; // Without the start code
+    unsigned char type; // nal_unit_type
+    unsigned char ref_idc; // nal_ref_idc, for HEVC 1 unless a sub-layer non-reference picture
+} h264_nal_unit;
+
+/* Stream parameters taken from the SPS and PPS */
 typedef struct {
-    int n_gop_index;
+    int valid; // Nothing else is meaningful before the first SPS
+    int profile_idc;
+    int constraint_flags; // constraint_set0_flag in the top bit
+    int level_idc; // Ten times the level, thirty times for HEVC
+    int chroma_format_idc;
+    int bit_depth;
+    int coded_width; // Whole macroblocks, as the decoder allocates them
+    int coded_height;
+    int width; // Inside the cropping window, as displayed
+    int height;
+    int sar_width; // Sample aspect ratio, 0 when not signalled
+    int sar_height;
+    int max_ref_frames;
+    int reorder_frames; // Frames held back to restore output order, -1 when not signalled
+    unsigned int fps_num; // Frame rate from the VUI timing, fps_den is 0 when unknown
+    unsigned int fps_den;
+    int cabac; // entropy_coding_mode_flag of the PPS
+} video_stream_info;
+
+typedef struct {
+    int n_gop_index; // Counts IDR frames since the stream started, -1 before the first
+    int codec;
     int frame_type;
-    int n_frame_poc;
+    int n_frame_poc; // Frames since the last IDR in decode order, 0 for the IDR itself
     unsigned char *data;
     int data_len;
     unsigned int n_time_stamp;
     uint64_t pts;
+    int nal_count;
+    h264_nal_unit nal_units[H264_MAX_NAL_UNITS];
+    video_stream_info info; // Of the parameter sets the frame is coded with
+    int resolution_changed; // Set on the parameter sets and the IDR that start a new size
 } h264_decode_struct;
 
 typedef struct {
@@ -33,4 +78,13 @@ typedef struct {
     uint64_t pts;
 } aac_decode_struct;
 
+typedef struct {
+    short *data; // Interleaved 16 bit samples
+    int data_len; // In bytes
+    int frame_size; // Samples per channel
+    int channels;
+    int sample_rate;
+    uint64_t pts;
+} pcm_decode_struct;
+
 #endif //AIRPLAYSERVER_STREAM_H